@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2026 The jsr-d10 Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RIL_INSTANCE_H
+#define RIL_INSTANCE_H
+
+#include <stddef.h>
+#include <telephony/ril.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Multi-instance extension of the libril daemon interface, for hosting
+ * several vendor RIL instances (SIM slots) in one rild process.
+ *
+ * Every instance gets its own command socket, "rild" for instance 0 and
+ * "rild<N>" otherwise, while the event loop, the dispatch thread and the
+ * debug port are shared. RIL_register() stays equivalent to registering
+ * the instance named by RIL_setRilSocketName().
+ *
+ * All instances must use the same RIL version.
+ */
+void RIL_registerInstance(const RIL_RadioFunctions *callbacks, int instance);
+
+/**
+ * RIL_onUnsolicitedResponse() for a given instance. The RIL_Env handed
+ * to a secondary instance must route its unsolicited responses here;
+ * solicited completions find their instance through the RIL_Token.
+ */
+void RIL_onUnsolicitedResponseInstance(int instance, int unsolResponse,
+        const void *data, size_t datalen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RIL_INSTANCE_H */
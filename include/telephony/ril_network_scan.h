@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2026 The jsr-d10 Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RIL_NETWORK_SCAN_H
+#define RIL_NETWORK_SCAN_H
+
+#include <stddef.h>
+#include <telephony/ril.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Incremental results of RIL_REQUEST_QUERY_AVAILABLE_NETWORKS.
+ *
+ * While the scan started by token t is running, the vendor RIL may
+ * report the operators found so far. "data" has the same layout as
+ * the final response, a char ** of 4 strings per operator (5 with
+ * NEW_LIBRIL_HTC), and only needs to hold the operators not reported
+ * before. It is copied before the call returns.
+ *
+ * Partial results are forwarded to clients that enabled the network
+ * scan feature of libril; everyone else only sees the final response,
+ * which must still carry the complete list.
+ *
+ * Returns 0 if the results were forwarded, -1 if the client does not
+ * take partial results or t is no longer pending.
+ */
+int RIL_onNetworkScanResult(RIL_Token t, const void *data, size_t datalen);
+
+/**
+ * Returns non-zero if partial results for the scan started by token t
+ * would be forwarded, letting the vendor skip the bookkeeping for
+ * clients that only want the final list.
+ */
+int RIL_isNetworkScanStreamingEnabled(RIL_Token t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RIL_NETWORK_SCAN_H */
@@ -18,6 +18,9 @@ LOCAL_SHARED_LIBRARIES := \
     librilutils
 
 LOCAL_CFLAGS :=
+# constexpr request tables, validated with static_assert
+LOCAL_CPPFLAGS := -std=gnu++11
+
 ifdef BOARD_USE_NEW_LIBRIL_HTC
     LOCAL_CFLAGS += -DNEW_LIBRIL_HTC
 endif
@@ -56,6 +59,7 @@ LOCAL_STATIC_LIBRARIES := \
     librilutils_static
 
 LOCAL_CFLAGS :=
+LOCAL_CPPFLAGS := -std=gnu++11
 
 LOCAL_MODULE:= libril_static
 
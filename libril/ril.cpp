@@ -29,6 +29,7 @@ char g_log_tag[12] = "RILC_x";
 #include <telephony/record_stream.h>
 #include <utils/Log.h>
 #include <utils/SystemClock.h>
+#include <utils/Timers.h>
 #include <pthread.h>
 #include <binder/Parcel.h>
 #include <cutils/jstring.h>
@@ -49,9 +50,17 @@ char g_log_tag[12] = "RILC_x";
 #include <ctype.h>
 #include <alloca.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <assert.h>
 #include <netinet/in.h>
 #include <cutils/properties.h>
+#include <cutils/ashmem.h>
+#include <private/android_filesystem_config.h>
+#include <telephony/ril_instance.h>
+#include <telephony/ril_network_scan.h>
 
 #include <ril_event.h>
 
@@ -62,6 +71,23 @@ namespace android {
 #define SOCKET_NAME_RIL "rild"
 #define SOCKET_NAME_RIL_DEBUG "rild-debug"
 
+// RIL instances (SIM slots) one process can host, see RIL_registerInstance()
+#define MAX_RIL_INSTANCES 3
+
+// Longest wait for the modem readiness probe when ro.ril.delay_N is unset
+#define DEFAULT_READY_TIMEOUT_MS 10000
+
+// State checkpoint file, see checkpointOpen()
+#define DEFAULT_CHECKPOINT_DIR "/data/misc/radio"
+#define CHECKPOINT_MAGIC 0x52494c43     // "RILC"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_BOOT_ID_BYTES 40  // a UUID string, NUL terminated
+#define CHECKPOINT_REPLAY_SLOTS 8
+#define CHECKPOINT_REPLAY_BYTES 1024
+#define CHECKPOINT_NITZ_BYTES 256
+// Replayed unsolicited responses older than this are stale
+#define CHECKPOINT_REPLAY_MAX_AGE_MS 60000
+
 #define ANDROID_WAKE_LOCK_NAME "radio-interface"
 
 
@@ -82,10 +108,94 @@ namespace android {
 /* Constants for response types */
 #define RESPONSE_SOLICITED 0
 #define RESPONSE_UNSOLICITED 1
+/* Response moved to shared memory: the record holds the payload size
+   and carries an ashmem fd with the actual response, see
+   sendResponseShared(). Only sent to clients that negotiated
+   LIBRIL_FEATURE_SHARED_MEMORY. */
+#define RESPONSE_SHARED_MEMORY 2
 
 /* Negative values for private RIL errno's */
 #define RIL_ERRNO_INVALID_RESPONSE -1
 
+/* libril private requests and unsolicited responses. They are handled
+   by libril itself, never reach the vendor RIL, and are only used with
+   clients that negotiated the matching feature. */
+#define RIL_LIBRIL_REQUEST_BASE 0x7f00
+#define RIL_REQUEST_LIBRIL_SET_FEATURES (RIL_LIBRIL_REQUEST_BASE + 0)
+
+#define RIL_LIBRIL_UNSOL_BASE 0x7f80
+#define RIL_UNSOL_LIBRIL_CELL_INFO_DELTA (RIL_LIBRIL_UNSOL_BASE + 0)
+#define RIL_UNSOL_LIBRIL_NETWORK_SCAN_RESULT (RIL_LIBRIL_UNSOL_BASE + 1)
+
+/* Feature bits for RIL_REQUEST_LIBRIL_SET_FEATURES. The response holds
+   the subset that was enabled, so a client learns what this libril
+   supports by asking for every bit it knows. */
+#define LIBRIL_FEATURE_CELL_INFO_DELTA (1 << 0)
+#define LIBRIL_FEATURE_NEIGHBORING_CELL_DELTA (1 << 1)
+#define LIBRIL_FEATURE_NETWORK_SCAN_RESULT (1 << 2)
+#define LIBRIL_FEATURE_SHARED_MEMORY (1 << 3)
+#define LIBRIL_FEATURES_SUPPORTED \
+    (LIBRIL_FEATURE_CELL_INFO_DELTA | LIBRIL_FEATURE_NEIGHBORING_CELL_DELTA \
+     | LIBRIL_FEATURE_NETWORK_SCAN_RESULT | LIBRIL_FEATURE_SHARED_MEMORY)
+
+// Datagrams moved per recvmmsg()/sendmmsg() on a SOCK_SEQPACKET connection
+#define SEQPACKET_BATCH 8
+
+// Responses above this size go through shared memory when negotiated
+#define DEFAULT_SHARED_MEMORY_THRESHOLD (4 * 1024)
+
+// Cells tracked per delta encoded list, longer lists are sent in full
+#define MAX_CELL_DELTA_SLOTS 64
+#define MAX_NEIGHBOR_CID_LEN 16
+
+/* Flags word leading a delta encoded cell list */
+#define CELL_DELTA_FULL (1 << 0)
+
+// Error returned for requests refused by admission control.
+// RIL.java has no "busy" errno, so this maps onto the generic failure.
+#define RIL_E_ADMISSION_REJECTED RIL_E_GENERIC_FAILURE
+
+// Upper bound on requests held back by admission control when it is
+// configured to queue instead of reject
+#define DEFAULT_MAX_DEFERRED_REQUESTS 64
+
+// RequestInfos kept for reuse instead of going back to the heap
+#define MAX_FREE_REQUEST_INFOS 16
+
+// SMS pipeline: parts at the vendor per instance and bytes of
+// completions coalesced into one write, see smsPipelineAdmit(). Off
+// unless ro.ril.sms_pipeline_depth is set, it only pays off for clients
+// that send parts without waiting for the previous response
+#define DEFAULT_SMS_PIPELINE_DEPTH 0
+#define SMS_BATCH_BYTES 4096
+
+// Debug port limits: concurrent clients, bytes buffered per client,
+// args per record and size of an introspection reply
+#define MAX_DEBUG_CLIENTS 2
+#define MAX_DEBUG_RECORD_BYTES 1024
+#define MAX_DEBUG_ARGS 16
+#define MAX_DEBUG_REPLY_BYTES (16 * 1024)
+
+// Debug port introspection commands, replies are int32 length + text
+#define DEBUG_CMD_PENDING 11
+#define DEBUG_CMD_QUEUES 12
+#define DEBUG_CMD_TIMERS 13
+#define DEBUG_CMD_WAKELOCK 14
+#define DEBUG_CMD_LATENCY 15
+#define DEBUG_CMD_METRICS 16
+#define DEBUG_CMD_LOOP_PROFILE 17
+
+// Callback profiles and slow callback records in a loop profile reply
+#define MAX_DEBUG_PROFILES 16
+#define MAX_DEBUG_SLOW_RECORDS 8
+
+// Default period of the metrics snapshot file, see metricsSnapshotThread()
+#define DEFAULT_METRICS_INTERVAL_SEC 60
+
+// Request latency histogram: bucket n counts completions under 2^n ms,
+// the last bucket everything slower
+#define LATENCY_BUCKETS 16
+
 // request, response, and unsolicited msg print macro
 #define PRINTBUF_SIZE 8096
 
@@ -119,24 +229,40 @@ namespace android {
 
 enum WakeType {DONT_WAKE, WAKE_PARTIAL};
 
+// Critical requests bypass the global admission limit and deferred queue
+enum RequestPriority {PRIORITY_NORMAL, PRIORITY_CRITICAL};
+
+/* A NULL dispatchFunction / responseFunction marks a request or
+   unsolicited response compiled out of this build */
 typedef struct {
     int requestNumber;
     void (*dispatchFunction) (Parcel &p, struct RequestInfo *pRI);
     int(*responseFunction) (Parcel &p, void *response, size_t responselen);
+    RequestPriority priority;
+    const char *name;
 } CommandInfo;
 
 typedef struct {
     int requestNumber;
     int (*responseFunction) (Parcel &p, void *response, size_t responselen);
     WakeType wakeType;
+    const char *name;
 } UnsolResponseInfo;
 
+typedef struct ErrnoInfo {
+    int error;
+    const char *name;
+} ErrnoInfo;
+
 typedef struct RequestInfo {
     int32_t token;      //this is not RIL_Token
-    CommandInfo *pCI;
+    const CommandInfo *pCI;
     struct RequestInfo *p_next;
     char cancelled;
     char local;         // responses to local commands do not go back to command process
+    nsecs_t startTime;  // monotonic time the request went to the vendor RIL
+    struct RilInstance *pInstance;  // instance whose socket the request came from
+    bool smsPart;       // holds an SMS pipeline slot, see smsIsPipelinePart()
 } RequestInfo;
 
 typedef struct UserCallbackInfo {
@@ -146,6 +272,105 @@ typedef struct UserCallbackInfo {
     struct UserCallbackInfo *p_next;
 } UserCallbackInfo;
 
+typedef struct CellInfoSlot {
+    bool used;
+    RIL_CellInfo cell;
+} CellInfoSlot;
+
+typedef struct NeighborSlot {
+    bool used;
+    int rssi;
+    char cid[MAX_NEIGHBOR_CID_LEN];
+} NeighborSlot;
+
+/* A command record held back by admission control, owned copy */
+typedef struct DeferredRequest {
+    int32_t request;
+    void *buffer;
+    size_t buflen;
+    struct RilInstance *pInstance;
+    bool smsPart;
+    struct DeferredRequest *p_next;
+} DeferredRequest;
+
+/**
+ * Per-socket state of one hosted RIL instance. The event loop, the
+ * dispatch tables, admission control and the writer lock are shared by
+ * all instances of the process.
+ */
+typedef struct RilInstance {
+    int id;
+    char socketName[MAX_SOCKET_NAME_LENGTH];
+    bool registered;
+    RIL_RadioFunctions callbacks;
+
+    int fdListen;
+    int fdCommand;
+    RecordStream *p_rs;
+    struct ril_event listen_event;
+    struct ril_event commands_event;
+
+    /* "<socket>-seq" SOCK_SEQPACKET listen socket, -1 if unavailable.
+       A client connecting there exchanges one record per datagram
+       without length prefixes; seqpacket is set for that connection. */
+    int fdListenSeq;
+    struct ril_event listen_seq_event;
+    bool seqpacket;
+
+    void *lastNITZTimeData;
+    size_t lastNITZTimeDataSize;
+
+    /* LIBRIL_FEATURE_* bits enabled by the connected client,
+       cleared on every new connection */
+    volatile uint32_t clientFeatures;
+
+    /* Cells and neighbours last sent to the client in delta form,
+       protected by s_cellDeltaMutex */
+    CellInfoSlot cellInfoSlots[MAX_CELL_DELTA_SLOTS];
+    NeighborSlot neighborSlots[MAX_CELL_DELTA_SLOTS];
+
+    /* Modem readiness probe gating the listen socket, see armWhenReady().
+       Times are elapsedRealtime() ms. */
+    char readyNode[PROPERTY_VALUE_MAX];
+    char readyProp[PROPERTY_VALUE_MAX];
+    int64_t readyDeadline;
+    int64_t registerTime;
+    int64_t readyTime;
+    bool firstRequestSeen;
+
+    // unsolicited responses restored from a checkpoint, not yet replayed
+    bool replayPending;
+
+    /* SMS pipeline, protected by s_smsMutex: parts of the multipart send
+       being received, parts at the vendor, parts queued behind them and
+       completions not yet written */
+    bool smsMoreExpected;
+    int smsInFlight;
+    DeferredRequest *smsQueueHead;
+    DeferredRequest *smsQueueTail;
+    int smsQueued;
+    bool smsDrainScheduled;
+    bool smsFlushScheduled;
+    size_t smsBatchLen;
+    uint8_t smsBatch[SMS_BATCH_BYTES];
+
+    /* Values decoded from the radio state for older RILs that do not
+       support RIL_REQUEST_VOICE_RADIO_TECH, RIL_REQUEST_GET_CDMA_SUBSCRIPTION_SOURCE
+       or RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, see processRadioState() */
+    int voiceRadioTech;
+    int cdmaSubscriptionSource;
+    int simRuimStatus;
+
+    /* Radio state cache, protected by s_radioStateMutex: the state the
+       vendor last reported through RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED
+       and the one sent to the client after processRadioState(). Valid
+       once the vendor reported a state; all three, and the derived
+       fields above, are updated together. */
+    bool radioStateValid;
+    RIL_RadioState vendorRadioState;
+    RIL_RadioState reportedRadioState;
+} RilInstance;
+
 extern "C"
 char rild[MAX_SOCKET_NAME_LENGTH] = SOCKET_NAME_RIL;
 /*******************************************************************/
@@ -157,21 +382,21 @@ static pthread_t s_tid_dispatch;
 static pthread_t s_tid_reader;
 static int s_started = 0;
 
-static int s_fdListen = -1;
-static int s_fdCommand = -1;
 static int s_fdDebug = -1;
 
 static int s_fdWakeupRead;
 static int s_fdWakeupWrite;
 
-static struct ril_event s_commands_event;
 static struct ril_event s_wakeupfd_event;
-static struct ril_event s_listen_event;
 static struct ril_event s_wake_timeout_event;
 static struct ril_event s_debug_event;
 
 
 static const struct timeval TIMEVAL_WAKE_TIMEOUT = {1,0};
+static const struct timeval TIMEVAL_DEBUG_CLIENT_TIMEOUT = {5,0};
+static const struct timeval TIMEVAL_DEBUG_RADIO_ON_DELAY = {2,0};
+static const struct timeval TIMEVAL_READY_POLL = {0,50000};
+static const struct timeval TIMEVAL_SMS_BATCH_FLUSH = {0,20000};
 
 static pthread_mutex_t s_pendingRequestsMutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
@@ -188,9 +413,6 @@ static RequestInfo *s_toDispatchTail = NULL;
 
 static UserCallbackInfo *s_last_wake_timeout_info = NULL;
 
-static void *s_lastNITZTimeData = NULL;
-static size_t s_lastNITZTimeDataSize;
-
 #if RILC_LOG
     static char printBuf[PRINTBUF_SIZE];
 #endif
@@ -251,7 +473,8 @@ static int responseSSData(Parcel &p, void *response, size_t responselen);
 
 static int decodeVoiceRadioTechnology (RIL_RadioState radioState);
 static int decodeCdmaSubscriptionSource (RIL_RadioState radioState);
-static RIL_RadioState processRadioState(RIL_RadioState newRadioState);
+static RIL_RadioState processRadioState(RilInstance *pInst, RIL_RadioState newRadioState);
+static RIL_RadioState currentRadioState(RilInstance *pInst, bool *pCached);
 
 static bool isServiceTypeCfQuery(RIL_SsServiceType serType, RIL_SsRequestType reqType);
 extern "C" const char * requestToString(int request);
@@ -259,7 +482,12 @@ extern "C" const char * failCauseToString(RIL_Errno);
 extern "C" const char * callStateToString(RIL_CallState);
 extern "C" const char * radioStateToString(RIL_RadioState);
 
-static int sendResponse (Parcel &p);
+static int sendResponse (RilInstance *pInst, Parcel &p);
+static int sendResponseFramed (RilInstance *pInst, const void *records, size_t len);
+static int writeResponseRawv (RilInstance *pInst, struct iovec *iov, int iovcnt);
+static void closeCommandConnection (RilInstance *pInst);
+static void smsPipelineDone (RilInstance *pInst, bool smsPart);
+static void processSetFeatures (RilInstance *pInst, Parcel &p, int32_t token);
 
 #ifdef RIL_SHLIB
 extern "C" void RIL_onUnsolicitedResponse(int unsolResponse, void *data,
@@ -269,37 +497,198 @@ extern "C" void RIL_onUnsolicitedResponse(int unsolResponse, void *data,
 static UserCallbackInfo * internalRequestTimedCallback
     (RIL_TimedCallback callback, void *param,
         const struct timeval *relativeTime);
+static const char * timedCallbackName(void *callback);
+
+/* Rows of ril_commands.h / ril_unsol_commands.h */
+#define REQUEST(name, dispatch, response, priority) \
+    {RIL_REQUEST_##name, dispatch, response, PRIORITY_##priority, #name}
+#define UNSOL(name, response, wakeType) \
+    {RIL_UNSOL_##name, response, wakeType, "UNSOL_" #name}
 
 /** Index == requestNumber */
-static CommandInfo s_commands[] = {
+static constexpr CommandInfo s_commands[] = {
 #include "ril_commands.h"
 };
 
-static UnsolResponseInfo s_unsolResponses[] = {
+/** Index == requestNumber - RIL_UNSOL_RESPONSE_BASE */
+static constexpr UnsolResponseInfo s_unsolResponses[] = {
 #include "ril_unsol_commands.h"
 };
 
-int extlog = 0;
+#undef REQUEST
+#undef UNSOL
+
+/** Index == RIL_Errno, dense part only, see failCauseToString() */
+static constexpr ErrnoInfo s_failCauses[] = {
+    {RIL_E_SUCCESS, "E_SUCCESS"},
+    {RIL_E_RADIO_NOT_AVAILABLE, "E_RADIO_NOT_AVAILABLE"},
+    {RIL_E_GENERIC_FAILURE, "E_GENERIC_FAILURE"},
+    {RIL_E_PASSWORD_INCORRECT, "E_PASSWORD_INCORRECT"},
+    {RIL_E_SIM_PIN2, "E_SIM_PIN2"},
+    {RIL_E_SIM_PUK2, "E_SIM_PUK2"},
+    {RIL_E_REQUEST_NOT_SUPPORTED, "E_REQUEST_NOT_SUPPORTED"},
+    {RIL_E_CANCELLED, "E_CANCELLED"},
+    {RIL_E_OP_NOT_ALLOWED_DURING_VOICE_CALL, "E_OP_NOT_ALLOWED_DURING_VOICE_CALL"},
+    {RIL_E_OP_NOT_ALLOWED_BEFORE_REG_TO_NW, "E_OP_NOT_ALLOWED_BEFORE_REG_TO_NW"},
+    {RIL_E_SMS_SEND_FAIL_RETRY, "E_SMS_SEND_FAIL_RETRY"},
+    {RIL_E_SIM_ABSENT, "E_SIM_ABSENT"},
+};
 
-/* For older RILs that do not support new commands RIL_REQUEST_VOICE_RADIO_TECH and
-   RIL_UNSOL_VOICE_RADIO_TECH_CHANGED messages, decode the voice radio tech from
-   radio state message and store it. Every time there is a change in Radio State
-   check to see if voice radio tech changes and notify telephony
- */
-int voiceRadioTech = -1;
+// Build time replacement for the old self-check in RIL_register():
+// every row must sit at the index of its own number.
+static constexpr bool commandsAreDense(int i) {
+    return i >= (int)NUM_ELEMS(s_commands)
+        || (s_commands[i].requestNumber == i && commandsAreDense(i + 1));
+}
 
-/* For older RILs that do not support new commands RIL_REQUEST_GET_CDMA_SUBSCRIPTION_SOURCE
-   and RIL_UNSOL_CDMA_SUBSCRIPTION_SOURCE_CHANGED messages, decode the subscription
-   source from radio state and store it. Every time there is a change in Radio State
-   check to see if subscription source changed and notify telephony
- */
-int cdmaSubscriptionSource = -1;
+static constexpr bool unsolResponsesAreDense(int i) {
+    return i >= (int)NUM_ELEMS(s_unsolResponses)
+        || (s_unsolResponses[i].requestNumber == i + RIL_UNSOL_RESPONSE_BASE
+            && unsolResponsesAreDense(i + 1));
+}
 
-/* For older RILs that do not send RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, decode the
-   SIM/RUIM state from radio state and store it. Every time there is a change in Radio State,
-   check to see if SIM/RUIM status changed and notify telephony
- */
-int simRuimStatus = -1;
+static constexpr bool failCausesAreDense(int i) {
+    return i >= (int)NUM_ELEMS(s_failCauses)
+        || (s_failCauses[i].error == i && failCausesAreDense(i + 1));
+}
+
+static_assert(commandsAreDense(0),
+        "ril_commands.h rows must be in RIL_REQUEST_* order without gaps");
+static_assert(unsolResponsesAreDense(0),
+        "ril_unsol_commands.h rows must be in RIL_UNSOL_* order without gaps");
+static_assert(failCausesAreDense(0),
+        "s_failCauses rows must be in RIL_Errno order without gaps");
+
+int extlog = 0;
+
+/* Admission control for requests outstanding at the vendor RIL.
+   Limits of 0 mean unlimited; they are read from ro.ril.max_pending*
+   in RIL_register(). All counters and the deferred queue are protected
+   by s_pendingRequestsMutex. */
+static int s_maxPending = 0;
+static int s_maxPendingPerType = 0;
+static int s_maxPendingForType[NUM_ELEMS(s_commands)];
+static int s_maxDeferred = DEFAULT_MAX_DEFERRED_REQUESTS;
+static bool s_admissionReject = false;
+
+static int s_pendingTotal = 0;
+static int s_pendingPerType[NUM_ELEMS(s_commands)];
+
+static unsigned int s_rejectedTotal = 0;
+static unsigned int s_rejectedPerType[NUM_ELEMS(s_commands)];
+static unsigned int s_deferredTotal = 0;
+static unsigned int s_deferredDropped = 0;
+
+static DeferredRequest *s_deferredHead = NULL;
+static DeferredRequest *s_deferredTail = NULL;
+static int s_deferredCount = 0;
+static bool s_deferredDrainScheduled = false;
+
+/* Recycled RequestInfos, protected by s_pendingRequestsMutex */
+static RequestInfo *s_freeRequestInfos = NULL;
+static int s_freeRequestInfoCount = 0;
+
+/* Size above which responses are handed over in shared memory, from
+   ro.ril.shm_threshold; 0 disables the shared memory path */
+static size_t s_sharedMemoryThreshold = DEFAULT_SHARED_MEMORY_THRESHOLD;
+
+static pthread_mutex_t s_radioStateMutex = PTHREAD_MUTEX_INITIALIZER;
+// serializes refreshRadioState(), taken before s_radioStateMutex
+static pthread_mutex_t s_radioRefreshMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* SMS pipeline depth from ro.ril.sms_pipeline_depth, 0 disables it */
+static int s_smsPipelineDepth = DEFAULT_SMS_PIPELINE_DEPTH;
+static pthread_mutex_t s_smsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Raw pass-through: command records are parsed in place and raw
+   payloads are written straight from the vendor buffer.
+   ro.ril.raw_passthrough=0 falls back to copying through a Parcel. */
+static bool s_rawPassthrough = true;
+
+/* Per request type completion latency, protected by s_pendingRequestsMutex */
+static unsigned int s_latencyHistogram[NUM_ELEMS(s_commands)][LATENCY_BUCKETS];
+
+/* Metrics registry. Every field is a counter updated with the __sync
+   builtins from whichever thread sees the event, so no lock is taken on
+   the hot paths; readers use METRIC_READ(). See metricsFormat(). */
+static struct {
+    unsigned int requestsIn[NUM_ELEMS(s_commands)];
+    unsigned int requestsOut[NUM_ELEMS(s_commands)];
+    unsigned int unsolicited[NUM_ELEMS(s_unsolResponses)];
+    unsigned long long bytesRead;
+    unsigned long long bytesWritten;
+    unsigned int wakeLocks;
+    unsigned int writeRetries;
+    unsigned int sharedResponses;
+    unsigned long long sharedBytes;
+} s_metrics;
+
+#define METRIC_ADD(counter, n) __sync_fetch_and_add(&(counter), (n))
+#define METRIC_READ(counter) __sync_fetch_and_add(&(counter), 0)
+
+/* Periodic metrics snapshot, ro.ril.metrics_file / ro.ril.metrics_interval */
+static char s_metricsFile[PROPERTY_VALUE_MAX];
+static struct timeval s_metricsInterval = {DEFAULT_METRICS_INTERVAL_SEC, 0};
+
+/* Wake lock accounting for the debug port */
+static struct {
+    bool held;
+    unsigned int acquired;
+    unsigned int released;
+    nsecs_t acquireTime;
+    nsecs_t heldTime;
+    nsecs_t longestHold;
+} s_wakeLockStats;
+static pthread_mutex_t s_wakeLockStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t s_cellDeltaMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Instances hosted by this process, indexed by instance id.
+   s_defaultInstance is the first one registered; the single instance
+   entry points (RIL_onUnsolicitedResponse(), the debug port) act on it
+   and s_callbacks holds its callbacks. */
+static RilInstance s_instances[MAX_RIL_INSTANCES];
+static RilInstance *s_defaultInstance = NULL;
+
+/* Checkpoint file layout. All multi-byte fields are native endian, the
+   file never leaves the device. Each instance section is guarded by a
+   sequence count that is odd while the section is being written, so a
+   restart after a crash mid-update discards only that section. */
+typedef struct CheckpointUnsol {
+    int32_t unsolResponse;      // 0 for an empty slot
+    uint32_t len;
+    int64_t time;               // elapsedRealtime() ms
+    uint8_t data[CHECKPOINT_REPLAY_BYTES];  // the record as sent
+} CheckpointUnsol;
+
+typedef struct CheckpointInstance {
+    volatile uint32_t seq;
+    int32_t radioState;
+    int32_t voiceRadioTech;
+    int32_t cdmaSubscriptionSource;
+    int32_t simRuimStatus;
+    uint32_t nitzLen;
+    uint8_t nitz[CHECKPOINT_NITZ_BYTES];
+    CheckpointUnsol replay[CHECKPOINT_REPLAY_SLOTS];
+} CheckpointInstance;
+
+typedef struct Checkpoint {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    int32_t pid;
+    char bootId[CHECKPOINT_BOOT_ID_BYTES];  // kernel boot_id of the writer
+    int64_t updated;            // elapsedRealtime() ms
+    uint32_t wakeLockHeld;
+    uint32_t wakeLocksAcquired;
+    uint32_t wakeLocksReleased;
+    CheckpointInstance instances[MAX_RIL_INSTANCES];
+} Checkpoint;
+
+/* Mapped checkpoint, NULL when disabled. Writers hold s_checkpointMutex. */
+static Checkpoint *s_checkpoint = NULL;
+static bool s_checkpointRestored = false;
+static pthread_mutex_t s_checkpointMutex = PTHREAD_MUTEX_INITIALIZER;
 
 static char * RIL_getRilSocketName() {
     return rild;
@@ -343,229 +732,1114 @@ void   nullParcelReleaseFunction (const uint8_t* data, size_t dataSize,
 }
 
 /**
- * To be called from dispatch thread
- * Issue a single local request, ensuring that the response
- * is not sent back up to the command process
+ * Points the Parcel at a command record. In raw pass-through mode the
+ * record is referenced in place rather than copied, so readInplace()
+ * in dispatchRaw() hands the vendor a pointer into the caller's buffer.
+ * The buffer must stay valid until dispatch returns.
  */
 static void
-issueLocalRequest(int request, void *data, int len) {
-    RequestInfo *pRI;
-    int ret;
-
-    pRI = (RequestInfo *)calloc(1, sizeof(RequestInfo));
-
-    pRI->local = 1;
-    pRI->token = 0xffffffff;        // token is not used in this context
-    pRI->pCI = &(s_commands[request]);
-
-    ret = pthread_mutex_lock(&s_pendingRequestsMutex);
-    assert (ret == 0);
-
-    pRI->p_next = s_pendingRequests;
-    s_pendingRequests = pRI;
-
-    ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
-    assert (ret == 0);
-
-    RLOGD("C[locl]> %s", requestToString(request));
-
-    s_callbacks.onRequest(request, data, len, pRI);
+setParcelData(Parcel &p, void *buffer, size_t buflen) {
+    if (s_rawPassthrough) {
+        p.ipcSetDataReference((const uint8_t *) buffer, buflen, NULL, 0,
+                              nullParcelReleaseFunction, NULL);
+    } else {
+        p.setData((uint8_t *) buffer, buflen);
+    }
 }
 
+/* Kernel boot_id, empty when it cannot be read */
+static void
+readBootId(char *bootId, size_t size) {
+    int fd;
+    ssize_t n;
 
+    memset(bootId, 0, size);
+    fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    n = read(fd, bootId, size - 1);
+    close(fd);
+    if (n <= 0) {
+        bootId[0] = '\0';
+        return;
+    }
+    bootId[strcspn(bootId, "\n")] = '\0';
+}
 
-static int
-processCommandBuffer(void *buffer, size_t buflen) {
-    Parcel p;
-    status_t status;
-    int32_t request;
-    int32_t token;
-    RequestInfo *pRI;
-    int ret;
-
-    p.setData((uint8_t *) buffer, buflen);
+/**
+ * Maps the state checkpoint of this process, creating it if needed.
+ * The file is shared-mapped so every update lands in the page cache
+ * and survives the process being killed; a checkpoint left by an
+ * earlier run of this boot is kept for checkpointRestoreInstance().
+ * The boot is identified by the kernel boot_id; elapsedRealtime()
+ * values, including the replay ages, are only compared within it.
+ * ro.ril.checkpoint=0 disables it, ro.ril.checkpoint_dir moves it.
+ */
+static void
+checkpointOpen(const char *socketName) {
+    char prop_val[PROPERTY_VALUE_MAX];
+    char path[PATH_MAX];
+    char bootId[CHECKPOINT_BOOT_ID_BYTES];
+    Checkpoint *ckpt;
+    int64_t now = elapsedRealtime();
+    int fd;
+
+    property_get("ro.ril.checkpoint", prop_val, "1");
+    if (strtol(prop_val, NULL, 0) == 0) {
+        return;
+    }
 
-    // status checked at end
-    status = p.readInt32(&request);
-    status = p.readInt32 (&token);
+    property_get("ro.ril.checkpoint_dir", prop_val, DEFAULT_CHECKPOINT_DIR);
+    snprintf(path, sizeof(path), "%s/libril-%s.ckpt", prop_val, socketName);
 
-    if (status != NO_ERROR) {
-        RLOGE("invalid request block");
-        return 0;
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        RLOGW("checkpoint: cannot open %s errno:%d", path, errno);
+        return;
     }
 
-    if (request < 1 || request >= (int32_t)NUM_ELEMS(s_commands)) {
-        Parcel pErr;
-        RLOGE("unsupported request code %d token %d", request, token);
-        // FIXME this should perhaps return a response
-        pErr.writeInt32 (RESPONSE_SOLICITED);
-        pErr.writeInt32 (token);
-        pErr.writeInt32 (RIL_E_GENERIC_FAILURE);
-        
-        sendResponse(pErr);
-        return 0;
+    if (ftruncate(fd, sizeof(Checkpoint)) < 0) {
+        RLOGW("checkpoint: cannot size %s errno:%d", path, errno);
+        close(fd);
+        return;
     }
 
-    if (extlog)
-        RLOGI("[ExtLog] > %s [id = %d, token = %d, size = %d]",
-            requestToString(request), request, token, buflen);
-
-    pRI = (RequestInfo *)calloc(1, sizeof(RequestInfo));
-
-    pRI->token = token;
-    pRI->pCI = &(s_commands[request]);
+    ckpt = (Checkpoint *)mmap(NULL, sizeof(Checkpoint), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (ckpt == MAP_FAILED) {
+        RLOGW("checkpoint: cannot map %s errno:%d", path, errno);
+        return;
+    }
 
-    ret = pthread_mutex_lock(&s_pendingRequestsMutex);
-    assert (ret == 0);
+    readBootId(bootId, sizeof(bootId));
 
-    pRI->p_next = s_pendingRequests;
-    s_pendingRequests = pRI;
+    if (ckpt->magic == CHECKPOINT_MAGIC && ckpt->version == CHECKPOINT_VERSION
+            && ckpt->size == sizeof(Checkpoint) && bootId[0] != '\0'
+            && strncmp(ckpt->bootId, bootId, sizeof(bootId)) == 0
+            && ckpt->updated <= now) {
+        RLOGI("checkpoint: restoring state of pid %d, %lld ms old",
+                ckpt->pid, (long long)(now - ckpt->updated));
+        s_checkpointRestored = true;
 
-    ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
-    assert (ret == 0);
+        // kernel wake locks outlive the process that took them
+        if (ckpt->wakeLockHeld) {
+            RLOGI("checkpoint: releasing wake lock left behind");
+            release_wake_lock(ANDROID_WAKE_LOCK_NAME);
+        }
+        s_wakeLockStats.acquired = ckpt->wakeLocksAcquired;
+        s_wakeLockStats.released = ckpt->wakeLocksReleased
+                + (ckpt->wakeLockHeld ? 1 : 0);
+    } else {
+        memset(ckpt, 0, sizeof(Checkpoint));
+        for (int i = 0; i < MAX_RIL_INSTANCES; i++) {
+            ckpt->instances[i].radioState = -1;
+        }
+        ckpt->magic = CHECKPOINT_MAGIC;
+        ckpt->version = CHECKPOINT_VERSION;
+        ckpt->size = sizeof(Checkpoint);
+    }
 
-/*    sLastDispatchedToken = token; */
+    ckpt->pid = getpid();
+    memcpy(ckpt->bootId, bootId, sizeof(ckpt->bootId));
+    ckpt->wakeLockHeld = 0;
+    ckpt->updated = now;
+    s_checkpoint = ckpt;
+}
 
-    pRI->pCI->dispatchFunction(p, pRI);
+/* Must be called with s_checkpointMutex held, brackets an update */
+static CheckpointInstance *
+checkpointBeginLocked(RilInstance *pInst) {
+    CheckpointInstance *ci = &s_checkpoint->instances[pInst->id];
 
-    return 0;
+    ci->seq++;
+    __sync_synchronize();
+    return ci;
 }
 
 static void
-invalidCommandBlock (RequestInfo *pRI) {
-    RLOGE("invalid command block for token %d request %s",
-                pRI->token, requestToString(pRI->pCI->requestNumber));
+checkpointEndLocked(CheckpointInstance *ci) {
+    __sync_synchronize();
+    ci->seq++;
+    s_checkpoint->updated = elapsedRealtime();
 }
 
-/** Callee expects NULL */
+/**
+ * Picks up the state an earlier run of this instance left behind:
+ * values decoded from the radio state, the last NITZ, and the latest
+ * state bearing unsolicited responses for replay on the next connect.
+ */
 static void
-dispatchVoid (Parcel& p, RequestInfo *pRI) {
-    clearPrintBuf;
-    printRequest(pRI->token, pRI->pCI->requestNumber);
-    s_callbacks.onRequest(pRI->pCI->requestNumber, NULL, 0, pRI);
-}
+checkpointRestoreInstance(RilInstance *pInst) {
+    CheckpointInstance *ci;
 
-/** Callee expects const char * */
-static void
-dispatchString (Parcel& p, RequestInfo *pRI) {
-    status_t status;
-    size_t datalen;
-    size_t stringlen;
-    char *string8 = NULL;
+    if (s_checkpoint == NULL) {
+        return;
+    }
 
-    string8 = strdupReadString(p);
+    pthread_mutex_lock(&s_checkpointMutex);
+    ci = &s_checkpoint->instances[pInst->id];
 
-    startRequest;
-    appendPrintBuf("%s%s", printBuf, string8);
-    closeRequest;
-    printRequest(pRI->token, pRI->pCI->requestNumber);
+    if (!s_checkpointRestored || (ci->seq & 1) != 0) {
+        if ((ci->seq & 1) != 0) {
+            RLOGW("checkpoint: %s torn, discarded", pInst->socketName);
+        }
+        ci->seq = 0;
+        ci->radioState = -1;
+        ci->nitzLen = 0;
+        memset(ci->replay, 0, sizeof(ci->replay));
+        pthread_mutex_unlock(&s_checkpointMutex);
+        return;
+    }
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, string8,
-                       sizeof(char *), pRI);
+    pInst->voiceRadioTech = ci->voiceRadioTech;
+    pInst->cdmaSubscriptionSource = ci->cdmaSubscriptionSource;
+    pInst->simRuimStatus = ci->simRuimStatus;
 
-#ifdef MEMSET_FREED
-    memsetString(string8);
-#endif
+    if (ci->nitzLen > 0 && ci->nitzLen <= sizeof(ci->nitz)) {
+        pInst->lastNITZTimeData = malloc(ci->nitzLen);
+        if (pInst->lastNITZTimeData != NULL) {
+            memcpy(pInst->lastNITZTimeData, ci->nitz, ci->nitzLen);
+            pInst->lastNITZTimeDataSize = ci->nitzLen;
+        }
+    }
 
-    free(string8);
-    return;
-invalid:
-    invalidCommandBlock(pRI);
-    return;
+    pInst->replayPending = true;
+
+    RLOGI("checkpoint: %s last radio state %d", pInst->socketName,
+            ci->radioState);
+    pthread_mutex_unlock(&s_checkpointMutex);
 }
 
-/** Callee expects const char ** */
 static void
-dispatchStrings (Parcel &p, RequestInfo *pRI) {
-    int32_t countStrings;
-    status_t status;
-    size_t datalen;
-    char **pStrings;
-
-    status = p.readInt32 (&countStrings);
+checkpointRadioState(RilInstance *pInst, RIL_RadioState state) {
+    CheckpointInstance *ci;
 
-    if (status != NO_ERROR) {
-        goto invalid;
+    if (s_checkpoint == NULL) {
+        return;
     }
 
-    startRequest;
-    if (countStrings == 0) {
-        // just some non-null pointer
-        pStrings = (char **)alloca(sizeof(char *));
-        datalen = 0;
-    } else if (((int)countStrings) == -1) {
-        pStrings = NULL;
-        datalen = 0;
-    } else {
-        datalen = sizeof(char *) * countStrings;
+    pthread_mutex_lock(&s_checkpointMutex);
+    ci = checkpointBeginLocked(pInst);
+    ci->radioState = state;
+    ci->voiceRadioTech = pInst->voiceRadioTech;
+    ci->cdmaSubscriptionSource = pInst->cdmaSubscriptionSource;
+    ci->simRuimStatus = pInst->simRuimStatus;
+    checkpointEndLocked(ci);
+    pthread_mutex_unlock(&s_checkpointMutex);
+}
 
-        pStrings = (char **)alloca(datalen);
+/* Unsolicited responses worth replaying to a client after a restart:
+   the latest one of each type describes current state. The data call
+   list is left out, the restarted vendor RIL may no longer have those
+   calls and the framework polls the list on connect anyway. */
+static bool
+isReplayableUnsol(int unsolResponse) {
+    switch (unsolResponse) {
+        case RIL_UNSOL_SIGNAL_STRENGTH:
+        case RIL_UNSOL_RESTRICTED_STATE_CHANGED:
+        case RIL_UNSOL_CDMA_SUBSCRIPTION_SOURCE_CHANGED:
+        case RIL_UNSOL_CDMA_PRL_CHANGED:
+        case RIL_UNSOL_VOICE_RADIO_TECH_CHANGED:
+        case RIL_UNSOL_CELL_INFO_LIST:
+        case RIL_UNSOL_UICC_SUBSCRIPTION_STATUS_CHANGED:
+            return true;
+        default:
+            return false;
+    }
+}
 
-        for (int i = 0 ; i < countStrings ; i++) {
-            pStrings[i] = strdupReadString(p);
-            appendPrintBuf("%s%s,", printBuf, pStrings[i]);
-        }
+/**
+ * Records a marshalled unsolicited response: NITZ always, others in a
+ * replay slot per type when they carry state. Records too large for a
+ * slot drop the stale entry of their type instead.
+ */
+static void
+checkpointUnsol(RilInstance *pInst, int unsolResponse,
+        const void *data, size_t len) {
+    CheckpointInstance *ci;
+    CheckpointUnsol *slot = NULL;
+
+    if (s_checkpoint == NULL) {
+        return;
+    }
+    if (unsolResponse != RIL_UNSOL_NITZ_TIME_RECEIVED
+            && !isReplayableUnsol(unsolResponse)) {
+        return;
     }
-    removeLastChar;
-    closeRequest;
-    printRequest(pRI->token, pRI->pCI->requestNumber);
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, pStrings, datalen, pRI);
+    pthread_mutex_lock(&s_checkpointMutex);
+    ci = checkpointBeginLocked(pInst);
 
-    if (pStrings != NULL) {
-        for (int i = 0 ; i < countStrings ; i++) {
-#ifdef MEMSET_FREED
-            memsetString (pStrings[i]);
-#endif
-            free(pStrings[i]);
+    if (unsolResponse == RIL_UNSOL_NITZ_TIME_RECEIVED) {
+        if (len <= sizeof(ci->nitz)) {
+            memcpy(ci->nitz, data, len);
+            ci->nitzLen = len;
+        } else {
+            ci->nitzLen = 0;
+        }
+    } else {
+        for (int i = 0; i < CHECKPOINT_REPLAY_SLOTS; i++) {
+            CheckpointUnsol *cur = &ci->replay[i];
+            if (cur->unsolResponse == unsolResponse) {
+                slot = cur;
+                break;
+            }
+            if (slot == NULL && cur->unsolResponse == 0) {
+                slot = cur;
+            }
         }
 
-#ifdef MEMSET_FREED
-        memset(pStrings, 0, datalen);
-#endif
+        if (slot != NULL && len <= sizeof(slot->data)) {
+            memcpy(slot->data, data, len);
+            slot->len = len;
+            slot->time = elapsedRealtime();
+            slot->unsolResponse = unsolResponse;
+        } else if (slot != NULL) {
+            slot->unsolResponse = 0;
+        }
     }
 
-    return;
-invalid:
-    invalidCommandBlock(pRI);
-    return;
+    checkpointEndLocked(ci);
+    pthread_mutex_unlock(&s_checkpointMutex);
 }
 
-/** Callee expects const int * */
 static void
-dispatchInts (Parcel &p, RequestInfo *pRI) {
-    int32_t count;
-    status_t status;
-    size_t datalen;
-    int *pInts;
+checkpointWakeLock() {
+    if (s_checkpoint == NULL) {
+        return;
+    }
 
-    status = p.readInt32 (&count);
+    // a single writer under s_wakeLockStatsMutex, no seq bracket needed
+    s_checkpoint->wakeLockHeld = s_wakeLockStats.held;
+    s_checkpoint->wakeLocksAcquired = s_wakeLockStats.acquired;
+    s_checkpoint->wakeLocksReleased = s_wakeLockStats.released;
+}
 
-    if (status != NO_ERROR || count == 0) {
-        goto invalid;
+/* Called before the process kills itself */
+static void
+checkpointFlush() {
+    if (s_checkpoint != NULL) {
+        msync(s_checkpoint, sizeof(Checkpoint), MS_SYNC);
     }
+}
 
-    datalen = sizeof(int) * count;
-    pInts = (int *)alloca(datalen);
+/**
+ * Must be called with s_pendingRequestsMutex held.
+ * Returns a zeroed RequestInfo, recycled when one is available.
+ */
+static RequestInfo *
+allocRequestInfoLocked() {
+    RequestInfo *pRI = s_freeRequestInfos;
 
-    startRequest;
-    for (int i = 0 ; i < count ; i++) {
-        int32_t t;
+    if (pRI == NULL) {
+        return (RequestInfo *)calloc(1, sizeof(RequestInfo));
+    }
 
-        status = p.readInt32(&t);
-        pInts[i] = (int)t;
-        appendPrintBuf("%s%d,", printBuf, t);
+    s_freeRequestInfos = pRI->p_next;
+    s_freeRequestInfoCount--;
+    memset(pRI, 0, sizeof(RequestInfo));
+    return pRI;
+}
 
-        if (status != NO_ERROR) {
-            goto invalid;
-        }
-   }
-   removeLastChar;
-   closeRequest;
-   printRequest(pRI->token, pRI->pCI->requestNumber);
+static void
+freeRequestInfo(RequestInfo *pRI) {
+    pthread_mutex_lock(&s_pendingRequestsMutex);
+    if (s_freeRequestInfoCount < MAX_FREE_REQUEST_INFOS) {
+        pRI->p_next = s_freeRequestInfos;
+        s_freeRequestInfos = pRI;
+        s_freeRequestInfoCount++;
+        pRI = NULL;
+    }
+    pthread_mutex_unlock(&s_pendingRequestsMutex);
 
-   s_callbacks.onRequest(pRI->pCI->requestNumber, const_cast<int *>(pInts),
-                       datalen, pRI);
+    free(pRI);
+}
+
+/**
+ * To be called from dispatch thread
+ * Issue a single local request, ensuring that the response
+ * is not sent back up to the command process
+ */
+static void
+issueLocalRequest(int request, void *data, int len) {
+    RequestInfo *pRI;
+    int ret;
+
+    if (s_defaultInstance == NULL) {
+        RLOGE("local %s before RIL_register", requestToString(request));
+        return;
+    }
+
+    ret = pthread_mutex_lock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+    pRI = allocRequestInfoLocked();
+
+    pRI->local = 1;
+    pRI->token = 0xffffffff;        // token is not used in this context
+    pRI->pCI = &(s_commands[request]);
+    pRI->startTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    pRI->pInstance = s_defaultInstance;
+
+    pRI->p_next = s_pendingRequests;
+    s_pendingRequests = pRI;
+
+    ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+    RLOGD("C[locl]> %s", requestToString(request));
+
+    pRI->pInstance->callbacks.onRequest(request, data, len, pRI);
+}
+
+
+
+static int
+maxPendingForType(int request) {
+    if (s_maxPendingForType[request] >= 0) {
+        return s_maxPendingForType[request];
+    }
+    return s_maxPendingPerType;
+}
+
+/**
+ * Must be called with s_pendingRequestsMutex held.
+ * Returns true and accounts the request if it may go to the vendor now.
+ */
+static bool
+tryAdmitLocked(int request, bool ignoreDeferred) {
+    int typeLimit = maxPendingForType(request);
+    // critical requests must not wait behind a flood of other
+    // traffic, only their own per-type limit applies
+    bool critical = s_commands[request].priority == PRIORITY_CRITICAL;
+
+    if (typeLimit > 0 && s_pendingPerType[request] >= typeLimit) {
+        return false;
+    }
+
+    if (!critical) {
+        if (s_maxPending > 0 && s_pendingTotal >= s_maxPending) {
+            return false;
+        }
+        // keep FIFO order with requests already waiting
+        if (!ignoreDeferred && s_deferredCount > 0) {
+            return false;
+        }
+    }
+
+    s_pendingTotal++;
+    s_pendingPerType[request]++;
+    return true;
+}
+
+/**
+ * Must be called with s_pendingRequestsMutex held.
+ * Gives back the slot taken by tryAdmitLocked(). Returns true if
+ * deferred requests are waiting for a slot.
+ */
+static bool
+releaseAdmissionLocked(int request) {
+    if (s_pendingTotal > 0) {
+        s_pendingTotal--;
+    }
+    if (s_pendingPerType[request] > 0) {
+        s_pendingPerType[request]--;
+    }
+    return s_deferredCount > 0;
+}
+
+static void
+sendAdmissionRejected(RilInstance *pInst, int32_t request, int32_t token) {
+    Parcel pErr;
+
+    RLOGW("admission: rejecting %s token %d (pending %d, deferred %d)",
+            requestToString(request), token, s_pendingTotal, s_deferredCount);
+
+    pErr.writeInt32 (RESPONSE_SOLICITED);
+    pErr.writeInt32 (token);
+    pErr.writeInt32 (RIL_E_ADMISSION_REJECTED);
+
+    sendResponse(pInst, pErr);
+}
+
+/**
+ * Called on the event loop thread for a request that did not pass
+ * tryAdmitLocked(). Queues a copy of the record, or rejects it.
+ * Must be called with s_pendingRequestsMutex held; returns true if
+ * the request must be rejected by the caller once the lock is dropped.
+ */
+static bool
+deferOrRejectLocked(RilInstance *pInst, int32_t request, void *buffer, size_t buflen,
+        bool smsPart) {
+    DeferredRequest *pDR;
+
+    if (s_admissionReject || s_deferredCount >= s_maxDeferred) {
+        s_rejectedTotal++;
+        s_rejectedPerType[request]++;
+        return true;
+    }
+
+    pDR = (DeferredRequest *)calloc(1, sizeof(DeferredRequest));
+    if (pDR != NULL) {
+        pDR->buffer = malloc(buflen);
+    }
+    if (pDR == NULL || pDR->buffer == NULL) {
+        free(pDR);
+        s_rejectedTotal++;
+        s_rejectedPerType[request]++;
+        return true;
+    }
+
+    memcpy(pDR->buffer, buffer, buflen);
+    pDR->buflen = buflen;
+    pDR->request = request;
+    pDR->pInstance = pInst;
+    pDR->smsPart = smsPart;
+
+    if (s_deferredTail == NULL) {
+        s_deferredHead = pDR;
+    } else {
+        s_deferredTail->p_next = pDR;
+    }
+    s_deferredTail = pDR;
+    s_deferredCount++;
+    s_deferredTotal++;
+
+    return false;
+}
+
+/**
+ * Creates the RequestInfo for an admitted request and hands it
+ * to the dispatch function. The Parcel is positioned just past
+ * the request number and token.
+ */
+static void
+dispatchAdmitted(RilInstance *pInst, Parcel &p, int32_t request, int32_t token,
+        bool smsPart) {
+    RequestInfo *pRI;
+    int ret;
+
+    ret = pthread_mutex_lock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+    pRI = allocRequestInfoLocked();
+
+    pRI->token = token;
+    pRI->pCI = &(s_commands[request]);
+    pRI->startTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    pRI->pInstance = pInst;
+    pRI->smsPart = smsPart;
+
+    pRI->p_next = s_pendingRequests;
+    s_pendingRequests = pRI;
+
+    ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+/*    sLastDispatchedToken = token; */
+
+    pRI->pCI->dispatchFunction(p, pRI);
+}
+
+/**
+ * Timer callback on the event loop thread: hands deferred requests to
+ * the vendor for as long as admission control has free slots.
+ */
+static void
+drainDeferredRequests(void *param) {
+    for (;;) {
+        DeferredRequest *pDR = NULL;
+        DeferredRequest *pPrev = NULL;
+        int ret;
+
+        ret = pthread_mutex_lock(&s_pendingRequestsMutex);
+        assert (ret == 0);
+
+        for (pDR = s_deferredHead; pDR != NULL; pPrev = pDR, pDR = pDR->p_next) {
+            if (tryAdmitLocked(pDR->request, true)) {
+                if (pPrev == NULL) {
+                    s_deferredHead = pDR->p_next;
+                } else {
+                    pPrev->p_next = pDR->p_next;
+                }
+                if (s_deferredTail == pDR) {
+                    s_deferredTail = pPrev;
+                }
+                s_deferredCount--;
+                break;
+            }
+        }
+
+        if (pDR == NULL) {
+            s_deferredDrainScheduled = false;
+        }
+
+        ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
+        assert (ret == 0);
+
+        if (pDR == NULL) {
+            return;
+        }
+
+        Parcel p;
+        int32_t request;
+        int32_t token;
+
+        setParcelData(p, pDR->buffer, pDR->buflen);
+        p.readInt32(&request);
+        p.readInt32(&token);
+
+        dispatchAdmitted(pDR->pInstance, p, request, token, pDR->smsPart);
+
+        free(pDR->buffer);
+        free(pDR);
+    }
+}
+
+/**
+ * Must be called with s_pendingRequestsMutex held.
+ * Arranges for drainDeferredRequests() to run on the event loop.
+ */
+static void
+scheduleDeferredDrainLocked() {
+    if (!s_deferredDrainScheduled) {
+        s_deferredDrainScheduled = true;
+        internalRequestTimedCallback(drainDeferredRequests, NULL, NULL);
+    }
+}
+
+/**
+ * Drops everything an instance has held back by admission control;
+ * these requests never reached the vendor so there is nothing to
+ * cancel there.
+ */
+static void
+flushDeferredRequests(RilInstance *pInst) {
+    DeferredRequest *pDR = NULL;
+    DeferredRequest **ppCur;
+    int ret;
+
+    ret = pthread_mutex_lock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+    s_deferredTail = NULL;
+    for (ppCur = &s_deferredHead; *ppCur != NULL; ) {
+        DeferredRequest *pCur = *ppCur;
+
+        if (pCur->pInstance == pInst) {
+            *ppCur = pCur->p_next;
+            pCur->p_next = pDR;
+            pDR = pCur;
+            s_deferredCount--;
+            s_deferredDropped++;
+        } else {
+            s_deferredTail = pCur;
+            ppCur = &pCur->p_next;
+        }
+    }
+
+    ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+    while (pDR != NULL) {
+        DeferredRequest *pNext = pDR->p_next;
+        smsPipelineDone(pDR->pInstance, pDR->smsPart);
+        free(pDR->buffer);
+        free(pDR);
+        pDR = pNext;
+    }
+}
+
+/**
+ * Admission control and dispatch of a validated command record;
+ * p is positioned just past the request number and token.
+ */
+static void
+admitAndDispatch(RilInstance *pInst, Parcel &p, int32_t request, int32_t token,
+        void *buffer, size_t buflen, bool smsPart) {
+    bool admitted;
+    bool reject = false;
+    int ret;
+
+    ret = pthread_mutex_lock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+    admitted = tryAdmitLocked(request, false);
+    if (!admitted) {
+        reject = deferOrRejectLocked(pInst, request, buffer, buflen, smsPart);
+    }
+
+    ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
+    assert (ret == 0);
+
+    if (admitted) {
+        dispatchAdmitted(pInst, p, request, token, smsPart);
+    } else if (reject) {
+        sendAdmissionRejected(pInst, request, token);
+        smsPipelineDone(pInst, smsPart);
+    } else if (extlog) {
+        RLOGI("[ExtLog] deferred %s [token = %d, deferred = %d]",
+            requestToString(request), token, s_deferredCount);
+    }
+}
+
+/**
+ * Called on the event loop thread for every command. Returns true for
+ * the requests that go through the SMS pipeline: the parts of a
+ * multipart send (each RIL_REQUEST_SEND_SMS_EXPECT_MORE and the
+ * RIL_REQUEST_SEND_SMS that ends the run) and writes to SIM/RUIM
+ * storage. SIM writes are independent of each other, so a bulk write
+ * streams through the pipeline while a lone one finds it empty and is
+ * answered right away. Single part messages and CDMA and IMS sends,
+ * which carry no more-to-come hint, keep the plain path.
+ */
+static bool
+smsIsPipelinePart(RilInstance *pInst, int request) {
+    bool part = false;
+
+    if (s_smsPipelineDepth <= 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&s_smsMutex);
+    if (request == RIL_REQUEST_SEND_SMS_EXPECT_MORE) {
+        pInst->smsMoreExpected = true;
+        part = true;
+    } else if (request == RIL_REQUEST_SEND_SMS && pInst->smsMoreExpected) {
+        pInst->smsMoreExpected = false;
+        part = true;
+    } else if (request == RIL_REQUEST_WRITE_SMS_TO_SIM
+            || request == RIL_REQUEST_CDMA_WRITE_SMS_TO_RUIM) {
+        part = true;
+    }
+    pthread_mutex_unlock(&s_smsMutex);
+
+    return part;
+}
+
+/**
+ * Timer callback on the event loop: hands queued SMS parts to the
+ * vendor while the pipeline has room.
+ */
+static void
+drainSmsPipeline(void *param) {
+    RilInstance *pInst = (RilInstance *)param;
+
+    for (;;) {
+        DeferredRequest *pDR = NULL;
+
+        pthread_mutex_lock(&s_smsMutex);
+        if (pInst->smsQueueHead != NULL && pInst->smsInFlight < s_smsPipelineDepth) {
+            pDR = pInst->smsQueueHead;
+            pInst->smsQueueHead = pDR->p_next;
+            if (pInst->smsQueueHead == NULL) {
+                pInst->smsQueueTail = NULL;
+            }
+            pInst->smsQueued--;
+            pInst->smsInFlight++;
+        } else {
+            pInst->smsDrainScheduled = false;
+        }
+        pthread_mutex_unlock(&s_smsMutex);
+
+        if (pDR == NULL) {
+            return;
+        }
+
+        Parcel p;
+        int32_t request;
+        int32_t token;
+
+        setParcelData(p, pDR->buffer, pDR->buflen);
+        p.readInt32(&request);
+        p.readInt32(&token);
+
+        admitAndDispatch(pInst, p, request, token, pDR->buffer, pDR->buflen, true);
+
+        free(pDR->buffer);
+        free(pDR);
+    }
+}
+
+/**
+ * Returns true if an SMS request may go to the vendor now and takes a
+ * pipeline slot for it. Otherwise the record is copied into the queue
+ * of the instance, behind the parts already in flight, so a long
+ * multipart message streams through at most s_smsPipelineDepth parts
+ * deep.
+ */
+static bool
+smsPipelineAdmit(RilInstance *pInst, int32_t request, void *buffer, size_t buflen) {
+    DeferredRequest *pDR;
+    bool admitted = true;
+
+    pthread_mutex_lock(&s_smsMutex);
+
+    if (pInst->smsInFlight >= s_smsPipelineDepth || pInst->smsQueued > 0) {
+        pDR = (DeferredRequest *)calloc(1, sizeof(DeferredRequest));
+        if (pDR != NULL) {
+            pDR->buffer = malloc(buflen);
+        }
+        if (pDR != NULL && pDR->buffer != NULL) {
+            memcpy(pDR->buffer, buffer, buflen);
+            pDR->buflen = buflen;
+            pDR->request = request;
+            pDR->pInstance = pInst;
+            pDR->smsPart = true;
+            if (pInst->smsQueueTail == NULL) {
+                pInst->smsQueueHead = pDR;
+            } else {
+                pInst->smsQueueTail->p_next = pDR;
+            }
+            pInst->smsQueueTail = pDR;
+            pInst->smsQueued++;
+            admitted = false;
+        } else {
+            // out of memory, better to overrun the depth than drop it
+            free(pDR);
+        }
+    }
+
+    if (admitted) {
+        pInst->smsInFlight++;
+    }
+
+    pthread_mutex_unlock(&s_smsMutex);
+
+    return admitted;
+}
+
+/**
+ * Must be called with s_smsMutex held.
+ * Gives back a pipeline slot and lets the next queued part through.
+ */
+static void
+smsPipelineReleaseLocked(RilInstance *pInst) {
+    if (pInst->smsInFlight > 0) {
+        pInst->smsInFlight--;
+    }
+    if (pInst->smsQueued > 0 && !pInst->smsDrainScheduled) {
+        pInst->smsDrainScheduled = true;
+        internalRequestTimedCallback(drainSmsPipeline, pInst, NULL);
+    }
+}
+
+/* For SMS parts that end without a response to batch */
+static void
+smsPipelineDone(RilInstance *pInst, bool smsPart) {
+    if (!smsPart) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_smsMutex);
+    smsPipelineReleaseLocked(pInst);
+    pthread_mutex_unlock(&s_smsMutex);
+}
+
+/* Must be called with s_smsMutex held */
+static void
+smsBatchFlushLocked(RilInstance *pInst) {
+    if (pInst->smsBatchLen > 0) {
+        sendResponseFramed(pInst, pInst->smsBatch, pInst->smsBatchLen);
+        pInst->smsBatchLen = 0;
+    }
+}
+
+static void
+smsBatchFlushCallback(void *param) {
+    RilInstance *pInst = (RilInstance *)param;
+
+    pthread_mutex_lock(&s_smsMutex);
+    pInst->smsFlushScheduled = false;
+    smsBatchFlushLocked(pInst);
+    pthread_mutex_unlock(&s_smsMutex);
+}
+
+/**
+ * Sends the response to a pipelined SMS request. While other parts of
+ * the instance are still at the vendor, completions are coalesced and
+ * go out in one write when the pipeline runs dry, the batch buffer
+ * fills up, TIMEVAL_SMS_BATCH_FLUSH passes or any other record is
+ * about to be written to the instance (see sendResponseRawv()), so
+ * responses keep their order. A client that waits for
+ * every response before sending the next part always finds the
+ * pipeline empty and sees no added delay.
+ */
+static void
+smsPipelineComplete(RilInstance *pInst, Parcel &p) {
+    uint32_t header = htonl(p.dataSize());
+    size_t recordLen = sizeof(header) + p.dataSize();
+
+    pthread_mutex_lock(&s_smsMutex);
+
+    smsPipelineReleaseLocked(pInst);
+
+    if (pInst->smsBatchLen + recordLen > sizeof(pInst->smsBatch)) {
+        smsBatchFlushLocked(pInst);
+    }
+
+    if (recordLen > sizeof(pInst->smsBatch)) {
+        // the batch was flushed above, sendResponse() would take s_smsMutex again
+        struct iovec iov[2];
+
+        iov[1].iov_base = const_cast<uint8_t *>(p.data());
+        iov[1].iov_len = p.dataSize();
+        writeResponseRawv(pInst, iov, 2);
+    } else {
+        memcpy(pInst->smsBatch + pInst->smsBatchLen, &header, sizeof(header));
+        memcpy(pInst->smsBatch + pInst->smsBatchLen + sizeof(header),
+                p.data(), p.dataSize());
+        pInst->smsBatchLen += recordLen;
+    }
+
+    if (pInst->smsInFlight == 0) {
+        smsBatchFlushLocked(pInst);
+    } else if (pInst->smsBatchLen > 0 && !pInst->smsFlushScheduled) {
+        pInst->smsFlushScheduled = true;
+        internalRequestTimedCallback(smsBatchFlushCallback, pInst,
+                &TIMEVAL_SMS_BATCH_FLUSH);
+    }
+
+    pthread_mutex_unlock(&s_smsMutex);
+}
+
+/* Drops the SMS parts still queued and completions not yet written */
+static void
+smsPipelineReset(RilInstance *pInst) {
+    DeferredRequest *pDR;
+
+    pthread_mutex_lock(&s_smsMutex);
+    pDR = pInst->smsQueueHead;
+    pInst->smsQueueHead = NULL;
+    pInst->smsQueueTail = NULL;
+    pInst->smsQueued = 0;
+    pInst->smsBatchLen = 0;
+    pInst->smsMoreExpected = false;
+    pthread_mutex_unlock(&s_smsMutex);
+
+    while (pDR != NULL) {
+        DeferredRequest *pNext = pDR->p_next;
+        free(pDR->buffer);
+        free(pDR);
+        pDR = pNext;
+    }
+}
+
+static int
+processCommandBuffer(RilInstance *pInst, void *buffer, size_t buflen) {
+    Parcel p;
+    status_t status;
+    int32_t request;
+    int32_t token;
+    bool smsPart;
+
+    setParcelData(p, buffer, buflen);
+
+    // status checked at end
+    status = p.readInt32(&request);
+    status = p.readInt32 (&token);
+
+    if (status != NO_ERROR) {
+        RLOGE("invalid request block");
+        return 0;
+    }
+
+    if (request == RIL_REQUEST_LIBRIL_SET_FEATURES) {
+        processSetFeatures(pInst, p, token);
+        return 0;
+    }
+
+    if (request < 1 || request >= (int32_t)NUM_ELEMS(s_commands)) {
+        Parcel pErr;
+        RLOGE("unsupported request code %d token %d", request, token);
+        // FIXME this should perhaps return a response
+        pErr.writeInt32 (RESPONSE_SOLICITED);
+        pErr.writeInt32 (token);
+        pErr.writeInt32 (RIL_E_GENERIC_FAILURE);
+        
+        sendResponse(pInst, pErr);
+        return 0;
+    }
+
+    if (s_commands[request].dispatchFunction == NULL) {
+        Parcel pErr;
+        RLOGE("%s not supported by this build, token %d",
+                requestToString(request), token);
+        pErr.writeInt32 (RESPONSE_SOLICITED);
+        pErr.writeInt32 (token);
+        pErr.writeInt32 (RIL_E_REQUEST_NOT_SUPPORTED);
+
+        sendResponse(pInst, pErr);
+        return 0;
+    }
+
+    METRIC_ADD(s_metrics.requestsIn[request], 1);
+
+    if (!pInst->firstRequestSeen) {
+        int64_t now = elapsedRealtime();
+
+        pInst->firstRequestSeen = true;
+        RLOGI("%s: first request %s at %lld ms since boot, "
+                "%lld ms after register (ready after %lld ms)",
+                pInst->socketName, requestToString(request), (long long)now,
+                (long long)(now - pInst->registerTime),
+                (long long)(pInst->readyTime - pInst->registerTime));
+    }
+
+    if (extlog)
+        RLOGI("[ExtLog] > %s [id = %d, token = %d, size = %d]",
+            requestToString(request), request, token, buflen);
+
+    smsPart = smsIsPipelinePart(pInst, request);
+    if (smsPart && !smsPipelineAdmit(pInst, request, buffer, buflen)) {
+        if (extlog)
+            RLOGI("[ExtLog] queued %s [token = %d, in flight = %d]",
+                requestToString(request), token, pInst->smsInFlight);
+        return 0;
+    }
+
+    admitAndDispatch(pInst, p, request, token, buffer, buflen, smsPart);
+
+    return 0;
+}
+
+static void
+invalidCommandBlock (RequestInfo *pRI) {
+    RLOGE("invalid command block for token %d request %s",
+                pRI->token, requestToString(pRI->pCI->requestNumber));
+}
+
+/** Callee expects NULL */
+static void
+dispatchVoid (Parcel& p, RequestInfo *pRI) {
+    clearPrintBuf;
+    printRequest(pRI->token, pRI->pCI->requestNumber);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, NULL, 0, pRI);
+}
+
+/** Callee expects const char * */
+static void
+dispatchString (Parcel& p, RequestInfo *pRI) {
+    status_t status;
+    size_t datalen;
+    size_t stringlen;
+    char *string8 = NULL;
+
+    string8 = strdupReadString(p);
+
+    startRequest;
+    appendPrintBuf("%s%s", printBuf, string8);
+    closeRequest;
+    printRequest(pRI->token, pRI->pCI->requestNumber);
+
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, string8,
+                       sizeof(char *), pRI);
+
+#ifdef MEMSET_FREED
+    memsetString(string8);
+#endif
+
+    free(string8);
+    return;
+invalid:
+    invalidCommandBlock(pRI);
+    return;
+}
+
+/** Callee expects const char ** */
+static void
+dispatchStrings (Parcel &p, RequestInfo *pRI) {
+    int32_t countStrings;
+    status_t status;
+    size_t datalen;
+    char **pStrings;
+
+    status = p.readInt32 (&countStrings);
+
+    if (status != NO_ERROR) {
+        goto invalid;
+    }
+
+    startRequest;
+    if (countStrings == 0) {
+        // just some non-null pointer
+        pStrings = (char **)alloca(sizeof(char *));
+        datalen = 0;
+    } else if (((int)countStrings) == -1) {
+        pStrings = NULL;
+        datalen = 0;
+    } else {
+        datalen = sizeof(char *) * countStrings;
+
+        pStrings = (char **)alloca(datalen);
+
+        for (int i = 0 ; i < countStrings ; i++) {
+            pStrings[i] = strdupReadString(p);
+            appendPrintBuf("%s%s,", printBuf, pStrings[i]);
+        }
+    }
+    removeLastChar;
+    closeRequest;
+    printRequest(pRI->token, pRI->pCI->requestNumber);
+
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, pStrings, datalen, pRI);
+
+    if (pStrings != NULL) {
+        for (int i = 0 ; i < countStrings ; i++) {
+#ifdef MEMSET_FREED
+            memsetString (pStrings[i]);
+#endif
+            free(pStrings[i]);
+        }
+
+#ifdef MEMSET_FREED
+        memset(pStrings, 0, datalen);
+#endif
+    }
+
+    return;
+invalid:
+    invalidCommandBlock(pRI);
+    return;
+}
+
+/** Callee expects const int * */
+static void
+dispatchInts (Parcel &p, RequestInfo *pRI) {
+    int32_t count;
+    status_t status;
+    size_t datalen;
+    int *pInts;
+
+    status = p.readInt32 (&count);
+
+    if (status != NO_ERROR || count == 0) {
+        goto invalid;
+    }
+
+    datalen = sizeof(int) * count;
+    pInts = (int *)alloca(datalen);
+
+    startRequest;
+    for (int i = 0 ; i < count ; i++) {
+        int32_t t;
+
+        status = p.readInt32(&t);
+        pInts[i] = (int)t;
+        appendPrintBuf("%s%d,", printBuf, t);
+
+        if (status != NO_ERROR) {
+            goto invalid;
+        }
+   }
+   removeLastChar;
+   closeRequest;
+   printRequest(pRI->token, pRI->pCI->requestNumber);
+
+   pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, const_cast<int *>(pInts),
+                       datalen, pRI);
 
 #ifdef MEMSET_FREED
     memset(pInts, 0, datalen);
@@ -609,7 +1883,7 @@ dispatchSmsWrite (Parcel &p, RequestInfo *pRI) {
     closeRequest;
     printRequest(pRI->token, pRI->pCI->requestNumber);
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &args, sizeof(args), pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &args, sizeof(args), pRI);
 
 #ifdef MEMSET_FREED
     memsetString (args.pdu);
@@ -705,7 +1979,7 @@ dispatchDial (Parcel &p, RequestInfo *pRI) {
     closeRequest;
     printRequest(pRI->token, pRI->pCI->requestNumber);
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &dial, sizeOfDial, pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &dial, sizeOfDial, pRI);
 
 #ifdef MEMSET_FREED
     memsetString (dial.address);
@@ -797,7 +2071,7 @@ dispatchSIM_IO (Parcel &p, RequestInfo *pRI) {
     }
 
     size = (s_callbacks.version < 6) ? sizeof(simIO.v5) : sizeof(simIO.v6);
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &simIO, size, pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &simIO, size, pRI);
 
 #ifdef MEMSET_FREED
     memsetString (simIO.v6.path);
@@ -875,7 +2149,7 @@ dispatchCallForward(Parcel &p, RequestInfo *pRI) {
     closeRequest;
     printRequest(pRI->token, pRI->pCI->requestNumber);
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &cff, sizeof(cff), pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &cff, sizeof(cff), pRI);
 
 #ifdef MEMSET_FREED
     memsetString(cff.number);
@@ -919,7 +2193,7 @@ dispatchRaw(Parcel &p, RequestInfo *pRI) {
     closeRequest;
     printRequest(pRI->token, pRI->pCI->requestNumber);
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, const_cast<void *>(data), len, pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, const_cast<void *>(data), len, pRI);
 
     return;
 invalid:
@@ -1016,7 +2290,7 @@ dispatchCdmaSms(Parcel &p, RequestInfo *pRI) {
         goto invalid;
     }
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &rcsm, sizeof(rcsm),pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &rcsm, sizeof(rcsm),pRI);
 
 #ifdef MEMSET_FREED
     memset(&rcsm, 0, sizeof(rcsm));
@@ -1045,7 +2319,7 @@ dispatchImsCdmaSms(Parcel &p, RequestInfo *pRI, uint8_t retry, int32_t messageRe
     rism.messageRef = messageRef;
     rism.message.cdmaMessage = &rcsm;
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &rism,
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &rism,
             sizeof(RIL_RadioTechnologyFamily)+sizeof(uint8_t)+sizeof(int32_t)
             +sizeof(rcsm),pRI);
 
@@ -1105,7 +2379,7 @@ dispatchImsGsmSms(Parcel &p, RequestInfo *pRI, uint8_t retry, int32_t messageRef
     printRequest(pRI->token, pRI->pCI->requestNumber);
 
     rism.message.gsmMessage = pStrings;
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &rism,
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &rism,
             sizeof(RIL_RadioTechnologyFamily)+sizeof(uint8_t)+sizeof(int32_t)
             +datalen, pRI);
 
@@ -1198,7 +2472,7 @@ dispatchCdmaSmsAck(Parcel &p, RequestInfo *pRI) {
 
     printRequest(pRI->token, pRI->pCI->requestNumber);
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &rcsa, sizeof(rcsa),pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &rcsa, sizeof(rcsa),pRI);
 
 #ifdef MEMSET_FREED
     memset(&rcsa, 0, sizeof(rcsa));
@@ -1257,7 +2531,7 @@ dispatchGsmBrSmsCnf(Parcel &p, RequestInfo *pRI) {
             goto invalid;
         }
 
-        s_callbacks.onRequest(pRI->pCI->requestNumber,
+        pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber,
                               gsmBciPtrs,
                               num * sizeof(RIL_GSM_BroadcastSmsConfigInfo *),
                               pRI);
@@ -1313,7 +2587,7 @@ dispatchCdmaBrSmsCnf(Parcel &p, RequestInfo *pRI) {
             goto invalid;
         }
 
-        s_callbacks.onRequest(pRI->pCI->requestNumber,
+        pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber,
                               cdmaBciPtrs,
                               num * sizeof(RIL_CDMA_BroadcastSmsConfigInfo *),
                               pRI);
@@ -1412,7 +2686,7 @@ static void dispatchRilCdmaSmsWriteArgs(Parcel &p, RequestInfo *pRI) {
 
     printRequest(pRI->token, pRI->pCI->requestNumber);
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &rcsw, sizeof(rcsw),pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &rcsw, sizeof(rcsw),pRI);
 
 #ifdef MEMSET_FREED
     memset(&rcsw, 0, sizeof(rcsw));
@@ -1458,7 +2732,9 @@ static void dispatchDataCall(Parcel& p, RequestInfo *pRI) {
 // When all RILs handle this request, this function can be removed and
 // the request can be sent directly to the RIL using dispatchVoid.
 static void dispatchVoiceRadioTech(Parcel& p, RequestInfo *pRI) {
-    RIL_RadioState state = s_callbacks.onStateRequest();
+    RilInstance *pInst = pRI->pInstance;
+    bool cached;
+    RIL_RadioState state = currentRadioState(pInst, &cached);
 
     if ((RADIO_STATE_UNAVAILABLE == state) || (RADIO_STATE_OFF == state)) {
         RIL_onRequestComplete(pRI, RIL_E_RADIO_NOT_AVAILABLE, NULL, 0);
@@ -1472,20 +2748,24 @@ static void dispatchVoiceRadioTech(Parcel& p, RequestInfo *pRI) {
 
     // For Older RILs, that do not support RADIO_STATE_ON, assume that they
     // will not support this new request either and decode Voice Radio Technology
-    // from Radio State
-    voiceRadioTech = decodeVoiceRadioTechnology(state);
+    // from Radio State, unless processRadioState() already did for this state
+    if (!cached) {
+        pInst->voiceRadioTech = decodeVoiceRadioTechnology(state);
+    }
 
-    if (voiceRadioTech < 0)
+    if (pInst->voiceRadioTech < 0)
         RIL_onRequestComplete(pRI, RIL_E_GENERIC_FAILURE, NULL, 0);
     else
-        RIL_onRequestComplete(pRI, RIL_E_SUCCESS, &voiceRadioTech, sizeof(int));
+        RIL_onRequestComplete(pRI, RIL_E_SUCCESS, &pInst->voiceRadioTech, sizeof(int));
 }
 
 // For backwards compatibility in RIL_REQUEST_CDMA_GET_SUBSCRIPTION_SOURCE:.
 // When all RILs handle this request, this function can be removed and
 // the request can be sent directly to the RIL using dispatchVoid.
 static void dispatchCdmaSubscriptionSource(Parcel& p, RequestInfo *pRI) {
-    RIL_RadioState state = s_callbacks.onStateRequest();
+    RilInstance *pInst = pRI->pInstance;
+    bool cached;
+    RIL_RadioState state = currentRadioState(pInst, &cached);
 
     if ((RADIO_STATE_UNAVAILABLE == state) || (RADIO_STATE_OFF == state)) {
         RIL_onRequestComplete(pRI, RIL_E_RADIO_NOT_AVAILABLE, NULL, 0);
@@ -1499,13 +2779,15 @@ static void dispatchCdmaSubscriptionSource(Parcel& p, RequestInfo *pRI) {
 
     // For Older RILs, that do not support RADIO_STATE_ON, assume that they
     // will not support this new request either and decode CDMA Subscription Source
-    // from Radio State
-    cdmaSubscriptionSource = decodeCdmaSubscriptionSource(state);
+    // from Radio State. processRadioState() only tracks it for 3GPP2 states.
+    if (!cached || pInst->cdmaSubscriptionSource < 0) {
+        pInst->cdmaSubscriptionSource = decodeCdmaSubscriptionSource(state);
+    }
 
-    if (cdmaSubscriptionSource < 0)
+    if (pInst->cdmaSubscriptionSource < 0)
         RIL_onRequestComplete(pRI, RIL_E_GENERIC_FAILURE, NULL, 0);
     else
-        RIL_onRequestComplete(pRI, RIL_E_SUCCESS, &cdmaSubscriptionSource, sizeof(int));
+        RIL_onRequestComplete(pRI, RIL_E_SUCCESS, &pInst->cdmaSubscriptionSource, sizeof(int));
 }
 
 static void dispatchSetInitialAttachApn(Parcel &p, RequestInfo *pRI)
@@ -1534,7 +2816,7 @@ static void dispatchSetInitialAttachApn(Parcel &p, RequestInfo *pRI)
     if (status != NO_ERROR) {
         goto invalid;
     }
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &pf, sizeof(pf), pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &pf, sizeof(pf), pRI);
 
 #ifdef MEMSET_FREED
     memsetString(pf.apn);
@@ -1596,7 +2878,7 @@ static void dispatchUiccSubscripton(Parcel &p, RequestInfo *pRI) {
     closeRequest;
     printRequest(pRI->token, pRI->pCI->requestNumber);
 
-    s_callbacks.onRequest(pRI->pCI->requestNumber, &uicc_sub, sizeof(uicc_sub), pRI);
+    pRI->pInstance->callbacks.onRequest(pRI->pCI->requestNumber, &uicc_sub, sizeof(uicc_sub), pRI);
 
 #ifdef MEMSET_FREED
     memset(&uicc_sub, 0, sizeof(uicc_sub));
@@ -1615,69 +2897,447 @@ blockingWrite(int fd, const void *buffer, size_t len) {
 
     toWrite = (const uint8_t *)buffer;
 
-    while (writeOffset < len) {
-        ssize_t written;
-        do {
-            written = write (fd, toWrite + writeOffset,
-                                len - writeOffset);
-        } while (written < 0 && ((errno == EINTR) || (errno == EAGAIN)));
+    while (writeOffset < len) {
+        ssize_t written;
+        do {
+            written = write (fd, toWrite + writeOffset,
+                                len - writeOffset);
+        } while (written < 0 && ((errno == EINTR) || (errno == EAGAIN)));
+
+        if (written >= 0) {
+            writeOffset += written;
+        } else {   // written < 0
+            RLOGE ("RIL Response: unexpected error on write errno:%d", errno);
+            close(fd);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+blockingWritev(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written;
+        for (;;) {
+            written = writev (fd, iov, iovcnt);
+            if (written >= 0 || ((errno != EINTR) && (errno != EAGAIN))) {
+                break;
+            }
+            METRIC_ADD(s_metrics.writeRetries, 1);
+        }
+
+        if (written < 0) {
+            RLOGE ("RIL Response: unexpected error on write errno:%d", errno);
+            close(fd);
+            return -1;
+        }
+
+        // skip what went out, a partial write resumes mid-vector
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            // a short write costs another round trip as well
+            METRIC_ADD(s_metrics.writeRetries, 1);
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+/* struct mmsghdr, which this bionic does not declare */
+typedef struct RilMmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} RilMmsghdr;
+
+/**
+ * recvmmsg()/sendmmsg() through the system call, as bionic lacks the
+ * wrappers; kernels without them get one recvmsg()/sendmsg() per
+ * datagram.
+ */
+static int
+rilRecvmmsg(int fd, RilMmsghdr *vec, unsigned int vlen, int flags) {
+#ifdef __NR_recvmmsg
+    int ret = syscall(__NR_recvmmsg, fd, vec, vlen, flags, NULL);
+    if (ret >= 0 || errno != ENOSYS) {
+        return ret;
+    }
+#endif
+    unsigned int n;
+    for (n = 0; n < vlen; n++) {
+        ssize_t got = recvmsg(fd, &vec[n].msg_hdr, n == 0 ? flags : flags | MSG_DONTWAIT);
+        if (got < 0) {
+            return n > 0 ? (int)n : -1;
+        }
+        vec[n].msg_len = got;
+        if (got == 0) {
+            return n + 1;
+        }
+    }
+    return n;
+}
+
+static int
+rilSendmmsg(int fd, RilMmsghdr *vec, unsigned int vlen, int flags) {
+#ifdef __NR_sendmmsg
+    int ret = syscall(__NR_sendmmsg, fd, vec, vlen, flags);
+    if (ret >= 0 || errno != ENOSYS) {
+        return ret;
+    }
+#endif
+    unsigned int n;
+    for (n = 0; n < vlen; n++) {
+        ssize_t sent = sendmsg(fd, &vec[n].msg_hdr, flags);
+        if (sent < 0) {
+            return n > 0 ? (int)n : -1;
+        }
+        vec[n].msg_len = sent;
+    }
+    return n;
+}
+
+/**
+ * Sends datagrams on a SOCK_SEQPACKET command socket, retrying while
+ * the socket buffer is full. Caller holds s_writeMutex.
+ */
+static int
+blockingSendmmsg(int fd, RilMmsghdr *vec, unsigned int vlen) {
+    while (vlen > 0) {
+        int sent;
+        for (;;) {
+            sent = rilSendmmsg(fd, vec, vlen, MSG_NOSIGNAL);
+            if (sent >= 0 || ((errno != EINTR) && (errno != EAGAIN))) {
+                break;
+            }
+            METRIC_ADD(s_metrics.writeRetries, 1);
+        }
+
+        if (sent < 0) {
+            RLOGE ("RIL Response: unexpected error on sendmmsg errno:%d", errno);
+            close(fd);
+            return -1;
+        }
+
+        vec += sent;
+        vlen -= sent;
+        if (vlen > 0) {
+            METRIC_ADD(s_metrics.writeRetries, 1);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copies the concatenation of iov[1..iovcnt-1] into a read-only ashmem
+ * region and sends a RESPONSE_SHARED_MEMORY record for it, with the fd
+ * attached through SCM_RIGHTS. The client maps the region and parses
+ * it like any other record, so large responses skip both the
+ * MAX_COMMAND_BYTES ceiling and the copies through the socket.
+ */
+static int
+sendResponseShared (RilInstance *pInst, struct iovec *iov, int iovcnt, size_t dataSize) {
+    int32_t record[3];
+    struct iovec out;
+    struct msghdr msg;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    uint8_t *region;
+    size_t offset = 0;
+    ssize_t written;
+    int shmFd;
+    int ret = 0;
+
+    shmFd = ashmem_create_region("libril-response", dataSize);
+    if (shmFd < 0) {
+        RLOGE("RIL: cannot create shared response region errno:%d", errno);
+        return -1;
+    }
+
+    region = (uint8_t *)mmap(NULL, dataSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED, shmFd, 0);
+    if (region == MAP_FAILED) {
+        RLOGE("RIL: cannot map shared response region errno:%d", errno);
+        close(shmFd);
+        return -1;
+    }
+
+    for (int i = 1; i < iovcnt; i++) {
+        memcpy(region + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    munmap(region, dataSize);
+
+    // the client only ever reads the response
+    ashmem_set_prot_region(shmFd, PROT_READ);
+
+    record[0] = htonl(sizeof(record) - sizeof(record[0]));
+    record[1] = RESPONSE_SHARED_MEMORY;
+    record[2] = dataSize;
+
+    if (pInst->seqpacket) {
+        // the datagram is the record, no length prefix
+        out.iov_base = &record[1];
+        out.iov_len = sizeof(record) - sizeof(record[0]);
+    } else {
+        out.iov_base = record;
+        out.iov_len = sizeof(record);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &out;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &shmFd, sizeof(int));
+
+    pthread_mutex_lock(&s_writeMutex);
+
+    for (;;) {
+        written = sendmsg(pInst->fdCommand, &msg, MSG_NOSIGNAL);
+        if (written >= 0 || ((errno != EINTR) && (errno != EAGAIN))) {
+            break;
+        }
+        METRIC_ADD(s_metrics.writeRetries, 1);
+    }
+
+    if (written < 0) {
+        RLOGE ("RIL Response: unexpected error on sendmsg errno:%d", errno);
+        close(pInst->fdCommand);
+        ret = -1;
+    } else if ((size_t)written < out.iov_len) {
+        // the fd went with the first byte, the rest is plain data
+        out.iov_base = (uint8_t *)out.iov_base + written;
+        out.iov_len -= written;
+        ret = blockingWritev(pInst->fdCommand, &out, 1);
+    }
+
+    pthread_mutex_unlock(&s_writeMutex);
+
+    close(shmFd);
+
+    if (ret == 0) {
+        METRIC_ADD(s_metrics.bytesWritten, out.iov_len);
+        METRIC_ADD(s_metrics.sharedResponses, 1);
+        METRIC_ADD(s_metrics.sharedBytes, dataSize);
+    }
+
+    return ret;
+}
+
+/**
+ * Frames the concatenation of iov[1..iovcnt-1] as one record and writes
+ * it with gather writes to the command socket of an instance. iov[0] is
+ * filled in with the length header; the vector is consumed. Callers
+ * other than the SMS pipeline go through sendResponseRawv().
+ */
+static int
+writeResponseRawv (RilInstance *pInst, struct iovec *iov, int iovcnt) {
+    int fd = pInst->fdCommand;
+    int ret;
+    uint32_t header;
+    size_t dataSize = 0;
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    for (int i = 1; i < iovcnt; i++) {
+        dataSize += iov[i].iov_len;
+    }
+
+    if (s_sharedMemoryThreshold > 0 && dataSize > s_sharedMemoryThreshold
+            && (pInst->clientFeatures & LIBRIL_FEATURE_SHARED_MEMORY)) {
+        return sendResponseShared(pInst, iov, iovcnt, dataSize);
+    }
+
+    if (dataSize > MAX_COMMAND_BYTES) {
+        RLOGE("RIL: packet larger than %u (%u)",
+                MAX_COMMAND_BYTES, (unsigned int )dataSize);
+
+        return -1;
+    }
+
+    if (pInst->seqpacket) {
+        RilMmsghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_hdr.msg_iov = iov + 1;
+        msg.msg_hdr.msg_iovlen = iovcnt - 1;
+
+        pthread_mutex_lock(&s_writeMutex);
+        ret = blockingSendmmsg(fd, &msg, 1);
+        pthread_mutex_unlock(&s_writeMutex);
+
+        if (ret == 0) {
+            METRIC_ADD(s_metrics.bytesWritten, dataSize);
+        }
+        return ret;
+    }
+
+    header = htonl(dataSize);
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+
+    pthread_mutex_lock(&s_writeMutex);
+
+    ret = blockingWritev(fd, iov, iovcnt);
+
+    pthread_mutex_unlock(&s_writeMutex);
+
+    if (ret == 0) {
+        METRIC_ADD(s_metrics.bytesWritten, sizeof(header) + dataSize);
+    }
+
+    return ret;
+}
+
+/**
+ * writeResponseRawv() after writing out the SMS completions the
+ * instance still holds in its batch, so that no response or
+ * unsolicited response overtakes them.
+ */
+static int
+sendResponseRawv (RilInstance *pInst, struct iovec *iov, int iovcnt) {
+    if (s_smsPipelineDepth > 0) {
+        pthread_mutex_lock(&s_smsMutex);
+        smsBatchFlushLocked(pInst);
+        pthread_mutex_unlock(&s_smsMutex);
+    }
+
+    return writeResponseRawv(pInst, iov, iovcnt);
+}
+
+/**
+ * sendResponseFramed() for SOCK_SEQPACKET: the length headers are
+ * stripped and the records go out as datagrams, up to SEQPACKET_BATCH
+ * per sendmmsg().
+ */
+static int
+sendResponseFramedSeqpacket (RilInstance *pInst, const uint8_t *records, size_t len) {
+    RilMmsghdr msgs[SEQPACKET_BATCH];
+    struct iovec iovs[SEQPACKET_BATCH];
+    size_t offset = 0;
+    size_t sent = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&s_writeMutex);
 
-        if (written >= 0) {
-            writeOffset += written;
-        } else {   // written < 0
-            RLOGE ("RIL Response: unexpected error on write errno:%d", errno);
-            close(fd);
-            return -1;
+    while (ret == 0 && offset < len) {
+        unsigned int n = 0;
+
+        memset(msgs, 0, sizeof(msgs));
+        while (n < SEQPACKET_BATCH && offset + sizeof(uint32_t) <= len) {
+            uint32_t header;
+
+            memcpy(&header, records + offset, sizeof(header));
+            iovs[n].iov_base = const_cast<uint8_t *>(records) + offset + sizeof(header);
+            iovs[n].iov_len = ntohl(header);
+            msgs[n].msg_hdr.msg_iov = &iovs[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            offset += sizeof(header) + iovs[n].iov_len;
+            sent += iovs[n].iov_len;
+            n++;
+        }
+        if (n == 0) {
+            break;
         }
+
+        ret = blockingSendmmsg(pInst->fdCommand, msgs, n);
     }
 
-    return 0;
+    pthread_mutex_unlock(&s_writeMutex);
+
+    if (ret == 0) {
+        METRIC_ADD(s_metrics.bytesWritten, sent);
+    }
+
+    return ret;
 }
 
+/**
+ * Writes records that already carry their length headers, as one
+ * gather-free write.
+ */
 static int
-sendResponseRaw (const void *data, size_t dataSize) {
-    int fd = s_fdCommand;
+sendResponseFramed (RilInstance *pInst, const void *records, size_t len) {
+    struct iovec iov;
     int ret;
-    uint32_t header;
 
-    if (s_fdCommand < 0) {
+    if (pInst->fdCommand < 0) {
         return -1;
     }
 
-    if (dataSize > MAX_COMMAND_BYTES) {
-        RLOGE("RIL: packet larger than %u (%u)",
-                MAX_COMMAND_BYTES, (unsigned int )dataSize);
-
-        return -1;
+    if (pInst->seqpacket) {
+        return sendResponseFramedSeqpacket(pInst, (const uint8_t *)records, len);
     }
 
+    iov.iov_base = const_cast<void *>(records);
+    iov.iov_len = len;
+
     pthread_mutex_lock(&s_writeMutex);
 
-    header = htonl(dataSize);
+    ret = blockingWritev(pInst->fdCommand, &iov, 1);
 
-    ret = blockingWrite(fd, (void *)&header, sizeof(header));
+    pthread_mutex_unlock(&s_writeMutex);
 
-    if (ret < 0) {
-        pthread_mutex_unlock(&s_writeMutex);
-        return ret;
+    if (ret == 0) {
+        METRIC_ADD(s_metrics.bytesWritten, len);
     }
 
-    ret = blockingWrite(fd, data, dataSize);
+    return ret;
+}
 
-    if (ret < 0) {
-        pthread_mutex_unlock(&s_writeMutex);
-        return ret;
-    }
+static int
+sendResponseRaw (RilInstance *pInst, const void *data, size_t dataSize) {
+    struct iovec iov[2];
 
-    pthread_mutex_unlock(&s_writeMutex);
+    iov[1].iov_base = const_cast<void *>(data);
+    iov[1].iov_len = dataSize;
 
-    return 0;
+    return sendResponseRawv(pInst, iov, 2);
+}
+
+/**
+ * Sends a response whose payload is a raw byte array, as responseRaw()
+ * would marshal it, without copying the bytes into the Parcel. p holds
+ * everything before the payload; the bytes are gathered straight from
+ * the vendor buffer and padded the way Parcel::write() pads them.
+ */
+static int
+sendResponseRawPayload (RilInstance *pInst, Parcel &p, const void *data, size_t dataSize) {
+    static const uint8_t padding[4] = {0, 0, 0, 0};
+    struct iovec iov[4];
+
+    p.writeInt32(dataSize);
+
+    iov[1].iov_base = const_cast<uint8_t *>(p.data());
+    iov[1].iov_len = p.dataSize();
+    iov[2].iov_base = const_cast<void *>(data);
+    iov[2].iov_len = dataSize;
+    iov[3].iov_base = const_cast<uint8_t *>(padding);
+    iov[3].iov_len = (4 - (dataSize & 3)) & 3;
+
+    printResponse;
+    return sendResponseRawv(pInst, iov, 4);
 }
 
 static int
-sendResponse (Parcel &p) {
+sendResponse (RilInstance *pInst, Parcel &p) {
     printResponse;
-    return sendResponseRaw(p.data(), p.dataSize());
+    return sendResponseRaw(pInst, p.data(), p.dataSize());
 }
 
 /** response is an int* pointing to an array of ints*/
@@ -2546,7 +4206,126 @@ static int responseSimRefresh(Parcel &p, void *response, size_t responselen) {
     return 0;
 }
 
-static int responseCellInfoList(Parcel &p, void *response, size_t responselen)
+static void writeCellIdentity(Parcel &p, const RIL_CellInfo *p_cur)
+{
+    switch(p_cur->cellInfoType) {
+        case RIL_CELL_INFO_TYPE_GSM: {
+            appendPrintBuf("%s GSM id: mcc=%d,mnc=%d,lac=%d,cid=%d,", printBuf,
+                p_cur->CellInfo.gsm.cellIdentityGsm.mcc,
+                p_cur->CellInfo.gsm.cellIdentityGsm.mnc,
+                p_cur->CellInfo.gsm.cellIdentityGsm.lac,
+                p_cur->CellInfo.gsm.cellIdentityGsm.cid);
+
+            p.writeInt32(p_cur->CellInfo.gsm.cellIdentityGsm.mcc);
+            p.writeInt32(p_cur->CellInfo.gsm.cellIdentityGsm.mnc);
+            p.writeInt32(p_cur->CellInfo.gsm.cellIdentityGsm.lac);
+            p.writeInt32(p_cur->CellInfo.gsm.cellIdentityGsm.cid);
+            break;
+        }
+        case RIL_CELL_INFO_TYPE_WCDMA: {
+            appendPrintBuf("%s WCDMA id: mcc=%d,mnc=%d,lac=%d,cid=%d,psc=%d,", printBuf,
+                p_cur->CellInfo.wcdma.cellIdentityWcdma.mcc,
+                p_cur->CellInfo.wcdma.cellIdentityWcdma.mnc,
+                p_cur->CellInfo.wcdma.cellIdentityWcdma.lac,
+                p_cur->CellInfo.wcdma.cellIdentityWcdma.cid,
+                p_cur->CellInfo.wcdma.cellIdentityWcdma.psc);
+
+            p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.mcc);
+            p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.mnc);
+            p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.lac);
+            p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.cid);
+            p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.psc);
+            break;
+        }
+        case RIL_CELL_INFO_TYPE_CDMA: {
+            appendPrintBuf("%s CDMA id: nId=%d,sId=%d,bsId=%d,long=%d,lat=%d", printBuf,
+                p_cur->CellInfo.cdma.cellIdentityCdma.networkId,
+                p_cur->CellInfo.cdma.cellIdentityCdma.systemId,
+                p_cur->CellInfo.cdma.cellIdentityCdma.basestationId,
+                p_cur->CellInfo.cdma.cellIdentityCdma.longitude,
+                p_cur->CellInfo.cdma.cellIdentityCdma.latitude);
+
+            p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.networkId);
+            p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.systemId);
+            p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.basestationId);
+            p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.longitude);
+            p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.latitude);
+            break;
+        }
+        case RIL_CELL_INFO_TYPE_LTE: {
+            appendPrintBuf("%s LTE id: mcc=%d,mnc=%d,ci=%d,pci=%d,tac=%d", printBuf,
+                p_cur->CellInfo.lte.cellIdentityLte.mcc,
+                p_cur->CellInfo.lte.cellIdentityLte.mnc,
+                p_cur->CellInfo.lte.cellIdentityLte.ci,
+                p_cur->CellInfo.lte.cellIdentityLte.pci,
+                p_cur->CellInfo.lte.cellIdentityLte.tac);
+
+            p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.mcc);
+            p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.mnc);
+            p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.ci);
+            p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.pci);
+            p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.tac);
+            break;
+        }
+    }
+}
+
+static void writeCellSignal(Parcel &p, const RIL_CellInfo *p_cur)
+{
+    switch(p_cur->cellInfoType) {
+        case RIL_CELL_INFO_TYPE_GSM: {
+            appendPrintBuf("%s gsmSS: ss=%d,ber=%d],", printBuf,
+                p_cur->CellInfo.gsm.signalStrengthGsm.signalStrength,
+                p_cur->CellInfo.gsm.signalStrengthGsm.bitErrorRate);
+
+            p.writeInt32(p_cur->CellInfo.gsm.signalStrengthGsm.signalStrength);
+            p.writeInt32(p_cur->CellInfo.gsm.signalStrengthGsm.bitErrorRate);
+            break;
+        }
+        case RIL_CELL_INFO_TYPE_WCDMA: {
+            appendPrintBuf("%s wcdmaSS: ss=%d,ber=%d],", printBuf,
+                p_cur->CellInfo.wcdma.signalStrengthWcdma.signalStrength,
+                p_cur->CellInfo.wcdma.signalStrengthWcdma.bitErrorRate);
+
+            p.writeInt32(p_cur->CellInfo.wcdma.signalStrengthWcdma.signalStrength);
+            p.writeInt32(p_cur->CellInfo.wcdma.signalStrengthWcdma.bitErrorRate);
+            break;
+        }
+        case RIL_CELL_INFO_TYPE_CDMA: {
+            appendPrintBuf("%s cdmaSS: dbm=%d ecio=%d evdoSS: dbm=%d,ecio=%d,snr=%d", printBuf,
+                p_cur->CellInfo.cdma.signalStrengthCdma.dbm,
+                p_cur->CellInfo.cdma.signalStrengthCdma.ecio,
+                p_cur->CellInfo.cdma.signalStrengthEvdo.dbm,
+                p_cur->CellInfo.cdma.signalStrengthEvdo.ecio,
+                p_cur->CellInfo.cdma.signalStrengthEvdo.signalNoiseRatio);
+
+            p.writeInt32(p_cur->CellInfo.cdma.signalStrengthCdma.dbm);
+            p.writeInt32(p_cur->CellInfo.cdma.signalStrengthCdma.ecio);
+            p.writeInt32(p_cur->CellInfo.cdma.signalStrengthEvdo.dbm);
+            p.writeInt32(p_cur->CellInfo.cdma.signalStrengthEvdo.ecio);
+            p.writeInt32(p_cur->CellInfo.cdma.signalStrengthEvdo.signalNoiseRatio);
+            break;
+        }
+        case RIL_CELL_INFO_TYPE_LTE: {
+            appendPrintBuf("%s lteSS: ss=%d,rsrp=%d,rsrq=%d,rssnr=%d,cqi=%d,ta=%d", printBuf,
+                p_cur->CellInfo.lte.signalStrengthLte.signalStrength,
+                p_cur->CellInfo.lte.signalStrengthLte.rsrp,
+                p_cur->CellInfo.lte.signalStrengthLte.rsrq,
+                p_cur->CellInfo.lte.signalStrengthLte.rssnr,
+                p_cur->CellInfo.lte.signalStrengthLte.cqi,
+                p_cur->CellInfo.lte.signalStrengthLte.timingAdvance);
+            p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.signalStrength);
+            p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.rsrp);
+            p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.rsrq);
+            p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.rssnr);
+            p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.cqi);
+            p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.timingAdvance);
+            break;
+        }
+    }
+}
+
+static int validateCellInfoList(void *response, size_t responselen)
 {
     if (response == NULL && responselen != 0) {
         RLOGE("invalid response: NULL");
@@ -2559,6 +4338,16 @@ static int responseCellInfoList(Parcel &p, void *response, size_t responselen)
         return RIL_ERRNO_INVALID_RESPONSE;
     }
 
+    return 0;
+}
+
+static int responseCellInfoList(Parcel &p, void *response, size_t responselen)
+{
+    int ret = validateCellInfoList(response, responselen);
+    if (ret != 0) {
+        return ret;
+    }
+
     int num = responselen / sizeof(RIL_CellInfo);
     p.writeInt32(num);
 
@@ -2572,106 +4361,323 @@ static int responseCellInfoList(Parcel &p, void *response, size_t responselen)
         p.writeInt32(p_cur->registered);
         p.writeInt32(p_cur->timeStampType);
         p.writeInt64(p_cur->timeStamp);
-        switch(p_cur->cellInfoType) {
-            case RIL_CELL_INFO_TYPE_GSM: {
-                appendPrintBuf("%s GSM id: mcc=%d,mnc=%d,lac=%d,cid=%d,", printBuf,
-                    p_cur->CellInfo.gsm.cellIdentityGsm.mcc,
-                    p_cur->CellInfo.gsm.cellIdentityGsm.mnc,
-                    p_cur->CellInfo.gsm.cellIdentityGsm.lac,
-                    p_cur->CellInfo.gsm.cellIdentityGsm.cid);
-                appendPrintBuf("%s gsmSS: ss=%d,ber=%d],", printBuf,
-                    p_cur->CellInfo.gsm.signalStrengthGsm.signalStrength,
-                    p_cur->CellInfo.gsm.signalStrengthGsm.bitErrorRate);
-
-                p.writeInt32(p_cur->CellInfo.gsm.cellIdentityGsm.mcc);
-                p.writeInt32(p_cur->CellInfo.gsm.cellIdentityGsm.mnc);
-                p.writeInt32(p_cur->CellInfo.gsm.cellIdentityGsm.lac);
-                p.writeInt32(p_cur->CellInfo.gsm.cellIdentityGsm.cid);
-                p.writeInt32(p_cur->CellInfo.gsm.signalStrengthGsm.signalStrength);
-                p.writeInt32(p_cur->CellInfo.gsm.signalStrengthGsm.bitErrorRate);
-                break;
-            }
-            case RIL_CELL_INFO_TYPE_WCDMA: {
-                appendPrintBuf("%s WCDMA id: mcc=%d,mnc=%d,lac=%d,cid=%d,psc=%d,", printBuf,
-                    p_cur->CellInfo.wcdma.cellIdentityWcdma.mcc,
-                    p_cur->CellInfo.wcdma.cellIdentityWcdma.mnc,
-                    p_cur->CellInfo.wcdma.cellIdentityWcdma.lac,
-                    p_cur->CellInfo.wcdma.cellIdentityWcdma.cid,
-                    p_cur->CellInfo.wcdma.cellIdentityWcdma.psc);
-                appendPrintBuf("%s wcdmaSS: ss=%d,ber=%d],", printBuf,
-                    p_cur->CellInfo.wcdma.signalStrengthWcdma.signalStrength,
-                    p_cur->CellInfo.wcdma.signalStrengthWcdma.bitErrorRate);
-
-                p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.mcc);
-                p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.mnc);
-                p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.lac);
-                p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.cid);
-                p.writeInt32(p_cur->CellInfo.wcdma.cellIdentityWcdma.psc);
-                p.writeInt32(p_cur->CellInfo.wcdma.signalStrengthWcdma.signalStrength);
-                p.writeInt32(p_cur->CellInfo.wcdma.signalStrengthWcdma.bitErrorRate);
-                break;
-            }
-            case RIL_CELL_INFO_TYPE_CDMA: {
-                appendPrintBuf("%s CDMA id: nId=%d,sId=%d,bsId=%d,long=%d,lat=%d", printBuf,
-                    p_cur->CellInfo.cdma.cellIdentityCdma.networkId,
-                    p_cur->CellInfo.cdma.cellIdentityCdma.systemId,
-                    p_cur->CellInfo.cdma.cellIdentityCdma.basestationId,
-                    p_cur->CellInfo.cdma.cellIdentityCdma.longitude,
-                    p_cur->CellInfo.cdma.cellIdentityCdma.latitude);
-
-                p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.networkId);
-                p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.systemId);
-                p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.basestationId);
-                p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.longitude);
-                p.writeInt32(p_cur->CellInfo.cdma.cellIdentityCdma.latitude);
-
-                appendPrintBuf("%s cdmaSS: dbm=%d ecio=%d evdoSS: dbm=%d,ecio=%d,snr=%d", printBuf,
-                    p_cur->CellInfo.cdma.signalStrengthCdma.dbm,
-                    p_cur->CellInfo.cdma.signalStrengthCdma.ecio,
-                    p_cur->CellInfo.cdma.signalStrengthEvdo.dbm,
-                    p_cur->CellInfo.cdma.signalStrengthEvdo.ecio,
-                    p_cur->CellInfo.cdma.signalStrengthEvdo.signalNoiseRatio);
-
-                p.writeInt32(p_cur->CellInfo.cdma.signalStrengthCdma.dbm);
-                p.writeInt32(p_cur->CellInfo.cdma.signalStrengthCdma.ecio);
-                p.writeInt32(p_cur->CellInfo.cdma.signalStrengthEvdo.dbm);
-                p.writeInt32(p_cur->CellInfo.cdma.signalStrengthEvdo.ecio);
-                p.writeInt32(p_cur->CellInfo.cdma.signalStrengthEvdo.signalNoiseRatio);
+        writeCellIdentity(p, p_cur);
+        writeCellSignal(p, p_cur);
+        p_cur += 1;
+    }
+    removeLastChar;
+    closeResponse;
+
+    return 0;
+}
+
+static bool sameCellIdentity(const RIL_CellInfo *a, const RIL_CellInfo *b)
+{
+    if (a->cellInfoType != b->cellInfoType) {
+        return false;
+    }
+
+    switch(a->cellInfoType) {
+        case RIL_CELL_INFO_TYPE_GSM:
+            return memcmp(&a->CellInfo.gsm.cellIdentityGsm,
+                    &b->CellInfo.gsm.cellIdentityGsm,
+                    sizeof(a->CellInfo.gsm.cellIdentityGsm)) == 0;
+        case RIL_CELL_INFO_TYPE_WCDMA:
+            return memcmp(&a->CellInfo.wcdma.cellIdentityWcdma,
+                    &b->CellInfo.wcdma.cellIdentityWcdma,
+                    sizeof(a->CellInfo.wcdma.cellIdentityWcdma)) == 0;
+        case RIL_CELL_INFO_TYPE_CDMA:
+            return memcmp(&a->CellInfo.cdma.cellIdentityCdma,
+                    &b->CellInfo.cdma.cellIdentityCdma,
+                    sizeof(a->CellInfo.cdma.cellIdentityCdma)) == 0;
+        case RIL_CELL_INFO_TYPE_LTE:
+            return memcmp(&a->CellInfo.lte.cellIdentityLte,
+                    &b->CellInfo.lte.cellIdentityLte,
+                    sizeof(a->CellInfo.lte.cellIdentityLte)) == 0;
+        default:
+            return false;
+    }
+}
+
+/* Timestamp-only updates do not count as a change */
+static bool cellInfoChanged(const RIL_CellInfo *a, const RIL_CellInfo *b)
+{
+    if (a->registered != b->registered) {
+        return true;
+    }
+
+    switch(a->cellInfoType) {
+        case RIL_CELL_INFO_TYPE_GSM:
+            return memcmp(&a->CellInfo.gsm.signalStrengthGsm,
+                    &b->CellInfo.gsm.signalStrengthGsm,
+                    sizeof(a->CellInfo.gsm.signalStrengthGsm)) != 0;
+        case RIL_CELL_INFO_TYPE_WCDMA:
+            return memcmp(&a->CellInfo.wcdma.signalStrengthWcdma,
+                    &b->CellInfo.wcdma.signalStrengthWcdma,
+                    sizeof(a->CellInfo.wcdma.signalStrengthWcdma)) != 0;
+        case RIL_CELL_INFO_TYPE_CDMA:
+            return memcmp(&a->CellInfo.cdma.signalStrengthCdma,
+                    &b->CellInfo.cdma.signalStrengthCdma,
+                    sizeof(a->CellInfo.cdma.signalStrengthCdma)) != 0
+                || memcmp(&a->CellInfo.cdma.signalStrengthEvdo,
+                    &b->CellInfo.cdma.signalStrengthEvdo,
+                    sizeof(a->CellInfo.cdma.signalStrengthEvdo)) != 0;
+        case RIL_CELL_INFO_TYPE_LTE:
+            return memcmp(&a->CellInfo.lte.signalStrengthLte,
+                    &b->CellInfo.lte.signalStrengthLte,
+                    sizeof(a->CellInfo.lte.signalStrengthLte)) != 0;
+        default:
+            return true;
+    }
+}
+
+/**
+ * Forgets the cells and neighbours last sent in delta form, so the
+ * next report goes out as all "added". Called whenever the client
+ * (re)negotiates the delta features.
+ */
+static void resetCellDeltaCache(RilInstance *pInst)
+{
+    pthread_mutex_lock(&s_cellDeltaMutex);
+    memset(pInst->cellInfoSlots, 0, sizeof(pInst->cellInfoSlots));
+    memset(pInst->neighborSlots, 0, sizeof(pInst->neighborSlots));
+    pthread_mutex_unlock(&s_cellDeltaMutex);
+}
+
+/**
+ * Delta form of responseCellInfoList() for RIL_UNSOL_LIBRIL_CELL_INFO_DELTA.
+ * Every cell the client knows about lives in a slot, keyed by its
+ * identity:
+ *
+ *   int32 flags
+ *   if flags & CELL_DELTA_FULL:
+ *     the responseCellInfoList() payload, all slots are dropped
+ *   else:
+ *     int32 count, count * {int32 slot}                         removed
+ *     int32 count, count * {int32 slot, full cell}              added
+ *     int32 count, count * {int32 slot, int32 registered,
+ *             int32 timeStampType, int64 timeStamp, signal}     changed
+ *
+ * Removed slots are freed before added cells are placed, so a slot can
+ * be reused within one report. Cells that only got a new timestamp are
+ * left out.
+ */
+static int responseCellInfoListDelta(RilInstance *pInst, Parcel &p,
+        void *response, size_t responselen)
+{
+    int ret = validateCellInfoList(response, responselen);
+    if (ret != 0) {
+        return ret;
+    }
+
+    int num = responselen / sizeof(RIL_CellInfo);
+    RIL_CellInfo *cells = (RIL_CellInfo *) response;
+
+    pthread_mutex_lock(&s_cellDeltaMutex);
+
+    if (num > MAX_CELL_DELTA_SLOTS) {
+        memset(pInst->cellInfoSlots, 0, sizeof(pInst->cellInfoSlots));
+        pthread_mutex_unlock(&s_cellDeltaMutex);
+
+        p.writeInt32(CELL_DELTA_FULL);
+        return responseCellInfoList(p, response, responselen);
+    }
+
+    int slotOf[MAX_CELL_DELTA_SLOTS];
+    bool changed[MAX_CELL_DELTA_SLOTS];
+    bool matched[MAX_CELL_DELTA_SLOTS];
+    int numRemoved = 0, numAdded = 0, numChanged = 0;
+
+    memset(matched, 0, sizeof(matched));
+
+    for (int i = 0; i < num; i++) {
+        slotOf[i] = -1;
+        changed[i] = false;
+        for (int s = 0; s < MAX_CELL_DELTA_SLOTS; s++) {
+            if (pInst->cellInfoSlots[s].used && !matched[s]
+                    && sameCellIdentity(&pInst->cellInfoSlots[s].cell, &cells[i])) {
+                slotOf[i] = s;
+                matched[s] = true;
+                changed[i] = cellInfoChanged(&pInst->cellInfoSlots[s].cell, &cells[i]);
                 break;
             }
-            case RIL_CELL_INFO_TYPE_LTE: {
-                appendPrintBuf("%s LTE id: mcc=%d,mnc=%d,ci=%d,pci=%d,tac=%d", printBuf,
-                    p_cur->CellInfo.lte.cellIdentityLte.mcc,
-                    p_cur->CellInfo.lte.cellIdentityLte.mnc,
-                    p_cur->CellInfo.lte.cellIdentityLte.ci,
-                    p_cur->CellInfo.lte.cellIdentityLte.pci,
-                    p_cur->CellInfo.lte.cellIdentityLte.tac);
-
-                p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.mcc);
-                p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.mnc);
-                p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.ci);
-                p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.pci);
-                p.writeInt32(p_cur->CellInfo.lte.cellIdentityLte.tac);
-
-                appendPrintBuf("%s lteSS: ss=%d,rsrp=%d,rsrq=%d,rssnr=%d,cqi=%d,ta=%d", printBuf,
-                    p_cur->CellInfo.lte.signalStrengthLte.signalStrength,
-                    p_cur->CellInfo.lte.signalStrengthLte.rsrp,
-                    p_cur->CellInfo.lte.signalStrengthLte.rsrq,
-                    p_cur->CellInfo.lte.signalStrengthLte.rssnr,
-                    p_cur->CellInfo.lte.signalStrengthLte.cqi,
-                    p_cur->CellInfo.lte.signalStrengthLte.timingAdvance);
-                p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.signalStrength);
-                p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.rsrp);
-                p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.rsrq);
-                p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.rssnr);
-                p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.cqi);
-                p.writeInt32(p_cur->CellInfo.lte.signalStrengthLte.timingAdvance);
+        }
+        if (slotOf[i] < 0) {
+            numAdded++;
+        } else if (changed[i]) {
+            numChanged++;
+        }
+    }
+
+    for (int s = 0; s < MAX_CELL_DELTA_SLOTS; s++) {
+        if (pInst->cellInfoSlots[s].used && !matched[s]) numRemoved++;
+    }
+
+    startResponse;
+    p.writeInt32(0);
+
+    p.writeInt32(numRemoved);
+    for (int s = 0; s < MAX_CELL_DELTA_SLOTS; s++) {
+        if (pInst->cellInfoSlots[s].used && !matched[s]) {
+            pInst->cellInfoSlots[s].used = false;
+            p.writeInt32(s);
+        }
+    }
+
+    p.writeInt32(numAdded);
+    for (int i = 0, s = 0; i < num; i++) {
+        if (slotOf[i] >= 0) {
+            continue;
+        }
+        // there are at least as many free slots as added cells
+        while (pInst->cellInfoSlots[s].used) s++;
+        pInst->cellInfoSlots[s].used = true;
+        pInst->cellInfoSlots[s].cell = cells[i];
+
+        p.writeInt32(s);
+        p.writeInt32((int)cells[i].cellInfoType);
+        p.writeInt32(cells[i].registered);
+        p.writeInt32(cells[i].timeStampType);
+        p.writeInt64(cells[i].timeStamp);
+        writeCellIdentity(p, &cells[i]);
+        writeCellSignal(p, &cells[i]);
+    }
+
+    p.writeInt32(numChanged);
+    for (int i = 0; i < num; i++) {
+        if (slotOf[i] < 0) {
+            continue;
+        }
+        if (changed[i]) {
+            p.writeInt32(slotOf[i]);
+            p.writeInt32(cells[i].registered);
+            p.writeInt32(cells[i].timeStampType);
+            p.writeInt64(cells[i].timeStamp);
+            writeCellSignal(p, &cells[i]);
+        }
+        pInst->cellInfoSlots[slotOf[i]].cell = cells[i];
+    }
+
+    pthread_mutex_unlock(&s_cellDeltaMutex);
+
+    appendPrintBuf("%s delta: removed=%d,added=%d,changed=%d,", printBuf,
+            numRemoved, numAdded, numChanged);
+    removeLastChar;
+    closeResponse;
+
+    return 0;
+}
+
+/**
+ * Delta form of responseCellList() for RIL_REQUEST_GET_NEIGHBORING_CELL_IDS,
+ * against the neighbour list last returned on this connection. Same
+ * layout as responseCellInfoListDelta(), neighbours are keyed by cid:
+ *
+ *   added:   {int32 slot, int32 rssi, String cid}
+ *   changed: {int32 slot, int32 rssi}
+ */
+static int responseCellListDelta(RilInstance *pInst, Parcel &p,
+        void *response, size_t responselen)
+{
+    if (response == NULL && responselen != 0) {
+        RLOGE("invalid response: NULL");
+        return RIL_ERRNO_INVALID_RESPONSE;
+    }
+
+    if (responselen % sizeof (RIL_NeighboringCell *) != 0) {
+        RLOGE("invalid response length %d expected multiple of %d\n",
+            (int)responselen, (int)sizeof (RIL_NeighboringCell *));
+        return RIL_ERRNO_INVALID_RESPONSE;
+    }
+
+    int num = responselen / sizeof(RIL_NeighboringCell *);
+    RIL_NeighboringCell **cells = (RIL_NeighboringCell **) response;
+    bool fits = (num <= MAX_CELL_DELTA_SLOTS);
+
+    for (int i = 0; fits && i < num; i++) {
+        if (cells[i]->cid == NULL || strlen(cells[i]->cid) >= MAX_NEIGHBOR_CID_LEN) {
+            fits = false;
+        }
+    }
+
+    pthread_mutex_lock(&s_cellDeltaMutex);
+
+    if (!fits) {
+        memset(pInst->neighborSlots, 0, sizeof(pInst->neighborSlots));
+        pthread_mutex_unlock(&s_cellDeltaMutex);
+
+        p.writeInt32(CELL_DELTA_FULL);
+        return responseCellList(p, response, responselen);
+    }
+
+    int slotOf[MAX_CELL_DELTA_SLOTS];
+    bool matched[MAX_CELL_DELTA_SLOTS];
+    int numRemoved = 0, numAdded = 0, numChanged = 0;
+
+    memset(matched, 0, sizeof(matched));
+
+    for (int i = 0; i < num; i++) {
+        slotOf[i] = -1;
+        for (int s = 0; s < MAX_CELL_DELTA_SLOTS; s++) {
+            if (pInst->neighborSlots[s].used && !matched[s]
+                    && strcmp(pInst->neighborSlots[s].cid, cells[i]->cid) == 0) {
+                slotOf[i] = s;
+                matched[s] = true;
                 break;
             }
         }
-        p_cur += 1;
+        if (slotOf[i] < 0) {
+            numAdded++;
+        } else if (pInst->neighborSlots[slotOf[i]].rssi != cells[i]->rssi) {
+            numChanged++;
+        }
     }
-    removeLastChar;
+
+    for (int s = 0; s < MAX_CELL_DELTA_SLOTS; s++) {
+        if (pInst->neighborSlots[s].used && !matched[s]) numRemoved++;
+    }
+
+    startResponse;
+    p.writeInt32(0);
+
+    p.writeInt32(numRemoved);
+    for (int s = 0; s < MAX_CELL_DELTA_SLOTS; s++) {
+        if (pInst->neighborSlots[s].used && !matched[s]) {
+            pInst->neighborSlots[s].used = false;
+            p.writeInt32(s);
+        }
+    }
+
+    p.writeInt32(numAdded);
+    for (int i = 0, s = 0; i < num; i++) {
+        if (slotOf[i] >= 0) {
+            continue;
+        }
+        while (pInst->neighborSlots[s].used) s++;
+        pInst->neighborSlots[s].used = true;
+        pInst->neighborSlots[s].rssi = cells[i]->rssi;
+        strcpy(pInst->neighborSlots[s].cid, cells[i]->cid);
+
+        p.writeInt32(s);
+        p.writeInt32(cells[i]->rssi);
+        writeStringToParcel (p, cells[i]->cid);
+    }
+
+    p.writeInt32(numChanged);
+    for (int i = 0; i < num; i++) {
+        if (slotOf[i] < 0 || pInst->neighborSlots[slotOf[i]].rssi == cells[i]->rssi) {
+            continue;
+        }
+        pInst->neighborSlots[slotOf[i]].rssi = cells[i]->rssi;
+
+        p.writeInt32(slotOf[i]);
+        p.writeInt32(cells[i]->rssi);
+    }
+
+    pthread_mutex_unlock(&s_cellDeltaMutex);
+
+    appendPrintBuf("%s[delta: removed=%d,added=%d,changed=%d]", printBuf,
+            numRemoved, numAdded, numChanged);
     closeResponse;
 
     return 0;
@@ -2993,11 +4999,12 @@ static void processWakeupCallback(int fd, short flags, void *param) {
     } while (ret > 0 || (ret < 0 && errno == EINTR));
 }
 
-static void onCommandsSocketClosed() {
+static void onCommandsSocketClosed(RilInstance *pInst) {
     int ret;
     RequestInfo *p_cur;
 
-    /* mark pending requests as "cancelled" so we dont report responses */
+    /* mark pending requests of this instance as "cancelled" so we dont
+       report responses */
 
     ret = pthread_mutex_lock(&s_pendingRequestsMutex);
     assert (ret == 0);
@@ -3008,22 +5015,58 @@ static void onCommandsSocketClosed() {
             ; p_cur != NULL
             ; p_cur  = p_cur->p_next
     ) {
-        p_cur->cancelled = 1;
+        if (p_cur->pInstance == pInst) {
+            p_cur->cancelled = 1;
+        }
     }
 
     ret = pthread_mutex_unlock(&s_pendingRequestsMutex);
     assert (ret == 0);
+
+    /* requests still waiting for admission never reached the vendor */
+    smsPipelineReset(pInst);
+    flushDeferredRequests(pInst);
+
+    pInst->clientFeatures = 0;
+}
+
+/**
+ * Tears down the command connection of an instance and listens for the
+ * next client on every listen socket again.
+ */
+static void closeCommandConnection(RilInstance *pInst) {
+    if (pInst->fdCommand >= 0) {
+        close(pInst->fdCommand);
+    }
+    pInst->fdCommand = -1;
+
+    ril_event_del(&pInst->commands_event);
+
+    if (pInst->p_rs != NULL) {
+        record_stream_free(pInst->p_rs);
+        pInst->p_rs = NULL;
+    }
+    pInst->seqpacket = false;
+
+    /* start listening for new connections again */
+    rilEventAddWakeup(&pInst->listen_event);
+    if (pInst->fdListenSeq >= 0) {
+        rilEventAddWakeup(&pInst->listen_seq_event);
+    }
+
+    onCommandsSocketClosed(pInst);
 }
 
 static void processCommandsCallback(int fd, short flags, void *param) {
+    RilInstance *pInst = (RilInstance *)param;
     RecordStream *p_rs;
     void *p_record;
     size_t recordlen;
     int ret;
 
-    assert(fd == s_fdCommand);
+    assert(fd == pInst->fdCommand);
 
-    p_rs = (RecordStream *)param;
+    p_rs = pInst->p_rs;
 
     for (;;) {
         /* loop until EAGAIN/EINTR, end of stream, or other error */
@@ -3034,56 +5077,205 @@ static void processCommandsCallback(int fd, short flags, void *param) {
             break;
         } else if (ret < 0) {
             break;
-        } else if (ret == 0) { /* && p_record != NULL */
-            processCommandBuffer(p_record, recordlen);
+        } else if (ret == 0) { /* && p_record != NULL */
+            METRIC_ADD(s_metrics.bytesRead, sizeof(uint32_t) + recordlen);
+            processCommandBuffer(pInst, p_record, recordlen);
+        }
+    }
+
+    if (ret == 0 || !(errno == EAGAIN || errno == EINTR)) {
+        /* fatal error or end-of-stream */
+        if (ret != 0) {
+            RLOGE("error on reading command socket errno:%d\n", errno);
+        } else {
+            RLOGW("EOS.  Closing command socket.");
+        }
+
+        closeCommandConnection(pInst);
+    }
+}
+
+/**
+ * processCommandsCallback() for SOCK_SEQPACKET connections. Every
+ * datagram is one record and up to SEQPACKET_BATCH of them are read
+ * per recvmmsg() straight into a buffer shared by all instances, which
+ * is fine as the event loop handles one callback at a time and
+ * processCommandBuffer() copies whatever it keeps.
+ */
+static void processSeqpacketCallback(int fd, short flags, void *param) {
+    static uint8_t buffers[SEQPACKET_BATCH][MAX_COMMAND_BYTES];
+    RilInstance *pInst = (RilInstance *)param;
+    RilMmsghdr msgs[SEQPACKET_BATCH];
+    struct iovec iovs[SEQPACKET_BATCH];
+    int ret;
+
+    assert(fd == pInst->fdCommand);
+
+    for (;;) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < SEQPACKET_BATCH; i++) {
+            iovs[i].iov_base = buffers[i];
+            iovs[i].iov_len = sizeof(buffers[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        ret = rilRecvmmsg(fd, msgs, SEQPACKET_BATCH, MSG_DONTWAIT);
+        if (ret <= 0) {
+            break;
+        }
+
+        for (int i = 0; i < ret; i++) {
+            if (msgs[i].msg_len == 0) {
+                /* end-of-stream */
+                ret = 0;
+                break;
+            }
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                RLOGE("dropping record larger than %u", MAX_COMMAND_BYTES);
+                continue;
+            }
+            METRIC_ADD(s_metrics.bytesRead, msgs[i].msg_len);
+            processCommandBuffer(pInst, buffers[i], msgs[i].msg_len);
+        }
+
+        if (ret == 0) {
+            break;
         }
     }
 
     if (ret == 0 || !(errno == EAGAIN || errno == EINTR)) {
-        /* fatal error or end-of-stream */
         if (ret != 0) {
             RLOGE("error on reading command socket errno:%d\n", errno);
         } else {
             RLOGW("EOS.  Closing command socket.");
         }
 
-        close(s_fdCommand);
-        s_fdCommand = -1;
+        closeCommandConnection(pInst);
+    }
+}
 
-        ril_event_del(&s_commands_event);
 
-        record_stream_free(p_rs);
+/**
+ * RIL_REQUEST_LIBRIL_SET_FEATURES, answered by libril itself.
+ * The request is an int array whose first element holds the wanted
+ * LIBRIL_FEATURE_* bits; the response is the subset actually enabled.
+ * Features stay enabled until the command socket is closed.
+ */
+static void processSetFeatures(RilInstance *pInst, Parcel &p, int32_t token) {
+    int32_t count = 0;
+    int32_t wanted = 0;
+    status_t status;
+    Parcel resp;
+
+    status = p.readInt32(&count);
+    if (status == NO_ERROR && count >= 1) {
+        status = p.readInt32(&wanted);
+    }
 
-        /* start listening for new connections again */
-        rilEventAddWakeup(&s_listen_event);
+    resp.writeInt32 (RESPONSE_SOLICITED);
+    resp.writeInt32 (token);
 
-        onCommandsSocketClosed();
+    if (status != NO_ERROR || count < 1) {
+        RLOGE("invalid libril feature request, token %d", token);
+        resp.writeInt32 (RIL_E_GENERIC_FAILURE);
+        sendResponse(pInst, resp);
+        return;
     }
+
+    // the delta baselines restart with the new feature set
+    resetCellDeltaCache(pInst);
+    pInst->clientFeatures = wanted & LIBRIL_FEATURES_SUPPORTED;
+
+    RLOGI("libril features: requested 0x%x, enabled 0x%x on %s",
+            wanted, pInst->clientFeatures, pInst->socketName);
+
+    resp.writeInt32 (RIL_E_SUCCESS);
+    resp.writeInt32 (1);
+    resp.writeInt32 (pInst->clientFeatures);
+    sendResponse(pInst, resp);
 }
 
+/**
+ * Sends the unsolicited responses restored from the checkpoint, in the
+ * order they were received, skipping stale ones.
+ */
+static void checkpointReplay(RilInstance *pInst) {
+    CheckpointInstance *ci = &s_checkpoint->instances[pInst->id];
+    int64_t now = elapsedRealtime();
+    bool sent[CHECKPOINT_REPLAY_SLOTS] = {false};
+    int count = 0;
+
+    pInst->replayPending = false;
+
+    pthread_mutex_lock(&s_checkpointMutex);
+    for (;;) {
+        CheckpointUnsol *oldest = NULL;
+        int oldestIndex = -1;
+
+        for (int i = 0; i < CHECKPOINT_REPLAY_SLOTS; i++) {
+            CheckpointUnsol *cur = &ci->replay[i];
+            if (sent[i] || cur->unsolResponse == 0
+                    || now - cur->time > CHECKPOINT_REPLAY_MAX_AGE_MS) {
+                continue;
+            }
+            if (oldest == NULL || cur->time < oldest->time) {
+                oldest = cur;
+                oldestIndex = i;
+            }
+        }
+
+        if (oldest == NULL) {
+            break;
+        }
+
+        sent[oldestIndex] = true;
+        sendResponseRaw(pInst, oldest->data, oldest->len);
+        count++;
+    }
+    pthread_mutex_unlock(&s_checkpointMutex);
+
+    RLOGI("checkpoint: replayed %d unsolicited responses on %s",
+            count, pInst->socketName);
+}
 
-static void onNewCommandConnect() {
+static void onNewCommandConnect(RilInstance *pInst) {
     // Inform we are connected and the ril version
-    int rilVer = s_callbacks.version;
-    RIL_onUnsolicitedResponse(RIL_UNSOL_RIL_CONNECTED,
+    int rilVer = pInst->callbacks.version;
+
+    pInst->clientFeatures = 0;
+    resetCellDeltaCache(pInst);
+
+    RIL_onUnsolicitedResponseInstance(pInst->id, RIL_UNSOL_RIL_CONNECTED,
                                     &rilVer, sizeof(rilVer));
 
-    // implicit radio state changed
-    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
-                                    NULL, 0);
+    // implicit radio state changed, from the cache once the vendor
+    // reported one
+    if (!sendCachedRadioState(pInst)) {
+        RIL_onUnsolicitedResponseInstance(pInst->id,
+                                        RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
+                                        NULL, 0);
+    }
 
     // Send last NITZ time data, in case it was missed
-    if (s_lastNITZTimeData != NULL) {
-        sendResponseRaw(s_lastNITZTimeData, s_lastNITZTimeDataSize);
+    if (pInst->lastNITZTimeData != NULL) {
+        sendResponseRaw(pInst, pInst->lastNITZTimeData,
+                pInst->lastNITZTimeDataSize);
 
-        free(s_lastNITZTimeData);
-        s_lastNITZTimeData = NULL;
+        free(pInst->lastNITZTimeData);
+        pInst->lastNITZTimeData = NULL;
+    }
+
+    // Replay state the previous run of rild reported, so the client
+    // does not have to wait for the modem to report it again
+    if (pInst->replayPending) {
+        checkpointReplay(pInst);
     }
 
     // Get version string
-    if (s_callbacks.getVersion != NULL) {
+    if (pInst->callbacks.getVersion != NULL) {
         const char *version;
-        version = s_callbacks.getVersion();
+        version = pInst->callbacks.getVersion();
         RLOGI("RIL Daemon version: %s\n", version);
 
         property_set(PROPERTY_RIL_IMPL, version);
@@ -3095,10 +5287,13 @@ static void onNewCommandConnect() {
 }
 
 static void listenCallback (int fd, short flags, void *param) {
+    RilInstance *pInst = (RilInstance *)param;
+    bool seqpacket = (fd == pInst->fdListenSeq);
+    struct ril_event *listenEvent = seqpacket ? &pInst->listen_seq_event
+                                              : &pInst->listen_event;
     int ret;
     int err;
     int is_phone_socket;
-    RecordStream *p_rs;
 
     struct sockaddr_un peeraddr;
     socklen_t socklen = sizeof (peeraddr);
@@ -3108,15 +5303,15 @@ static void listenCallback (int fd, short flags, void *param) {
 
     struct passwd *pwd = NULL;
 
-    assert (s_fdCommand < 0);
-    assert (fd == s_fdListen);
+    assert (pInst->fdCommand < 0);
+    assert (fd == pInst->fdListen || fd == pInst->fdListenSeq);
 
-    s_fdCommand = accept(s_fdListen, (sockaddr *) &peeraddr, &socklen);
+    pInst->fdCommand = accept(fd, (sockaddr *) &peeraddr, &socklen);
 
-    if (s_fdCommand < 0 ) {
+    if (pInst->fdCommand < 0 ) {
         RLOGE("Error on accept() errno:%d", errno);
         /* start listening for new connections again */
-        rilEventAddWakeup(&s_listen_event);
+        rilEventAddWakeup(listenEvent);
         return;
     }
 
@@ -3126,7 +5321,7 @@ static void listenCallback (int fd, short flags, void *param) {
     errno = 0;
     is_phone_socket = 0;
 
-    err = getsockopt(s_fdCommand, SOL_SOCKET, SO_PEERCRED, &creds, &szCreds);
+    err = getsockopt(pInst->fdCommand, SOL_SOCKET, SO_PEERCRED, &creds, &szCreds);
 
     if (err == 0 && szCreds > 0) {
         errno = 0;
@@ -3147,33 +5342,48 @@ static void listenCallback (int fd, short flags, void *param) {
     if ( !is_phone_socket ) {
       RLOGE("RILD must accept socket from %s", PHONE_PROCESS);
 
-      close(s_fdCommand);
-      s_fdCommand = -1;
+      close(pInst->fdCommand);
+      pInst->fdCommand = -1;
 
-      onCommandsSocketClosed();
+      onCommandsSocketClosed(pInst);
 
       /* start listening for new connections again */
-      rilEventAddWakeup(&s_listen_event);
+      rilEventAddWakeup(listenEvent);
 
       return;
     }
 
-    ret = fcntl(s_fdCommand, F_SETFL, O_NONBLOCK);
+    /* one client at a time, whichever socket it came in on */
+    if (seqpacket) {
+        ril_event_del(&pInst->listen_event);
+    } else if (pInst->fdListenSeq >= 0) {
+        ril_event_del(&pInst->listen_seq_event);
+    }
+
+    ret = fcntl(pInst->fdCommand, F_SETFL, O_NONBLOCK);
 
     if (ret < 0) {
         RLOGE ("Error setting O_NONBLOCK errno:%d", errno);
     }
 
-    RLOGI("libril: new connection");
+    pInst->seqpacket = seqpacket;
+
+    RLOGI("libril: new %s connection on %s",
+            seqpacket ? "seqpacket" : "stream", pInst->socketName);
 
-    p_rs = record_stream_new(s_fdCommand, MAX_COMMAND_BYTES);
+    if (seqpacket) {
+        ril_event_set (&pInst->commands_event, pInst->fdCommand, 1,
+            processSeqpacketCallback, pInst);
+    } else {
+        pInst->p_rs = record_stream_new(pInst->fdCommand, MAX_COMMAND_BYTES);
 
-    ril_event_set (&s_commands_event, s_fdCommand, 1,
-        processCommandsCallback, p_rs);
+        ril_event_set (&pInst->commands_event, pInst->fdCommand, 1,
+            processCommandsCallback, pInst);
+    }
 
-    rilEventAddWakeup (&s_commands_event);
+    rilEventAddWakeup (&pInst->commands_event);
 
-    onNewCommandConnect();
+    onNewCommandConnect(pInst);
 }
 
 static void freeDebugCallbackArgs(int number, char **args) {
@@ -3185,51 +5395,408 @@ static void freeDebugCallbackArgs(int number, char **args) {
     free(args);
 }
 
-static void debugCallback (int fd, short flags, void *param) {
-    int acceptFD, option;
-    struct sockaddr_un peeraddr;
-    socklen_t socklen = sizeof (peeraddr);
-    int data;
-    unsigned int qxdm_data[6];
-    const char *deactData[1] = {"1"};
-    char *actData[1];
-    RIL_Dial dialData;
-    int hangupData[1] = {1};
-    int number;
-    char **args;
+/**
+ * Per-connection state for the debug port. Records use the legacy
+ * radiooptions framing (native-endian int32 argc, then argc times
+ * int32 length followed by that many bytes) and are parsed
+ * incrementally from non-blocking reads, so a slow or stuck client
+ * can no longer stall the event loop.
+ */
+typedef struct DebugClient {
+    int fd;
+    struct ril_event event;
+    UserCallbackInfo *timeout_info;
+    int64_t deadline;           // elapsedRealtime() ms
+    size_t len;
+    uint8_t buf[MAX_DEBUG_RECORD_BYTES];
+} DebugClient;
 
-    acceptFD = accept (fd,  (sockaddr *) &peeraddr, &socklen);
+static DebugClient s_debugClients[MAX_DEBUG_CLIENTS];
 
-    if (acceptFD < 0) {
-        RLOGE ("error accepting on debug port: %d\n", errno);
+static void
+debugReplyAppend(char *reply, size_t size, size_t *used, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (*used >= size) {
         return;
     }
 
-    if (recv(acceptFD, &number, sizeof(int), 0) != sizeof(int)) {
-        RLOGE ("error reading on socket: number of Args: \n");
-        return;
+    va_start(ap, fmt);
+    n = vsnprintf(reply + *used, size - *used, fmt, ap);
+    va_end(ap);
+
+    if (n > 0) {
+        *used = MIN(*used + n, size - 1);
     }
-    args = (char **) malloc(sizeof(char*) * number);
+}
 
-    for (int i = 0; i < number; i++) {
-        int len;
-        if (recv(acceptFD, &len, sizeof(int), 0) != sizeof(int)) {
-            RLOGE ("error reading on socket: Len of Args: \n");
-            freeDebugCallbackArgs(i, args);
-            return;
+static void debugClientClose(DebugClient *c);
+
+/**
+ * Best-effort reply to an introspection command: int32 length then the
+ * text. The debug socket is never allowed to block the event loop; a
+ * reply that does not fit into the socket buffer would leave a frame
+ * shorter than its header announces, so the client is dropped instead.
+ */
+static void
+debugSendReply(DebugClient *c, const char *reply, size_t len) {
+    uint32_t header = len;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)reply;
+    iov[1].iov_len = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    ssize_t written = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written < (ssize_t)(sizeof(header) + len)) {
+        RLOGW("debug port: short reply (%d of %d bytes), closing client",
+                (int)written, (int)(sizeof(header) + len));
+        debugClientClose(c);
+    }
+}
+
+static void
+debugDumpPending(char *reply, size_t size, size_t *used) {
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    int count = 0;
+
+    pthread_mutex_lock(&s_pendingRequestsMutex);
+    for (RequestInfo *pRI = s_pendingRequests; pRI != NULL; pRI = pRI->p_next) {
+        debugReplyAppend(reply, size, used, "%s token=%d inst=%d age=%lldms%s%s\n",
+                requestToString(pRI->pCI->requestNumber), pRI->token,
+                pRI->pInstance != NULL ? pRI->pInstance->id : -1,
+                pRI->startTime ? (long long)ns2ms(now - pRI->startTime) : 0LL,
+                pRI->local ? " local" : "",
+                pRI->cancelled ? " cancelled" : "");
+        count++;
+    }
+    pthread_mutex_unlock(&s_pendingRequestsMutex);
+
+    debugReplyAppend(reply, size, used, "pending: %d\n", count);
+}
+
+static void
+debugDumpQueues(char *reply, size_t size, size_t *used) {
+    pthread_mutex_lock(&s_pendingRequestsMutex);
+    debugReplyAppend(reply, size, used,
+            "admitted: %d/%d\ndeferred: %d/%d total=%u dropped=%u\n"
+            "rejected: %u\n",
+            s_pendingTotal, s_maxPending, s_deferredCount, s_maxDeferred,
+            s_deferredTotal, s_deferredDropped, s_rejectedTotal);
+    for (int i = 1; i < (int)NUM_ELEMS(s_commands); i++) {
+        if (s_pendingPerType[i] == 0 && s_rejectedPerType[i] == 0) {
+            continue;
         }
-        // +1 for null-term
-        args[i] = (char *) malloc((sizeof(char) * len) + 1);
-        if (recv(acceptFD, args[i], sizeof(char) * len, 0)
-            != (int)sizeof(char) * len) {
-            RLOGE ("error reading on socket: Args[%d] \n", i);
-            freeDebugCallbackArgs(i, args);
-            return;
+        debugReplyAppend(reply, size, used, "  %s pending=%d rejected=%u\n",
+                requestToString(i), s_pendingPerType[i], s_rejectedPerType[i]);
+    }
+    pthread_mutex_unlock(&s_pendingRequestsMutex);
+
+    pthread_mutex_lock(&s_smsMutex);
+    for (int i = 0; i < MAX_RIL_INSTANCES; i++) {
+        RilInstance *pInst = &s_instances[i];
+        if (!pInst->registered) {
+            continue;
+        }
+        debugReplyAppend(reply, size, used,
+                "sms pipeline %s: in flight %d/%d queued %d batched %u bytes\n",
+                pInst->socketName, pInst->smsInFlight, s_smsPipelineDepth,
+                pInst->smsQueued, (unsigned int)pInst->smsBatchLen);
+    }
+    pthread_mutex_unlock(&s_smsMutex);
+}
+
+static void
+debugDumpTimers(char *reply, size_t size, size_t *used) {
+    int watches, timers, pending;
+    int clients = 0;
+
+    ril_event_get_counts(&watches, &timers, &pending);
+    for (int i = 0; i < MAX_DEBUG_CLIENTS; i++) {
+        if (s_debugClients[i].fd >= 0) clients++;
+    }
+
+    debugReplyAppend(reply, size, used,
+            "watches: %d\ntimers: %d\nfiring: %d\ndebug clients: %d/%d\n",
+            watches, timers, pending, clients, MAX_DEBUG_CLIENTS);
+}
+
+static void
+debugDumpWakeLock(char *reply, size_t size, size_t *used) {
+    nsecs_t heldTime;
+
+    pthread_mutex_lock(&s_wakeLockStatsMutex);
+    heldTime = s_wakeLockStats.heldTime;
+    if (s_wakeLockStats.held) {
+        heldTime += systemTime(SYSTEM_TIME_MONOTONIC) - s_wakeLockStats.acquireTime;
+    }
+    debugReplyAppend(reply, size, used,
+            "held: %d\nacquired: %u\nreleased: %u\nheld time: %lldms\n"
+            "longest hold: %lldms\n",
+            s_wakeLockStats.held ? 1 : 0, s_wakeLockStats.acquired,
+            s_wakeLockStats.released, (long long)ns2ms(heldTime),
+            (long long)ns2ms(s_wakeLockStats.longestHold));
+    pthread_mutex_unlock(&s_wakeLockStatsMutex);
+}
+
+static void
+debugDumpLatency(char *reply, size_t size, size_t *used) {
+    debugReplyAppend(reply, size, used,
+            "request latency, bucket n counts completions < 2^n ms\n");
+
+    pthread_mutex_lock(&s_pendingRequestsMutex);
+    for (int i = 1; i < (int)NUM_ELEMS(s_commands); i++) {
+        unsigned int total = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            total += s_latencyHistogram[i][b];
+        }
+        if (total == 0) {
+            continue;
+        }
+        debugReplyAppend(reply, size, used, "%s n=%u", requestToString(i), total);
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            debugReplyAppend(reply, size, used, " %u", s_latencyHistogram[i][b]);
+        }
+        debugReplyAppend(reply, size, used, "\n");
+    }
+    pthread_mutex_unlock(&s_pendingRequestsMutex);
+}
+
+/**
+ * Formats the metrics registry as "name value" lines: counters first,
+ * then gauges sampled now, then the non-zero per type counters.
+ */
+static void
+metricsFormat(char *reply, size_t size, size_t *used) {
+    unsigned int in = 0, out = 0, unsol = 0;
+    unsigned int iterations;
+    long long callbackUs;
+    int watches, timers, firing;
+    int pending, deferred;
+
+    for (int i = 0; i < (int)NUM_ELEMS(s_commands); i++) {
+        in += METRIC_READ(s_metrics.requestsIn[i]);
+        out += METRIC_READ(s_metrics.requestsOut[i]);
+    }
+    for (int i = 0; i < (int)NUM_ELEMS(s_unsolResponses); i++) {
+        unsol += METRIC_READ(s_metrics.unsolicited[i]);
+    }
+
+    ril_event_get_loop_stats(&iterations, &callbackUs);
+    ril_event_get_counts(&watches, &timers, &firing);
+
+    pthread_mutex_lock(&s_pendingRequestsMutex);
+    pending = s_pendingTotal;
+    deferred = s_deferredCount;
+    pthread_mutex_unlock(&s_pendingRequestsMutex);
+
+    debugReplyAppend(reply, size, used,
+            "uptime_ms %lld\n"
+            "requests_in %u\nrequests_out %u\nunsolicited %u\n"
+            "bytes_read %llu\nbytes_written %llu\nwrite_retries %u\n"
+            "shared_responses %u\nshared_bytes %llu\n"
+            "wake_locks %u\n"
+            "loop_iterations %u\nloop_callback_us %lld\n"
+            "gauge.pending %d\ngauge.deferred %d\n"
+            "gauge.timers %d\ngauge.watches %d\n",
+            (long long)elapsedRealtime(),
+            in, out, unsol,
+            METRIC_READ(s_metrics.bytesRead), METRIC_READ(s_metrics.bytesWritten),
+            METRIC_READ(s_metrics.writeRetries),
+            METRIC_READ(s_metrics.sharedResponses),
+            METRIC_READ(s_metrics.sharedBytes),
+            METRIC_READ(s_metrics.wakeLocks),
+            iterations, callbackUs,
+            pending, deferred, timers, watches);
+
+    for (int i = 1; i < (int)NUM_ELEMS(s_commands); i++) {
+        unsigned int n = METRIC_READ(s_metrics.requestsIn[i]);
+        if (n != 0) {
+            debugReplyAppend(reply, size, used, "request_in.%s %u\n",
+                    s_commands[i].name, n);
         }
-        char * buf = args[i];
-        buf[len] = 0;
+        n = METRIC_READ(s_metrics.requestsOut[i]);
+        if (n != 0) {
+            debugReplyAppend(reply, size, used, "request_out.%s %u\n",
+                    s_commands[i].name, n);
+        }
+    }
+    for (int i = 0; i < (int)NUM_ELEMS(s_unsolResponses); i++) {
+        unsigned int n = METRIC_READ(s_metrics.unsolicited[i]);
+        if (n != 0) {
+            debugReplyAppend(reply, size, used, "unsol.%s %u\n",
+                    s_unsolResponses[i].name, n);
+        }
+    }
+}
+
+/**
+ * Event loop callback profile, see ril_event_set_profiling(). Slow user
+ * timers are identified by the RIL_TimedCallback they ran.
+ */
+static void
+debugDumpLoopProfile(char *reply, size_t size, size_t *used) {
+    struct ril_event_profile profiles[MAX_DEBUG_PROFILES];
+    struct ril_event_slow slow[MAX_DEBUG_SLOW_RECORDS];
+    int n;
+
+    n = ril_event_get_profile(profiles, MAX_DEBUG_PROFILES);
+    debugReplyAppend(reply, size, used,
+            "callback calls slow avg_us max_us avg_delay_us max_delay_us\n");
+    for (int i = 0; i < n; i++) {
+        struct ril_event_profile *prof = &profiles[i];
+        if (prof->calls == 0) {
+            continue;
+        }
+        if (prof->name != NULL) {
+            debugReplyAppend(reply, size, used, "%s", prof->name);
+        } else {
+            debugReplyAppend(reply, size, used, "%p", prof->func);
+        }
+        debugReplyAppend(reply, size, used, " %u %u %lld %lld %lld %lld\n",
+                prof->calls, prof->slow,
+                prof->totalUs / prof->calls, prof->maxUs,
+                prof->totalDelayUs / prof->calls, prof->maxDelayUs);
+    }
+
+    n = ril_event_get_slow(slow, MAX_DEBUG_SLOW_RECORDS);
+    debugReplyAppend(reply, size, used, "slow callbacks: %d\n", n);
+    for (int i = 0; i < n; i++) {
+        const char *identity = NULL;
+
+        if (slow[i].name != NULL && strcmp(slow[i].name, "userTimer") == 0) {
+            identity = timedCallbackName(slow[i].identity);
+        }
+        debugReplyAppend(reply, size, used, "%s fd=%d id=",
+                slow[i].name != NULL ? slow[i].name : "?", slow[i].fd);
+        if (identity != NULL) {
+            debugReplyAppend(reply, size, used, "%s", identity);
+        } else {
+            debugReplyAppend(reply, size, used, "%p", slow[i].identity);
+        }
+        debugReplyAppend(reply, size, used, " took=%lldus delay=%lldus\n",
+                slow[i].durationUs, slow[i].delayUs);
+    }
+}
+
+/**
+ * Writes the metrics to ro.ril.metrics_file. The file is replaced
+ * atomically so collectors never read a partial snapshot.
+ */
+static void
+metricsWriteSnapshot() {
+    char tmp[PROPERTY_VALUE_MAX + 8];
+    char *reply;
+    size_t used = 0;
+    int fd;
+
+    reply = (char *)malloc(MAX_DEBUG_REPLY_BYTES);
+    if (reply == NULL) {
+        return;
+    }
+    reply[0] = 0;
+    metricsFormat(reply, MAX_DEBUG_REPLY_BYTES, &used);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s_metricsFile);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0) {
+        RLOGW("metrics: cannot open %s errno:%d", tmp, errno);
+        free(reply);
+        return;
+    }
+
+    if (write(fd, reply, used) != (ssize_t)used) {
+        RLOGW("metrics: short write to %s errno:%d", tmp, errno);
+        close(fd);
+        unlink(tmp);
+    } else {
+        close(fd);
+        rename(tmp, s_metricsFile);
     }
 
+    free(reply);
+}
+
+/**
+ * Writes a snapshot every ro.ril.metrics_interval seconds. Runs on its
+ * own thread so flash I/O never holds up the event loop; metricsFormat()
+ * only reads counters and takes short-lived locks.
+ */
+static void *
+metricsSnapshotThread(void *param) {
+    for (;;) {
+        struct timespec ts;
+
+        ts.tv_sec = s_metricsInterval.tv_sec;
+        ts.tv_nsec = s_metricsInterval.tv_usec * 1000;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+
+        metricsWriteSnapshot();
+    }
+
+    return NULL;
+}
+
+static void
+loadMetricsConfig() {
+    char prop_val[PROPERTY_VALUE_MAX];
+    pthread_attr_t attr;
+    pthread_t tid;
+    int result;
+
+    if (property_get("ro.ril.metrics_file", s_metricsFile, "") <= 0) {
+        return;
+    }
+
+    if (property_get("ro.ril.metrics_interval", prop_val, "") > 0) {
+        int interval = strtol(prop_val, NULL, 0);
+        if (interval > 0) {
+            s_metricsInterval.tv_sec = interval;
+        }
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    result = pthread_create(&tid, &attr, metricsSnapshotThread, NULL);
+    pthread_attr_destroy(&attr);
+    if (result != 0) {
+        RLOGE("metrics: cannot start snapshot thread: %s", strerror(result));
+        return;
+    }
+
+    RLOGI("metrics: snapshot to %s every %d sec", s_metricsFile,
+            (int)s_metricsInterval.tv_sec);
+}
+
+/**
+ * Timer callback for debug command 5: select automatic network
+ * once the radio had time to come up. Used to be a sleep(2) on
+ * the event loop thread.
+ */
+static void
+debugNetworkSelectionAutomatic(void *param) {
+    issueLocalRequest(RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC, NULL, 0);
+}
+
+static void
+debugExecute(DebugClient *c, int number, char **args) {
+    int data;
+    unsigned int qxdm_data[6];
+    const char *deactData[1] = {"1"};
+    char *actData[1];
+    RIL_Dial dialData;
+    int hangupData[1] = {1};
+    char *reply = NULL;
+    size_t used = 0;
+
     switch (atoi(args[0])) {
         case 0:
             RLOGI ("Connection on debug port: issuing reset.");
@@ -3240,8 +5807,10 @@ static void debugCallback (int fd, short flags, void *param) {
             data = 0;
             issueLocalRequest(RIL_REQUEST_RADIO_POWER, &data, sizeof(int));
             // Close the socket
-            close(s_fdCommand);
-            s_fdCommand = -1;
+            if (s_defaultInstance != NULL) {
+                close(s_defaultInstance->fdCommand);
+                s_defaultInstance->fdCommand = -1;
+            }
             break;
         case 2:
             RLOGI ("Debug port: issuing unsolicited voice network change.");
@@ -3274,11 +5843,12 @@ static void debugCallback (int fd, short flags, void *param) {
             RLOGI("Debug port: Radio On");
             data = 1;
             issueLocalRequest(RIL_REQUEST_RADIO_POWER, &data, sizeof(int));
-            sleep(2);
-            // Set network selection automatic.
-            issueLocalRequest(RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC, NULL, 0);
+            // Set network selection automatic once the radio is up.
+            internalRequestTimedCallback(debugNetworkSelectionAutomatic, NULL,
+                                         &TIMEVAL_DEBUG_RADIO_ON_DELAY);
             break;
         case 6:
+            if (number < 2) goto missing_arg;
             RLOGI("Debug port: Setup Data Call, Apn :%s\n", args[1]);
             actData[0] = args[1];
             issueLocalRequest(RIL_REQUEST_SETUP_DATA_CALL, &actData,
@@ -3290,6 +5860,7 @@ static void debugCallback (int fd, short flags, void *param) {
                               sizeof(deactData));
             break;
         case 8:
+            if (number < 2) goto missing_arg;
             RLOGI("Debug port: Dial Call");
             dialData.clir = 0;
             dialData.address = args[1];
@@ -3304,12 +5875,270 @@ static void debugCallback (int fd, short flags, void *param) {
             issueLocalRequest(RIL_REQUEST_HANGUP, &hangupData,
                               sizeof(hangupData));
             break;
-        default:
-            RLOGE ("Invalid request");
+        case DEBUG_CMD_PENDING:
+        case DEBUG_CMD_QUEUES:
+        case DEBUG_CMD_TIMERS:
+        case DEBUG_CMD_WAKELOCK:
+        case DEBUG_CMD_LATENCY:
+        case DEBUG_CMD_METRICS:
+        case DEBUG_CMD_LOOP_PROFILE:
+            reply = (char *)malloc(MAX_DEBUG_REPLY_BYTES);
+            if (reply == NULL) {
+                RLOGE("debug port: out of memory");
+                break;
+            }
+            reply[0] = 0;
+            switch (atoi(args[0])) {
+                case DEBUG_CMD_PENDING:
+                    debugDumpPending(reply, MAX_DEBUG_REPLY_BYTES, &used);
+                    break;
+                case DEBUG_CMD_QUEUES:
+                    debugDumpQueues(reply, MAX_DEBUG_REPLY_BYTES, &used);
+                    break;
+                case DEBUG_CMD_TIMERS:
+                    debugDumpTimers(reply, MAX_DEBUG_REPLY_BYTES, &used);
+                    break;
+                case DEBUG_CMD_WAKELOCK:
+                    debugDumpWakeLock(reply, MAX_DEBUG_REPLY_BYTES, &used);
+                    break;
+                case DEBUG_CMD_LATENCY:
+                    debugDumpLatency(reply, MAX_DEBUG_REPLY_BYTES, &used);
+                    break;
+                case DEBUG_CMD_METRICS:
+                    metricsFormat(reply, MAX_DEBUG_REPLY_BYTES, &used);
+                    break;
+                case DEBUG_CMD_LOOP_PROFILE:
+                    debugDumpLoopProfile(reply, MAX_DEBUG_REPLY_BYTES, &used);
+                    break;
+            }
+            debugSendReply(c, reply, used);
+            free(reply);
+            break;
+        default:
+            RLOGE ("Invalid request");
+            break;
+    }
+    return;
+
+missing_arg:
+    RLOGE("Debug port: command %s needs an argument", args[0]);
+}
+
+static void
+debugClientClose(DebugClient *c) {
+    if (c->fd < 0) {
+        return;
+    }
+
+    ril_event_del(&c->event);
+    close(c->fd);
+    c->fd = -1;
+    c->len = 0;
+
+    // We're using "param == NULL" as a cancellation mechanism
+    if (c->timeout_info != NULL) {
+        c->timeout_info->userParam = NULL;
+        c->timeout_info = NULL;
+    }
+}
+
+static void debugClientTimeout(void *param);
+
+static void
+debugScheduleTimeout(DebugClient *c, int64_t delayMs) {
+    struct timeval tv;
+
+    tv.tv_sec = delayMs / 1000;
+    tv.tv_usec = (delayMs % 1000) * 1000;
+    c->timeout_info = internalRequestTimedCallback(debugClientTimeout, c, &tv);
+}
+
+static void
+debugClientTimeout(void *param) {
+    DebugClient *c = (DebugClient *)param;
+    int64_t now;
+
+    if (c == NULL) {
+        return;
+    }
+
+    c->timeout_info = NULL;
+
+    // the client was active since this timer was set, wait for the rest
+    now = elapsedRealtime();
+    if (now < c->deadline) {
+        debugScheduleTimeout(c, c->deadline - now);
+        return;
+    }
+
+    RLOGW("debug port: closing idle client");
+    debugClientClose(c);
+}
+
+/**
+ * Pushes the idle deadline out. Only one timer is pending per client;
+ * it re-arms itself for the remainder when it fires early.
+ */
+static void
+debugArmTimeout(DebugClient *c) {
+    int64_t timeoutMs = TIMEVAL_DEBUG_CLIENT_TIMEOUT.tv_sec * 1000
+            + TIMEVAL_DEBUG_CLIENT_TIMEOUT.tv_usec / 1000;
+
+    c->deadline = elapsedRealtime() + timeoutMs;
+    if (c->timeout_info == NULL) {
+        debugScheduleTimeout(c, timeoutMs);
+    }
+}
+
+/**
+ * Tries to take one complete record off the front of the client buffer.
+ * Returns the record length, 0 if more bytes are needed, or -1 if the
+ * record is malformed.
+ */
+static int
+debugParseRecord(DebugClient *c, int *pNumber, char ***pArgs) {
+    int32_t number, len;
+    size_t offset = sizeof(int32_t);
+    char **args;
+
+    if (c->len < sizeof(int32_t)) {
+        return 0;
+    }
+
+    memcpy(&number, c->buf, sizeof(int32_t));
+    if (number <= 0 || number > MAX_DEBUG_ARGS) {
+        RLOGE ("debug port: bad number of args %d", number);
+        return -1;
+    }
+
+    // first pass: make sure the whole record has arrived
+    for (int i = 0; i < number; i++) {
+        if (c->len < offset + sizeof(int32_t)) {
+            return 0;
+        }
+        memcpy(&len, c->buf + offset, sizeof(int32_t));
+        if (len < 0 || len > (int32_t)sizeof(c->buf)) {
+            RLOGE ("debug port: bad length %d for Args[%d]", len, i);
+            return -1;
+        }
+        offset += sizeof(int32_t) + len;
+        if (offset > sizeof(c->buf)) {
+            RLOGE ("debug port: record too long");
+            return -1;
+        }
+    }
+    if (c->len < offset) {
+        return 0;
+    }
+
+    args = (char **) calloc(number, sizeof(char*));
+    if (args == NULL) {
+        return -1;
+    }
+
+    offset = sizeof(int32_t);
+    for (int i = 0; i < number; i++) {
+        memcpy(&len, c->buf + offset, sizeof(int32_t));
+        offset += sizeof(int32_t);
+        // +1 for null-term
+        args[i] = (char *) malloc((sizeof(char) * len) + 1);
+        if (args[i] == NULL) {
+            freeDebugCallbackArgs(i, args);
+            return -1;
+        }
+        memcpy(args[i], c->buf + offset, len);
+        args[i][len] = 0;
+        offset += len;
+    }
+
+    *pNumber = number;
+    *pArgs = args;
+    return (int)offset;
+}
+
+static void debugClientCallback (int fd, short flags, void *param) {
+    DebugClient *c = (DebugClient *)param;
+    ssize_t n;
+
+    // closed by the idle timeout earlier in the same event loop pass
+    if (c->fd < 0) {
+        return;
+    }
+
+    n = recv(fd, c->buf + c->len, sizeof(c->buf) - c->len, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        debugClientClose(c);
+        return;
+    }
+    if (n < 0) {
+        return;
+    }
+    c->len += n;
+
+    for (;;) {
+        int number;
+        char **args;
+        int consumed = debugParseRecord(c, &number, &args);
+
+        if (consumed < 0) {
+            debugClientClose(c);
+            return;
+        }
+        if (consumed == 0) {
+            break;
+        }
+
+        debugExecute(c, number, args);
+        freeDebugCallbackArgs(number, args);
+
+        // debugExecute may have closed the connection
+        if (c->fd < 0) {
+            return;
+        }
+
+        c->len -= consumed;
+        memmove(c->buf, c->buf + consumed, c->len);
+    }
+
+    debugArmTimeout(c);
+}
+
+static void debugCallback (int fd, short flags, void *param) {
+    int acceptFD;
+    struct sockaddr_un peeraddr;
+    socklen_t socklen = sizeof (peeraddr);
+    DebugClient *c = NULL;
+
+    acceptFD = accept (fd,  (sockaddr *) &peeraddr, &socklen);
+
+    if (acceptFD < 0) {
+        RLOGE ("error accepting on debug port: %d\n", errno);
+        return;
+    }
+
+    for (int i = 0; i < MAX_DEBUG_CLIENTS; i++) {
+        if (s_debugClients[i].fd < 0) {
+            c = &s_debugClients[i];
             break;
+        }
     }
-    freeDebugCallbackArgs(number, args);
-    close(acceptFD);
+
+    if (c == NULL) {
+        RLOGE ("debug port: too many clients, dropping connection");
+        close(acceptFD);
+        return;
+    }
+
+    fcntl(acceptFD, F_SETFL, O_NONBLOCK);
+
+    c->fd = acceptFD;
+    c->len = 0;
+    c->timeout_info = NULL;
+
+    ril_event_set (&c->event, acceptFD, true, debugClientCallback, c);
+    rilEventAddWakeup (&c->event);
+
+    debugArmTimeout(c);
 }
 
 
@@ -3329,6 +6158,11 @@ static void userTimerCallback (int fd, short flags, void *param) {
     free(p_info);
 }
 
+// Profiler identity of a user timer: the callback it is about to run
+static void * userTimerIdentity(void *param) {
+    return (void *)((UserCallbackInfo *)param)->p_callback;
+}
+
 
 static void *
 eventLoop(void *param) {
@@ -3364,71 +6198,454 @@ eventLoop(void *param) {
     // Only returns on error
     ril_event_loop();
     RLOGE ("error in event_loop_base errno:%d", errno);
+    checkpointFlush();
     // kill self to restart on error
     kill(0, SIGKILL);
 
     return NULL;
 }
 
-extern "C" void
-RIL_startEventLoop(void) {
-    /* spin up eventLoop thread and wait for it to get started */
-    s_started = 0;
-    pthread_mutex_lock(&s_startupMutex);
+extern "C" void
+RIL_startEventLoop(void) {
+    /* spin up eventLoop thread and wait for it to get started */
+    s_started = 0;
+    pthread_mutex_lock(&s_startupMutex);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int result = pthread_create(&s_tid_dispatch, &attr, eventLoop, NULL);
+    if (result != 0) {
+        RLOGE("Failed to create dispatch thread: %s", strerror(result));
+        goto done;
+    }
+
+    while (s_started == 0) {
+        pthread_cond_wait(&s_startupCond, &s_startupMutex);
+    }
+
+done:
+    pthread_mutex_unlock(&s_startupMutex);
+}
+
+// Used for testing purpose only.
+extern "C" void RIL_setcallbacks (const RIL_RadioFunctions *callbacks) {
+    memcpy(&s_callbacks, callbacks, sizeof (RIL_RadioFunctions));
+}
+
+/**
+ * Reads the admission control limits:
+ *   ro.ril.max_pending          requests outstanding at the vendor, all types
+ *   ro.ril.max_pending_type     requests outstanding per request type
+ *   ro.ril.max_pending_req      per-type overrides, "request:limit,..."
+ *   ro.ril.max_deferred         requests queued in libril before rejecting
+ *   ro.ril.admission_reject     1 to reject excess requests instead of queueing
+ */
+static void
+loadAdmissionConfig() {
+    char prop_val[PROPERTY_VALUE_MAX];
+
+    for (int i = 0; i < (int)NUM_ELEMS(s_maxPendingForType); i++) {
+        s_maxPendingForType[i] = -1;
+    }
+
+    if (property_get("ro.ril.max_pending", prop_val, "") > 0) {
+        s_maxPending = strtol(prop_val, NULL, 0);
+        if (s_maxPending < 0) s_maxPending = 0;
+    }
+
+    if (property_get("ro.ril.max_pending_type", prop_val, "") > 0) {
+        s_maxPendingPerType = strtol(prop_val, NULL, 0);
+        if (s_maxPendingPerType < 0) s_maxPendingPerType = 0;
+    }
+
+    if (property_get("ro.ril.max_deferred", prop_val, "") > 0) {
+        s_maxDeferred = strtol(prop_val, NULL, 0);
+        if (s_maxDeferred < 0) s_maxDeferred = 0;
+    }
+
+    if (property_get("ro.ril.admission_reject", prop_val, "") > 0) {
+        s_admissionReject = (strtol(prop_val, NULL, 0) != 0);
+    }
+
+    if (property_get("ro.ril.max_pending_req", prop_val, "") > 0) {
+        char *cur = prop_val;
+
+        while (*cur != '\0') {
+            char *end;
+            long request = strtol(cur, &end, 0);
+            long limit;
+
+            if (end == cur || *end != ':') {
+                RLOGE("ro.ril.max_pending_req: malformed at '%s'", cur);
+                break;
+            }
+            cur = end + 1;
+            limit = strtol(cur, &end, 0);
+            if (end == cur) {
+                RLOGE("ro.ril.max_pending_req: malformed at '%s'", cur);
+                break;
+            }
+            if (request > 0 && request < (long)NUM_ELEMS(s_maxPendingForType)
+                    && limit >= 0) {
+                s_maxPendingForType[request] = (int)limit;
+            }
+            cur = end;
+            if (*cur == ',') cur++;
+        }
+    }
+
+    if (s_maxPending > 0 || s_maxPendingPerType > 0) {
+        RLOGI("admission: max_pending = %d, per type = %d, deferred = %d, %s",
+            s_maxPending, s_maxPendingPerType, s_maxDeferred,
+            s_admissionReject ? "reject" : "queue");
+    }
+}
+
+/**
+ * Instance id a single instance rild is running as, from the socket
+ * name it was given: "rild" is instance 0, "rild<N>" instance N.
+ */
+static int
+instanceFromSocketName(const char *name) {
+    size_t baseLen = strlen(SOCKET_NAME_RIL);
+    int id;
+
+    if (strncmp(name, SOCKET_NAME_RIL, baseLen) != 0 || name[baseLen] == '\0') {
+        return 0;
+    }
+
+    id = atoi(name + baseLen);
+    return (id > 0 && id < MAX_RIL_INSTANCES) ? id : 1;
+}
+
+/**
+ * Process wide part of registration, done once by whichever instance
+ * registers first: properties, the event loop and the debug port.
+ */
+static void
+registerProcess(int id) {
+    int ret;
+    char prop_name[120];
+    char prop_val[PROPERTY_VALUE_MAX];
+    int prop_len;
+
+    g_log_tag[5] = '0' + id;
+
+    strcpy(prop_name, "ro.ril.extlog");
+    prop_len = property_get(prop_name, prop_val, "");
+    if (prop_len > 0) {
+        extlog = strtol(prop_val, NULL, 0);
+        RLOGI("extlog = %d", extlog);
+        if (extlog < 0) extlog = 0;
+    }
+
+    prop_len = property_get("ro.ril.raw_passthrough", prop_val, "");
+    if (prop_len > 0) {
+        s_rawPassthrough = (strtol(prop_val, NULL, 0) != 0);
+        RLOGI("raw pass-through = %d", s_rawPassthrough);
+    }
+
+    loadAdmissionConfig();
+
+    prop_len = property_get("ro.ril.shm_threshold", prop_val, "");
+    if (prop_len > 0) {
+        long threshold = strtol(prop_val, NULL, 0);
+        s_sharedMemoryThreshold = threshold > 0 ? threshold : 0;
+        RLOGI("shared memory threshold = %u",
+                (unsigned int)s_sharedMemoryThreshold);
+    }
+
+    prop_len = property_get("ro.ril.sms_pipeline_depth", prop_val, "");
+    if (prop_len > 0) {
+        s_smsPipelineDepth = strtol(prop_val, NULL, 0);
+        if (s_smsPipelineDepth < 0) s_smsPipelineDepth = 0;
+        RLOGI("sms pipeline depth = %d", s_smsPipelineDepth);
+    }
+
+    checkpointOpen(RIL_getRilSocketName());
+
+    for (int i = 0; i < MAX_RIL_INSTANCES; i++) {
+        s_instances[i].id = i;
+        s_instances[i].fdListen = -1;
+        s_instances[i].fdListenSeq = -1;
+        s_instances[i].fdCommand = -1;
+        s_instances[i].voiceRadioTech = -1;
+        s_instances[i].cdmaSubscriptionSource = -1;
+        s_instances[i].simRuimStatus = -1;
+    }
+
+    s_registerCalled = 1;
+
+    // New rild impl calls RIL_startEventLoop() first
+    // old standalone impl wants it here.
+
+    if (s_started == 0) {
+        RIL_startEventLoop();
+    }
+
+    loadMetricsConfig();
+
+    // ro.ril.loop_profile=<ms> profiles event loop callbacks and records
+    // those taking at least that long
+    if (property_get("ro.ril.loop_profile", prop_val, "") > 0) {
+        long long slowMs = strtoll(prop_val, NULL, 0);
+        if (slowMs > 0) {
+            ril_event_profile_name(processWakeupCallback, "wakeup", NULL);
+            ril_event_profile_name(listenCallback, "listen", NULL);
+            ril_event_profile_name(processCommandsCallback, "commands", NULL);
+            ril_event_profile_name(processSeqpacketCallback, "commandsSeq", NULL);
+            ril_event_profile_name(debugCallback, "debugAccept", NULL);
+            ril_event_profile_name(debugClientCallback, "debugClient", NULL);
+            ril_event_profile_name(userTimerCallback, "userTimer",
+                    userTimerIdentity);
+            ril_event_set_profiling(slowMs * 1000);
+            RLOGI("event loop profiling, slow callback threshold %lld ms", slowMs);
+        }
+    }
+
+#if 1
+    // start debug interface socket, one per process; it is named after
+    // the instance registered first
+
+    char *inst = NULL;
+    if (strlen(RIL_getRilSocketName()) >= strlen(SOCKET_NAME_RIL)) {
+        inst = RIL_getRilSocketName() + strlen(SOCKET_NAME_RIL);
+    }
+
+    char rildebug[MAX_DEBUG_SOCKET_NAME_LENGTH] = SOCKET_NAME_RIL_DEBUG;
+    if (inst != NULL) {
+        strncat(rildebug, inst, MAX_DEBUG_SOCKET_NAME_LENGTH);
+    }
+
+    for (int i = 0; i < MAX_DEBUG_CLIENTS; i++) {
+        s_debugClients[i].fd = -1;
+    }
+
+    s_fdDebug = android_get_control_socket(rildebug);
+    if (s_fdDebug < 0) {
+        RLOGE("Failed to get socket : %s errno:%d", rildebug, errno);
+        exit(-1);
+    }
+
+    ret = listen(s_fdDebug, 4);
+
+    if (ret < 0) {
+        RLOGE("Failed to listen on ril debug socket '%d': %s",
+             s_fdDebug, strerror(errno));
+        exit(-1);
+    }
+
+    ril_event_set (&s_debug_event, s_fdDebug, true,
+                debugCallback, NULL);
+
+    rilEventAddWakeup (&s_debug_event);
+#endif
+}
+
+/**
+ * Opens the command socket of an instance. Sockets declared for the
+ * service in init.rc are used as they are; a secondary instance hosted
+ * by another service's process creates its own, restricted to the
+ * radio group.
+ */
+static int
+openInstanceSocket(RilInstance *pInst) {
+    int fd;
+
+    fd = android_get_control_socket(pInst->socketName);
+    if (fd < 0 && pInst->id != 0) {
+        char path[sizeof(ANDROID_SOCKET_DIR) + MAX_SOCKET_NAME_LENGTH + 1];
+
+        fd = socket_local_server(pInst->socketName,
+                ANDROID_SOCKET_NAMESPACE_RESERVED, SOCK_STREAM);
+        if (fd >= 0) {
+            snprintf(path, sizeof(path), ANDROID_SOCKET_DIR "/%s",
+                    pInst->socketName);
+            if (chmod(path, 0660) < 0 || chown(path, -1, AID_RADIO) < 0) {
+                RLOGW("Failed to set permissions of %s errno:%d", path, errno);
+            }
+        }
+    }
+
+    return fd;
+}
+
+/**
+ * Opens the optional "<socket>-seq" SOCK_SEQPACKET listen socket of an
+ * instance, declared in init.rc or created here. Clients that find it
+ * use datagram framing; everyone else keeps connecting to the stream
+ * socket, so failing here only disables the mode.
+ */
+static int
+openInstanceSeqSocket(RilInstance *pInst) {
+    char name[MAX_SOCKET_NAME_LENGTH + 4];
+    char path[sizeof(ANDROID_SOCKET_DIR) + sizeof(name) + 1];
+    int fd;
+
+    snprintf(name, sizeof(name), "%s-seq", pInst->socketName);
+
+    fd = android_get_control_socket(name);
+    if (fd < 0) {
+        fd = socket_local_server(name,
+                ANDROID_SOCKET_NAMESPACE_RESERVED, SOCK_SEQPACKET);
+        if (fd < 0) {
+            RLOGI("%s: no seqpacket socket, errno:%d", pInst->socketName, errno);
+            return -1;
+        }
+        snprintf(path, sizeof(path), ANDROID_SOCKET_DIR "/%s", name);
+        if (chmod(path, 0660) < 0 || chown(path, -1, AID_RADIO) < 0) {
+            RLOGW("Failed to set permissions of %s errno:%d", path, errno);
+        }
+    }
+
+    if (listen(fd, 4) < 0) {
+        RLOGW("Failed to listen on %s: %s", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * True once the readiness conditions of an instance hold: the device
+ * node exists and the property has the wanted value ("name=value"),
+ * or any value when given as just "name".
+ */
+static bool
+modemReady(RilInstance *pInst) {
+    if (pInst->readyNode[0] != '\0' && access(pInst->readyNode, F_OK) != 0) {
+        return false;
+    }
+
+    if (pInst->readyProp[0] != '\0') {
+        char name[PROPERTY_KEY_MAX];
+        char value[PROPERTY_VALUE_MAX];
+        const char *wanted = strchr(pInst->readyProp, '=');
+        size_t nameLen = wanted != NULL ? (size_t)(wanted - pInst->readyProp)
+                                        : strlen(pInst->readyProp);
+
+        if (nameLen >= sizeof(name)) {
+            return true;
+        }
+        memcpy(name, pInst->readyProp, nameLen);
+        name[nameLen] = '\0';
+
+        if (property_get(name, value, "") <= 0) {
+            return false;
+        }
+        if (wanted != NULL && strcmp(value, wanted + 1) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+armListen(RilInstance *pInst) {
+    pInst->readyTime = elapsedRealtime();
+
+    /* note: non-persistent so we can accept only one connection at a time */
+    ril_event_set (&pInst->listen_event, pInst->fdListen, false,
+                listenCallback, pInst);
 
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rilEventAddWakeup (&pInst->listen_event);
 
-    int result = pthread_create(&s_tid_dispatch, &attr, eventLoop, NULL);
-    if (result != 0) {
-        RLOGE("Failed to create dispatch thread: %s", strerror(result));
-        goto done;
+    if (pInst->fdListenSeq >= 0) {
+        ril_event_set (&pInst->listen_seq_event, pInst->fdListenSeq, false,
+                    listenCallback, pInst);
+
+        rilEventAddWakeup (&pInst->listen_seq_event);
     }
+}
 
-    while (s_started == 0) {
-        pthread_cond_wait(&s_startupCond, &s_startupMutex);
+/**
+ * Timer callback on the event loop: accepts connections once the modem
+ * is ready or the deadline passed, polls again otherwise.
+ */
+static void
+readinessProbeCallback(void *param) {
+    RilInstance *pInst = (RilInstance *)param;
+    int64_t now = elapsedRealtime();
+    bool ready = modemReady(pInst);
+
+    if (!ready && now < pInst->readyDeadline) {
+        internalRequestTimedCallback(readinessProbeCallback, pInst,
+                &TIMEVAL_READY_POLL);
+        return;
     }
 
-done:
-    pthread_mutex_unlock(&s_startupMutex);
-}
+    if (ready) {
+        RLOGI("%s: modem ready after %lld ms", pInst->socketName,
+                (long long)(now - pInst->registerTime));
+    } else {
+        RLOGW("%s: modem not ready after %lld ms, accepting connections anyway",
+                pInst->socketName, (long long)(now - pInst->registerTime));
+    }
 
-// Used for testing purpose only.
-extern "C" void RIL_setcallbacks (const RIL_RadioFunctions *callbacks) {
-    memcpy(&s_callbacks, callbacks, sizeof (RIL_RadioFunctions));
+    armListen(pInst);
 }
 
-extern "C" void
-RIL_register (const RIL_RadioFunctions *callbacks) {
-    int ret;
-    int flags;
-    char prop_name[120];
+/**
+ * Accepts framework connections on an instance once the modem is
+ * ready, without blocking the caller. Connections made earlier wait in
+ * the listen backlog. Per instance N:
+ *   ro.ril.ready_node_N   path that must exist, e.g. the modem control node
+ *   ro.ril.ready_prop_N   property that must be set, "name" or "name=value"
+ *   ro.ril.delay_N        longest wait for the above in seconds; without
+ *                         them, a plain delay before accepting
+ */
+static void
+armWhenReady(RilInstance *pInst) {
+    char prop_name[PROPERTY_KEY_MAX];
     char prop_val[PROPERTY_VALUE_MAX];
-    int prop_len;
+    int64_t timeoutMs = -1;
 
-    if (strcmp(RIL_getRilSocketName(), "rild") == 0) {
-        g_log_tag[5] = '0';
-    } else {
-        g_log_tag[5] = '1';
-    }
-    sprintf(prop_name, "ro.ril.delay_%c", g_log_tag[5]);
-    prop_len = property_get(prop_name, prop_val, "");
-    if (prop_len > 0) {
+    pInst->registerTime = elapsedRealtime();
+
+    snprintf(prop_name, sizeof(prop_name), "ro.ril.ready_node_%d", pInst->id);
+    property_get(prop_name, pInst->readyNode, "");
+    snprintf(prop_name, sizeof(prop_name), "ro.ril.ready_prop_%d", pInst->id);
+    property_get(prop_name, pInst->readyProp, "");
+
+    snprintf(prop_name, sizeof(prop_name), "ro.ril.delay_%d", pInst->id);
+    if (property_get(prop_name, prop_val, "") > 0) {
         int delay = strtol(prop_val, NULL, 0);
         if (delay > 0) {
-            RLOGI("delay = %d sec .... wait .....", delay);
-            sleep(delay);
+            timeoutMs = delay * 1000LL;
         }
-    } 
-    strcpy(prop_name, "ro.ril.extlog");
-    prop_len = property_get(prop_name, prop_val, "");
-    if (prop_len > 0) {
-        extlog = strtol(prop_val, NULL, 0);
-        RLOGI("extlog = %d", extlog);
-        if (extlog < 0) extlog = 0;
     }
 
+    if (pInst->readyNode[0] == '\0' && pInst->readyProp[0] == '\0') {
+        if (timeoutMs <= 0) {
+            armListen(pInst);
+            return;
+        }
+        struct timeval delay = {(time_t)(timeoutMs / 1000), 0};
+
+        RLOGI("%s: delay = %lld ms", pInst->socketName, (long long)timeoutMs);
+        pInst->readyDeadline = pInst->registerTime + timeoutMs;
+        internalRequestTimedCallback(readinessProbeCallback, pInst, &delay);
+        return;
+    }
+
+    if (timeoutMs <= 0) {
+        timeoutMs = DEFAULT_READY_TIMEOUT_MS;
+    }
+
+    pInst->readyDeadline = pInst->registerTime + timeoutMs;
+    readinessProbeCallback(pInst);
+}
+
+static void
+registerInstance(const RIL_RadioFunctions *callbacks, int id,
+        const char *socketName) {
+    RilInstance *pInst;
+    int ret;
+
     if (callbacks == NULL) {
         RLOGE("RIL_register: RIL_RadioFunctions * null");
         return;
@@ -3443,104 +6660,114 @@ RIL_register (const RIL_RadioFunctions *callbacks) {
              callbacks->version, RIL_VERSION);
         return;
     }
-    RLOGE("RIL_register: RIL version %d", callbacks->version);
+    RLOGE("RIL_register: RIL version %d instance %d", callbacks->version, id);
 
-    if (s_registerCalled > 0) {
-        RLOGE("RIL_register has been called more than once. "
-                "Subsequent call ignored");
+    if (id < 0 || id >= MAX_RIL_INSTANCES) {
+        RLOGE("RIL_register: instance %d out of range, max %d",
+                id, MAX_RIL_INSTANCES - 1);
         return;
     }
 
-    memcpy(&s_callbacks, callbacks, sizeof (RIL_RadioFunctions));
-
-    s_registerCalled = 1;
-
-    // Little self-check
+    pInst = &s_instances[id];
 
-    for (int i = 0; i < (int)NUM_ELEMS(s_commands); i++) {
-        assert(i == s_commands[i].requestNumber);
+    if (pInst->registered) {
+        RLOGE("RIL_register has been called more than once for instance %d. "
+                "Subsequent call ignored", id);
+        return;
     }
 
-    for (int i = 0; i < (int)NUM_ELEMS(s_unsolResponses); i++) {
-        assert(i + RIL_UNSOL_RESPONSE_BASE
-                == s_unsolResponses[i].requestNumber);
+    // the marshalling code is shared and looks at s_callbacks.version
+    if (s_defaultInstance != NULL && callbacks->version != s_callbacks.version) {
+        RLOGE("RIL_register: instance %d version %d differs from %d",
+                id, callbacks->version, s_callbacks.version);
+        return;
     }
 
-    // New rild impl calls RIL_startEventLoop() first
-    // old standalone impl wants it here.
-
-    if (s_started == 0) {
-        RIL_startEventLoop();
-    }
+    memcpy(&pInst->callbacks, callbacks, sizeof (RIL_RadioFunctions));
+    strncpy(pInst->socketName, socketName, MAX_SOCKET_NAME_LENGTH - 1);
 
     // start listen socket
 
-#if 0
-    ret = socket_local_server (SOCKET_NAME_RIL,
-            ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
-
-    if (ret < 0) {
-        RLOGE("Unable to bind socket errno:%d", errno);
-        exit (-1);
-    }
-    s_fdListen = ret;
-
-#else
-    s_fdListen = android_get_control_socket(RIL_getRilSocketName());
-    if (s_fdListen < 0) {
-        RLOGE("Failed to get socket %s",RIL_getRilSocketName());
+    pInst->fdListen = openInstanceSocket(pInst);
+    if (pInst->fdListen < 0) {
+        RLOGE("Failed to get socket %s", pInst->socketName);
         exit(-1);
     }
 
-    ret = listen(s_fdListen, 4);
+    ret = listen(pInst->fdListen, 4);
 
     if (ret < 0) {
         RLOGE("Failed to listen on control socket '%d': %s",
-             s_fdListen, strerror(errno));
+             pInst->fdListen, strerror(errno));
         exit(-1);
     }
-#endif
 
+    pInst->fdListenSeq = openInstanceSeqSocket(pInst);
 
-    /* note: non-persistent so we can accept only one connection at a time */
-    ril_event_set (&s_listen_event, s_fdListen, false,
-                listenCallback, NULL);
+    if (s_defaultInstance == NULL) {
+        memcpy(&s_callbacks, callbacks, sizeof (RIL_RadioFunctions));
+        s_defaultInstance = pInst;
+    }
+    checkpointRestoreInstance(pInst);
+    pInst->registered = true;
 
-    rilEventAddWakeup (&s_listen_event);
+    armWhenReady(pInst);
+}
 
-#if 1
-    // start debug interface socket
+extern "C" void
+RIL_register (const RIL_RadioFunctions *callbacks) {
+    int id = instanceFromSocketName(RIL_getRilSocketName());
 
-    char *inst = NULL;
-    if (strlen(RIL_getRilSocketName()) >= strlen(SOCKET_NAME_RIL)) {
-        inst = RIL_getRilSocketName() + strlen(SOCKET_NAME_RIL);
+    if (s_registerCalled == 0) {
+        registerProcess(id);
     }
 
-    char rildebug[MAX_DEBUG_SOCKET_NAME_LENGTH] = SOCKET_NAME_RIL_DEBUG;
-    if (inst != NULL) {
-        strncat(rildebug, inst, MAX_DEBUG_SOCKET_NAME_LENGTH);
-    }
+    registerInstance(callbacks, id, RIL_getRilSocketName());
+}
 
-    s_fdDebug = android_get_control_socket(rildebug);
-    if (s_fdDebug < 0) {
-        RLOGE("Failed to get socket : %s errno:%d", rildebug, errno);
-        exit(-1);
+extern "C" void
+RIL_registerInstance (const RIL_RadioFunctions *callbacks, int instance) {
+    char socketName[MAX_SOCKET_NAME_LENGTH];
+
+    if (instance <= 0) {
+        strcpy(socketName, SOCKET_NAME_RIL);
+    } else {
+        snprintf(socketName, sizeof(socketName), SOCKET_NAME_RIL "%d", instance);
     }
 
-    ret = listen(s_fdDebug, 4);
+    if (instance < 0 || instance >= MAX_RIL_INSTANCES) {
+        RLOGE("RIL_registerInstance: instance %d out of range, max %d",
+                instance, MAX_RIL_INSTANCES - 1);
+        return;
+    }
 
-    if (ret < 0) {
-        RLOGE("Failed to listen on ril debug socket '%d': %s",
-             s_fdDebug, strerror(errno));
-        exit(-1);
+    if (s_registerCalled == 0) {
+        // the debug socket and log tag follow the first instance
+        RIL_setRilSocketName(socketName);
+        registerProcess(instance);
     }
 
-    ril_event_set (&s_debug_event, s_fdDebug, true,
-                debugCallback, NULL);
+    registerInstance(callbacks, instance, socketName);
+}
 
-    rilEventAddWakeup (&s_debug_event);
-#endif
+/**
+ * Must be called with s_pendingRequestsMutex held.
+ * Adds a completed request to the latency histogram of its type.
+ */
+static void
+recordLatencyLocked(RequestInfo *pRI) {
+    int64_t ms;
+    int bucket = 0;
 
+    if (pRI->startTime == 0) {
+        return;
+    }
+
+    ms = ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - pRI->startTime);
+    while (bucket < LATENCY_BUCKETS - 1 && ms >= (1LL << bucket)) {
+        bucket++;
+    }
+    s_latencyHistogram[pRI->pCI->requestNumber][bucket]++;
 }
 
 static int
@@ -3561,6 +6788,13 @@ checkAndDequeueRequestInfo(struct RequestInfo *pRI) {
             ret = 1;
 
             *ppCur = (*ppCur)->p_next;
+
+            recordLatencyLocked(pRI);
+
+            if (!pRI->local
+                    && releaseAdmissionLocked(pRI->pCI->requestNumber)) {
+                scheduleDeferredDrainLocked();
+            }
             break;
         }
     }
@@ -3571,9 +6805,87 @@ checkAndDequeueRequestInfo(struct RequestInfo *pRI) {
 }
 
 
+/**
+ * Looks up a pending network scan; on success the instance and client
+ * token are returned, as pRI may complete once the lock is dropped.
+ */
+static bool
+findNetworkScan(RIL_Token t, RilInstance **ppInst, int32_t *pToken) {
+    RequestInfo *pRI = (RequestInfo *)t;
+    bool found = false;
+
+    if (pRI == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&s_pendingRequestsMutex);
+
+    for (RequestInfo *pCur = s_pendingRequests; pCur != NULL; pCur = pCur->p_next) {
+        if (pCur == pRI) {
+            if (!pRI->local && !pRI->cancelled
+                    && pRI->pCI->requestNumber == RIL_REQUEST_QUERY_AVAILABLE_NETWORKS
+                    && (pRI->pInstance->clientFeatures
+                        & LIBRIL_FEATURE_NETWORK_SCAN_RESULT)) {
+                *ppInst = pRI->pInstance;
+                *pToken = pRI->token;
+                found = true;
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&s_pendingRequestsMutex);
+
+    return found;
+}
+
+extern "C" int
+RIL_isNetworkScanStreamingEnabled(RIL_Token t) {
+    RilInstance *pInst;
+    int32_t token;
+
+    return findNetworkScan(t, &pInst, &token) ? 1 : 0;
+}
+
+/**
+ * Sends RIL_UNSOL_LIBRIL_NETWORK_SCAN_RESULT: the token of the scan
+ * followed by the operators found since the last partial result,
+ * marshalled like the final response.
+ */
+extern "C" int
+RIL_onNetworkScanResult(RIL_Token t, const void *data, size_t datalen) {
+    RilInstance *pInst;
+    int32_t token;
+    Parcel p;
+
+    if (!findNetworkScan(t, &pInst, &token)) {
+        return -1;
+    }
+
+    p.writeInt32 (RESPONSE_UNSOLICITED);
+    p.writeInt32 (RIL_UNSOL_LIBRIL_NETWORK_SCAN_RESULT);
+    p.writeInt32 (token);
+
+    appendPrintBuf("[UNSL]< %s", requestToString(RIL_UNSOL_LIBRIL_NETWORK_SCAN_RESULT));
+
+    if (responseStringsNetworks(p, const_cast<void *>(data), datalen) != 0) {
+        return -1;
+    }
+
+    printResponse;
+
+    if (extlog)
+        RLOGI("[ExtLog] < %s [token = %d, size = %d]",
+            requestToString(RIL_UNSOL_LIBRIL_NETWORK_SCAN_RESULT), token, datalen);
+
+    return sendResponse(pInst, p) == 0 ? 0 : -1;
+}
+
 extern "C" void
 RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void *response, size_t responselen) {
     RequestInfo *pRI;
+    RilInstance *pInst;
+    bool pipelined;
     int ret;
     size_t errorOffset;
 
@@ -3584,6 +6896,9 @@ RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void *response, size_t responsel
         return;
     }
 
+    pInst = pRI->pInstance;
+    METRIC_ADD(s_metrics.requestsOut[pRI->pCI->requestNumber], 1);
+
     if (pRI->local > 0) {
         // Locally issued command...void only!
         // response does not go back up the command socket
@@ -3592,6 +6907,8 @@ RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void *response, size_t responsel
         goto done;
     }
 
+    pipelined = pRI->smsPart;
+
     if (extlog)
         RLOGI("[ExtLog] < %s [id = %d, token = %d, size = %d, cancelled = %d, err = %d]", 
             requestToString(pRI->pCI->requestNumber), pRI->pCI->requestNumber, pRI->token, 
@@ -3609,9 +6926,21 @@ RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void *response, size_t responsel
 
         p.writeInt32 (e);
 
+        if (response != NULL && s_rawPassthrough
+                && pRI->pCI->responseFunction == responseRaw) {
+            appendPrintBuf("%s raw_size=%d", printBuf, (int)responselen);
+            sendResponseRawPayload(pInst, p, response, responselen);
+            goto done;
+        }
+
         if (response != NULL) {
             // there is a response payload, no matter success or not.
-            ret = pRI->pCI->responseFunction(p, response, responselen);
+            if (pRI->pCI->requestNumber == RIL_REQUEST_GET_NEIGHBORING_CELL_IDS
+                    && (pInst->clientFeatures & LIBRIL_FEATURE_NEIGHBORING_CELL_DELTA)) {
+                ret = responseCellListDelta(pInst, p, response, responselen);
+            } else {
+                ret = pRI->pCI->responseFunction(p, response, responselen);
+            }
 
             /* if an error occurred, rewind and mark it */
             if (ret != 0) {
@@ -3624,25 +6953,55 @@ RIL_onRequestComplete(RIL_Token t, RIL_Errno e, void *response, size_t responsel
             appendPrintBuf("%s fails by %s", printBuf, failCauseToString(e));
         }
 
-        if (s_fdCommand < 0) {
+        if (pInst->fdCommand < 0) {
             RLOGD ("RIL onRequestComplete: Command channel closed");
         }
-        sendResponse(p);
+        if (pipelined) {
+            smsPipelineComplete(pInst, p);
+        } else {
+            sendResponse(pInst, p);
+        }
+    } else if (pipelined) {
+        smsPipelineDone(pInst, pipelined);
     }
 
 done:
-    free(pRI);
+    freeRequestInfo(pRI);
 }
 
 
 static void
 grabPartialWakeLock() {
     acquire_wake_lock(PARTIAL_WAKE_LOCK, ANDROID_WAKE_LOCK_NAME);
+    METRIC_ADD(s_metrics.wakeLocks, 1);
+
+    pthread_mutex_lock(&s_wakeLockStatsMutex);
+    s_wakeLockStats.acquired++;
+    if (!s_wakeLockStats.held) {
+        s_wakeLockStats.held = true;
+        s_wakeLockStats.acquireTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    }
+    checkpointWakeLock();
+    pthread_mutex_unlock(&s_wakeLockStatsMutex);
 }
 
 static void
 releaseWakeLock() {
     release_wake_lock(ANDROID_WAKE_LOCK_NAME);
+
+    pthread_mutex_lock(&s_wakeLockStatsMutex);
+    s_wakeLockStats.released++;
+    if (s_wakeLockStats.held) {
+        nsecs_t hold = systemTime(SYSTEM_TIME_MONOTONIC)
+                - s_wakeLockStats.acquireTime;
+        s_wakeLockStats.held = false;
+        s_wakeLockStats.heldTime += hold;
+        if (hold > s_wakeLockStats.longestHold) {
+            s_wakeLockStats.longestHold = hold;
+        }
+    }
+    checkpointWakeLock();
+    pthread_mutex_unlock(&s_wakeLockStatsMutex);
 }
 
 /**
@@ -3741,7 +7100,7 @@ static bool is3gpp2(int radioTech) {
  * returned when telephony framework requests them
  */
 static RIL_RadioState
-processRadioState(RIL_RadioState newRadioState) {
+processRadioState(RilInstance *pInst, RIL_RadioState newRadioState) {
 
     if((newRadioState > RADIO_STATE_UNAVAILABLE) && (newRadioState < RADIO_STATE_ON)) {
         int newVoiceRadioTech;
@@ -3751,23 +7110,27 @@ processRadioState(RIL_RadioState newRadioState) {
         /* This is old RIL. Decode Subscription source and Voice Radio Technology
            from Radio State and send change notifications if there has been a change */
         newVoiceRadioTech = decodeVoiceRadioTechnology(newRadioState);
-        if(newVoiceRadioTech != voiceRadioTech) {
-            voiceRadioTech = newVoiceRadioTech;
-            RIL_onUnsolicitedResponse (RIL_UNSOL_VOICE_RADIO_TECH_CHANGED,
-                        &voiceRadioTech, sizeof(voiceRadioTech));
+        if(newVoiceRadioTech != pInst->voiceRadioTech) {
+            pInst->voiceRadioTech = newVoiceRadioTech;
+            RIL_onUnsolicitedResponseInstance (pInst->id,
+                        RIL_UNSOL_VOICE_RADIO_TECH_CHANGED,
+                        &pInst->voiceRadioTech, sizeof(pInst->voiceRadioTech));
         }
         if(is3gpp2(newVoiceRadioTech)) {
             newCdmaSubscriptionSource = decodeCdmaSubscriptionSource(newRadioState);
-            if(newCdmaSubscriptionSource != cdmaSubscriptionSource) {
-                cdmaSubscriptionSource = newCdmaSubscriptionSource;
-                RIL_onUnsolicitedResponse (RIL_UNSOL_CDMA_SUBSCRIPTION_SOURCE_CHANGED,
-                        &cdmaSubscriptionSource, sizeof(cdmaSubscriptionSource));
+            if(newCdmaSubscriptionSource != pInst->cdmaSubscriptionSource) {
+                pInst->cdmaSubscriptionSource = newCdmaSubscriptionSource;
+                RIL_onUnsolicitedResponseInstance (pInst->id,
+                        RIL_UNSOL_CDMA_SUBSCRIPTION_SOURCE_CHANGED,
+                        &pInst->cdmaSubscriptionSource,
+                        sizeof(pInst->cdmaSubscriptionSource));
             }
         }
         newSimStatus = decodeSimStatus(newRadioState);
-        if(newSimStatus != simRuimStatus) {
-            simRuimStatus = newSimStatus;
-            RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
+        if(newSimStatus != pInst->simRuimStatus) {
+            pInst->simRuimStatus = newSimStatus;
+            RIL_onUnsolicitedResponseInstance(pInst->id,
+                        RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
         }
 
         /* Send RADIO_ON to telephony */
@@ -3777,22 +7140,139 @@ processRadioState(RIL_RadioState newRadioState) {
     return newRadioState;
 }
 
+/**
+ * Radio state of an instance as last reported by the vendor, asking
+ * onStateRequest() only while nothing was reported yet. *pCached tells
+ * whether the derived fields of the instance match the state.
+ */
+static RIL_RadioState
+currentRadioState(RilInstance *pInst, bool *pCached) {
+    RIL_RadioState state;
+
+    pthread_mutex_lock(&s_radioStateMutex);
+    *pCached = pInst->radioStateValid;
+    state = pInst->vendorRadioState;
+    pthread_mutex_unlock(&s_radioStateMutex);
+
+    if (!*pCached) {
+        state = pInst->callbacks.onStateRequest();
+    }
+
+    return state;
+}
+
+/**
+ * Updates the radio state cache after RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
+ * with the single onStateRequest() call per change. The derived fields
+ * and their unsolicited responses are only recomputed when the vendor
+ * state actually changed. Returns the state to report to the client;
+ * *pVendorState gets the one the vendor reported.
+ *
+ * The cache is only published once processRadioState() has updated the
+ * derived fields, so readers never see a state without its reported
+ * value or voice radio technology. s_radioRefreshMutex keeps concurrent
+ * refreshes from publishing out of order.
+ */
+static RIL_RadioState
+refreshRadioState(RilInstance *pInst, RIL_RadioState *pVendorState) {
+    RIL_RadioState state;
+    RIL_RadioState reported;
+
+    pthread_mutex_lock(&s_radioRefreshMutex);
+
+    state = pInst->callbacks.onStateRequest();
+    *pVendorState = state;
+
+    pthread_mutex_lock(&s_radioStateMutex);
+    if (pInst->radioStateValid && pInst->vendorRadioState == state) {
+        reported = pInst->reportedRadioState;
+        pthread_mutex_unlock(&s_radioStateMutex);
+        pthread_mutex_unlock(&s_radioRefreshMutex);
+        return reported;
+    }
+    pthread_mutex_unlock(&s_radioStateMutex);
+
+    // may send further unsolicited responses, so without s_radioStateMutex
+    reported = processRadioState(pInst, state);
+
+    pthread_mutex_lock(&s_radioStateMutex);
+    pInst->radioStateValid = true;
+    pInst->vendorRadioState = state;
+    pInst->reportedRadioState = reported;
+    pthread_mutex_unlock(&s_radioStateMutex);
+
+    checkpointRadioState(pInst, reported);
+
+    pthread_mutex_unlock(&s_radioRefreshMutex);
+
+    return reported;
+}
+
+/**
+ * Sends the cached radio state to a new client without going back to
+ * the vendor. Returns false if there is none yet.
+ */
+static bool
+sendCachedRadioState(RilInstance *pInst) {
+    RIL_RadioState reported;
+    Parcel p;
+
+    pthread_mutex_lock(&s_radioStateMutex);
+    if (!pInst->radioStateValid) {
+        pthread_mutex_unlock(&s_radioStateMutex);
+        return false;
+    }
+    reported = pInst->reportedRadioState;
+    pthread_mutex_unlock(&s_radioStateMutex);
+
+    p.writeInt32 (RESPONSE_UNSOLICITED);
+    p.writeInt32 (RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED);
+    p.writeInt32 (reported);
+
+    appendPrintBuf("[UNSL]< %s {%s} (cached)",
+            requestToString(RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED),
+            radioStateToString(reported));
+    sendResponse(pInst, p);
+
+    return true;
+}
+
 extern "C"
 void RIL_onUnsolicitedResponse(int unsolResponse, const void *data,
                                 size_t datalen)
 {
+    if (s_defaultInstance == NULL) {
+        // Ignore RIL_onUnsolicitedResponse before RIL_register
+        RLOGW("RIL_onUnsolicitedResponse called before RIL_register");
+        return;
+    }
+
+    RIL_onUnsolicitedResponseInstance(s_defaultInstance->id,
+            unsolResponse, data, datalen);
+}
+
+extern "C"
+void RIL_onUnsolicitedResponseInstance(int instance, int unsolResponse,
+                                const void *data, size_t datalen)
+{
+    RilInstance *pInst;
     int unsolResponseIndex;
     int ret;
     int64_t timeReceived = 0;
     bool shouldScheduleTimeout = false;
     RIL_RadioState newState;
+    RIL_RadioState vendorState;
 
-    if (s_registerCalled == 0) {
-        // Ignore RIL_onUnsolicitedResponse before RIL_register
-        RLOGW("RIL_onUnsolicitedResponse called before RIL_register");
+    if (instance < 0 || instance >= MAX_RIL_INSTANCES
+            || !s_instances[instance].registered) {
+        // Ignore unsolicited responses for instances not registered
+        RLOGW("RIL_onUnsolicitedResponse called before RIL_register "
+                "of instance %d", instance);
         return;
     }
 
+    pInst = &s_instances[instance];
+
     unsolResponseIndex = unsolResponse - RIL_UNSOL_RESPONSE_BASE;
 
     if ((unsolResponseIndex < 0)
@@ -3801,6 +7281,14 @@ void RIL_onUnsolicitedResponse(int unsolResponse, const void *data,
         return;
     }
 
+    if (s_unsolResponses[unsolResponseIndex].responseFunction == NULL) {
+        RLOGE("%s not supported by this build",
+                requestToString(unsolResponse));
+        return;
+    }
+
+    METRIC_ADD(s_metrics.unsolicited[unsolResponseIndex], 1);
+
     if (extlog)
         RLOGI("[ExtLog] < %s [id = %d, size = %d]", 
             requestToString(unsolResponse), unsolResponse, datalen);
@@ -3834,8 +7322,26 @@ void RIL_onUnsolicitedResponse(int unsolResponse, const void *data,
     Parcel p;
 
     p.writeInt32 (RESPONSE_UNSOLICITED);
+
+    if (unsolResponse == RIL_UNSOL_CELL_INFO_LIST
+            && (pInst->clientFeatures & LIBRIL_FEATURE_CELL_INFO_DELTA)) {
+        p.writeInt32 (RIL_UNSOL_LIBRIL_CELL_INFO_DELTA);
+        ret = responseCellInfoListDelta(pInst, p, const_cast<void*>(data), datalen);
+        if (ret != 0) {
+            goto error_exit;
+        }
+        ret = sendResponse(pInst, p);
+        goto sent;
+    }
+
     p.writeInt32 (unsolResponse);
 
+    if (data != NULL && s_rawPassthrough
+            && s_unsolResponses[unsolResponseIndex].responseFunction == responseRaw) {
+        sendResponseRawPayload(pInst, p, data, datalen);
+        goto sent;
+    }
+
     ret = s_unsolResponses[unsolResponseIndex]
                 .responseFunction(p, const_cast<void*>(data), datalen);
     if (ret != 0) {
@@ -3846,10 +7352,10 @@ void RIL_onUnsolicitedResponse(int unsolResponse, const void *data,
     // some things get more payload
     switch(unsolResponse) {
         case RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED:
-            newState = processRadioState(s_callbacks.onStateRequest());
+            newState = refreshRadioState(pInst, &vendorState);
             p.writeInt32(newState);
             appendPrintBuf("%s {%s}", printBuf,
-                radioStateToString(s_callbacks.onStateRequest()));
+                radioStateToString(vendorState));
         break;
 
 
@@ -3863,7 +7369,8 @@ void RIL_onUnsolicitedResponse(int unsolResponse, const void *data,
         break;
     }
 
-    ret = sendResponse(p);
+    ret = sendResponse(pInst, p);
+    checkpointUnsol(pInst, unsolResponse, p.data(), p.dataSize());
     if (ret != 0 && unsolResponse == RIL_UNSOL_NITZ_TIME_RECEIVED) {
 
         // Unfortunately, NITZ time is not poll/update like everything
@@ -3871,16 +7378,17 @@ void RIL_onUnsolicitedResponse(int unsolResponse, const void *data,
         // keep a copy of the last NITZ response (with receive time noted
         // above) around so we can deliver it when it is connected
 
-        if (s_lastNITZTimeData != NULL) {
-            free (s_lastNITZTimeData);
-            s_lastNITZTimeData = NULL;
+        if (pInst->lastNITZTimeData != NULL) {
+            free (pInst->lastNITZTimeData);
+            pInst->lastNITZTimeData = NULL;
         }
 
-        s_lastNITZTimeData = malloc(p.dataSize());
-        s_lastNITZTimeDataSize = p.dataSize();
-        memcpy(s_lastNITZTimeData, p.data(), p.dataSize());
+        pInst->lastNITZTimeData = malloc(p.dataSize());
+        pInst->lastNITZTimeDataSize = p.dataSize();
+        memcpy(pInst->lastNITZTimeData, p.data(), p.dataSize());
     }
 
+sent:
     // For now, we automatically go back to sleep after TIMEVAL_WAKE_TIMEOUT
     // FIXME The java code should handshake here to release wake lock
 
@@ -3907,6 +7415,31 @@ error_exit:
 /** FIXME generalize this if you track UserCAllbackInfo, clear it
     when the callback occurs
 */
+/**
+ * Name of a libril timer callback for the loop profile,
+ * NULL for callbacks of the vendor RIL.
+ */
+static const char *
+timedCallbackName(void *callback) {
+    static const struct {
+        RIL_TimedCallback callback;
+        const char *name;
+    } names[] = {
+        {wakeTimeoutCallback, "wakeTimeout"},
+        {drainDeferredRequests, "drainDeferred"},
+        {readinessProbeCallback, "readinessProbe"},
+        {debugClientTimeout, "debugClientTimeout"},
+        {debugNetworkSelectionAutomatic, "debugNetworkSelection"},
+    };
+
+    for (size_t i = 0; i < NUM_ELEMS(names); i++) {
+        if ((void *)names[i].callback == callback) {
+            return names[i].name;
+        }
+    }
+    return NULL;
+}
+
 static UserCallbackInfo *
 internalRequestTimedCallback (RIL_TimedCallback callback, void *param,
                                 const struct timeval *relativeTime)
@@ -3944,19 +7477,11 @@ RIL_requestTimedCallback (RIL_TimedCallback callback, void *param,
 
 const char *
 failCauseToString(RIL_Errno e) {
+    if (e >= 0 && e < (int)NUM_ELEMS(s_failCauses)) {
+        return s_failCauses[e].name;
+    }
+
     switch(e) {
-        case RIL_E_SUCCESS: return "E_SUCCESS";
-        case RIL_E_RADIO_NOT_AVAILABLE: return "E_RADIO_NOT_AVAILABLE";
-        case RIL_E_GENERIC_FAILURE: return "E_GENERIC_FAILURE";
-        case RIL_E_PASSWORD_INCORRECT: return "E_PASSWORD_INCORRECT";
-        case RIL_E_SIM_PIN2: return "E_SIM_PIN2";
-        case RIL_E_SIM_PUK2: return "E_SIM_PUK2";
-        case RIL_E_REQUEST_NOT_SUPPORTED: return "E_REQUEST_NOT_SUPPORTED";
-        case RIL_E_CANCELLED: return "E_CANCELLED";
-        case RIL_E_OP_NOT_ALLOWED_DURING_VOICE_CALL: return "E_OP_NOT_ALLOWED_DURING_VOICE_CALL";
-        case RIL_E_OP_NOT_ALLOWED_BEFORE_REG_TO_NW: return "E_OP_NOT_ALLOWED_BEFORE_REG_TO_NW";
-        case RIL_E_SMS_SEND_FAIL_RETRY: return "E_SMS_SEND_FAIL_RETRY";
-        case RIL_E_SIM_ABSENT:return "E_SIM_ABSENT";
         case RIL_E_ILLEGAL_SIM_OR_ME:return "E_ILLEGAL_SIM_OR_ME";
 #ifdef FEATURE_MULTIMODE_ANDROID
         case RIL_E_SUBSCRIPTION_NOT_AVAILABLE:return "E_SUBSCRIPTION_NOT_AVAILABLE";
@@ -3999,181 +7524,22 @@ callStateToString(RIL_CallState s) {
 
 const char *
 requestToString(int request) {
-/*
- cat libs/telephony/ril_commands.h \
- | egrep "^ *{RIL_" \
- | sed -re 's/\{RIL_([^,]+),[^,]+,([^}]+).+/case RIL_\1: return "\1";/'
-
+    if (request >= 0 && request < (int)NUM_ELEMS(s_commands)) {
+        return s_commands[request].name;
+    }
 
- cat libs/telephony/ril_unsol_commands.h \
- | egrep "^ *{RIL_" \
- | sed -re 's/\{RIL_([^,]+),([^}]+).+/case RIL_\1: return "\1";/'
+    int unsolIndex = request - RIL_UNSOL_RESPONSE_BASE;
+    if (unsolIndex >= 0 && unsolIndex < (int)NUM_ELEMS(s_unsolResponses)) {
+        return s_unsolResponses[unsolIndex].name;
+    }
 
-*/
     switch(request) {
-        case RIL_REQUEST_GET_SIM_STATUS: return "GET_SIM_STATUS";
-        case RIL_REQUEST_ENTER_SIM_PIN: return "ENTER_SIM_PIN";
-        case RIL_REQUEST_ENTER_SIM_PUK: return "ENTER_SIM_PUK";
-        case RIL_REQUEST_ENTER_SIM_PIN2: return "ENTER_SIM_PIN2";
-        case RIL_REQUEST_ENTER_SIM_PUK2: return "ENTER_SIM_PUK2";
-        case RIL_REQUEST_CHANGE_SIM_PIN: return "CHANGE_SIM_PIN";
-        case RIL_REQUEST_CHANGE_SIM_PIN2: return "CHANGE_SIM_PIN2";
-        case RIL_REQUEST_ENTER_DEPERSONALIZATION_CODE: return "ENTER_DEPERSONALIZATION_CODE";
-        case RIL_REQUEST_GET_CURRENT_CALLS: return "GET_CURRENT_CALLS";
-        case RIL_REQUEST_DIAL: return "DIAL";
-        case RIL_REQUEST_GET_IMSI: return "GET_IMSI";
-        case RIL_REQUEST_HANGUP: return "HANGUP";
-        case RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND: return "HANGUP_WAITING_OR_BACKGROUND";
-        case RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND: return "HANGUP_FOREGROUND_RESUME_BACKGROUND";
-        case RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE: return "SWITCH_WAITING_OR_HOLDING_AND_ACTIVE";
-        case RIL_REQUEST_CONFERENCE: return "CONFERENCE";
-        case RIL_REQUEST_UDUB: return "UDUB";
-        case RIL_REQUEST_LAST_CALL_FAIL_CAUSE: return "LAST_CALL_FAIL_CAUSE";
-        case RIL_REQUEST_SIGNAL_STRENGTH: return "SIGNAL_STRENGTH";
-        case RIL_REQUEST_VOICE_REGISTRATION_STATE: return "VOICE_REGISTRATION_STATE";
-        case RIL_REQUEST_DATA_REGISTRATION_STATE: return "DATA_REGISTRATION_STATE";
-        case RIL_REQUEST_OPERATOR: return "OPERATOR";
-        case RIL_REQUEST_RADIO_POWER: return "RADIO_POWER";
-        case RIL_REQUEST_DTMF: return "DTMF";
-        case RIL_REQUEST_SEND_SMS: return "SEND_SMS";
-        case RIL_REQUEST_SEND_SMS_EXPECT_MORE: return "SEND_SMS_EXPECT_MORE";
-        case RIL_REQUEST_SETUP_DATA_CALL: return "SETUP_DATA_CALL";
-        case RIL_REQUEST_SIM_IO: return "SIM_IO";
-        case RIL_REQUEST_SIM_TRANSMIT_BASIC: return "SIM_TRANSMIT_BASIC";
-        case RIL_REQUEST_SIM_OPEN_CHANNEL: return "SIM_OPEN_CHANNEL";
-        case RIL_REQUEST_SIM_CLOSE_CHANNEL: return "SIM_CLOSE_CHANNEL";
-        case RIL_REQUEST_SIM_TRANSMIT_CHANNEL: return "SIM_TRANSMIT_CHANNEL";
-        case RIL_REQUEST_SIM_GET_ATR: return "SIM_GET_ATR";
-        case RIL_REQUEST_SEND_USSD: return "SEND_USSD";
-        case RIL_REQUEST_CANCEL_USSD: return "CANCEL_USSD";
-        case RIL_REQUEST_GET_CLIR: return "GET_CLIR";
-        case RIL_REQUEST_SET_CLIR: return "SET_CLIR";
-        case RIL_REQUEST_QUERY_CALL_FORWARD_STATUS: return "QUERY_CALL_FORWARD_STATUS";
-        case RIL_REQUEST_SET_CALL_FORWARD: return "SET_CALL_FORWARD";
-        case RIL_REQUEST_QUERY_CALL_WAITING: return "QUERY_CALL_WAITING";
-        case RIL_REQUEST_SET_CALL_WAITING: return "SET_CALL_WAITING";
-        case RIL_REQUEST_SMS_ACKNOWLEDGE: return "SMS_ACKNOWLEDGE";
-        case RIL_REQUEST_GET_IMEI: return "GET_IMEI";
-        case RIL_REQUEST_GET_IMEISV: return "GET_IMEISV";
-        case RIL_REQUEST_ANSWER: return "ANSWER";
-        case RIL_REQUEST_DEACTIVATE_DATA_CALL: return "DEACTIVATE_DATA_CALL";
-        case RIL_REQUEST_QUERY_FACILITY_LOCK: return "QUERY_FACILITY_LOCK";
-        case RIL_REQUEST_SET_FACILITY_LOCK: return "SET_FACILITY_LOCK";
-        case RIL_REQUEST_CHANGE_BARRING_PASSWORD: return "CHANGE_BARRING_PASSWORD";
-        case RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE: return "QUERY_NETWORK_SELECTION_MODE";
-        case RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC: return "SET_NETWORK_SELECTION_AUTOMATIC";
-        case RIL_REQUEST_SET_NETWORK_SELECTION_MANUAL: return "SET_NETWORK_SELECTION_MANUAL";
-        case RIL_REQUEST_QUERY_AVAILABLE_NETWORKS : return "QUERY_AVAILABLE_NETWORKS ";
-        case RIL_REQUEST_DTMF_START: return "DTMF_START";
-        case RIL_REQUEST_DTMF_STOP: return "DTMF_STOP";
-        case RIL_REQUEST_BASEBAND_VERSION: return "BASEBAND_VERSION";
-        case RIL_REQUEST_SEPARATE_CONNECTION: return "SEPARATE_CONNECTION";
-        case RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE: return "SET_PREFERRED_NETWORK_TYPE";
-        case RIL_REQUEST_GET_PREFERRED_NETWORK_TYPE: return "GET_PREFERRED_NETWORK_TYPE";
-        case RIL_REQUEST_GET_NEIGHBORING_CELL_IDS: return "GET_NEIGHBORING_CELL_IDS";
-        case RIL_REQUEST_SET_MUTE: return "SET_MUTE";
-        case RIL_REQUEST_GET_MUTE: return "GET_MUTE";
-        case RIL_REQUEST_QUERY_CLIP: return "QUERY_CLIP";
-        case RIL_REQUEST_LAST_DATA_CALL_FAIL_CAUSE: return "LAST_DATA_CALL_FAIL_CAUSE";
-        case RIL_REQUEST_DATA_CALL_LIST: return "DATA_CALL_LIST";
-        case RIL_REQUEST_RESET_RADIO: return "RESET_RADIO";
-        case RIL_REQUEST_OEM_HOOK_RAW: return "OEM_HOOK_RAW";
-        case RIL_REQUEST_OEM_HOOK_STRINGS: return "OEM_HOOK_STRINGS";
-        case RIL_REQUEST_SET_BAND_MODE: return "SET_BAND_MODE";
-        case RIL_REQUEST_QUERY_AVAILABLE_BAND_MODE: return "QUERY_AVAILABLE_BAND_MODE";
-        case RIL_REQUEST_STK_GET_PROFILE: return "STK_GET_PROFILE";
-        case RIL_REQUEST_STK_SET_PROFILE: return "STK_SET_PROFILE";
-        case RIL_REQUEST_STK_SEND_ENVELOPE_COMMAND: return "STK_SEND_ENVELOPE_COMMAND";
-        case RIL_REQUEST_STK_SEND_TERMINAL_RESPONSE: return "STK_SEND_TERMINAL_RESPONSE";
-        case RIL_REQUEST_STK_HANDLE_CALL_SETUP_REQUESTED_FROM_SIM: return "STK_HANDLE_CALL_SETUP_REQUESTED_FROM_SIM";
-        case RIL_REQUEST_SCREEN_STATE: return "SCREEN_STATE";
-        case RIL_REQUEST_EXPLICIT_CALL_TRANSFER: return "EXPLICIT_CALL_TRANSFER";
-        case RIL_REQUEST_SET_LOCATION_UPDATES: return "SET_LOCATION_UPDATES";
-        case RIL_REQUEST_CDMA_SET_SUBSCRIPTION_SOURCE:return"CDMA_SET_SUBSCRIPTION_SOURCE";
-        case RIL_REQUEST_CDMA_SET_ROAMING_PREFERENCE:return"CDMA_SET_ROAMING_PREFERENCE";
-        case RIL_REQUEST_CDMA_QUERY_ROAMING_PREFERENCE:return"CDMA_QUERY_ROAMING_PREFERENCE";
-        case RIL_REQUEST_SET_TTY_MODE:return"SET_TTY_MODE";
-        case RIL_REQUEST_QUERY_TTY_MODE:return"QUERY_TTY_MODE";
-        case RIL_REQUEST_CDMA_SET_PREFERRED_VOICE_PRIVACY_MODE:return"CDMA_SET_PREFERRED_VOICE_PRIVACY_MODE";
-        case RIL_REQUEST_CDMA_QUERY_PREFERRED_VOICE_PRIVACY_MODE:return"CDMA_QUERY_PREFERRED_VOICE_PRIVACY_MODE";
-        case RIL_REQUEST_CDMA_FLASH:return"CDMA_FLASH";
-        case RIL_REQUEST_CDMA_BURST_DTMF:return"CDMA_BURST_DTMF";
-        case RIL_REQUEST_CDMA_SEND_SMS:return"CDMA_SEND_SMS";
-        case RIL_REQUEST_CDMA_SMS_ACKNOWLEDGE:return"CDMA_SMS_ACKNOWLEDGE";
-        case RIL_REQUEST_GSM_GET_BROADCAST_SMS_CONFIG:return"GSM_GET_BROADCAST_SMS_CONFIG";
-        case RIL_REQUEST_GSM_SET_BROADCAST_SMS_CONFIG:return"GSM_SET_BROADCAST_SMS_CONFIG";
-        case RIL_REQUEST_CDMA_GET_BROADCAST_SMS_CONFIG:return "CDMA_GET_BROADCAST_SMS_CONFIG";
-        case RIL_REQUEST_CDMA_SET_BROADCAST_SMS_CONFIG:return "CDMA_SET_BROADCAST_SMS_CONFIG";
-        case RIL_REQUEST_CDMA_SMS_BROADCAST_ACTIVATION:return "CDMA_SMS_BROADCAST_ACTIVATION";
-        case RIL_REQUEST_CDMA_VALIDATE_AND_WRITE_AKEY: return"CDMA_VALIDATE_AND_WRITE_AKEY";
-        case RIL_REQUEST_CDMA_SUBSCRIPTION: return"CDMA_SUBSCRIPTION";
-        case RIL_REQUEST_CDMA_WRITE_SMS_TO_RUIM: return "CDMA_WRITE_SMS_TO_RUIM";
-        case RIL_REQUEST_CDMA_DELETE_SMS_ON_RUIM: return "CDMA_DELETE_SMS_ON_RUIM";
-        case RIL_REQUEST_DEVICE_IDENTITY: return "DEVICE_IDENTITY";
-        case RIL_REQUEST_EXIT_EMERGENCY_CALLBACK_MODE: return "EXIT_EMERGENCY_CALLBACK_MODE";
-        case RIL_REQUEST_GET_SMSC_ADDRESS: return "GET_SMSC_ADDRESS";
-        case RIL_REQUEST_SET_SMSC_ADDRESS: return "SET_SMSC_ADDRESS";
-        case RIL_REQUEST_REPORT_SMS_MEMORY_STATUS: return "REPORT_SMS_MEMORY_STATUS";
-        case RIL_REQUEST_REPORT_STK_SERVICE_IS_RUNNING: return "REPORT_STK_SERVICE_IS_RUNNING";
-        case RIL_REQUEST_CDMA_GET_SUBSCRIPTION_SOURCE: return "CDMA_GET_SUBSCRIPTION_SOURCE";
-        case RIL_REQUEST_ISIM_AUTHENTICATION: return "ISIM_AUTHENTICATION";
-        case RIL_REQUEST_ACKNOWLEDGE_INCOMING_GSM_SMS_WITH_PDU: return "RIL_REQUEST_ACKNOWLEDGE_INCOMING_GSM_SMS_WITH_PDU";
-        case RIL_REQUEST_STK_SEND_ENVELOPE_WITH_STATUS: return "RIL_REQUEST_STK_SEND_ENVELOPE_WITH_STATUS";
-        case RIL_REQUEST_VOICE_RADIO_TECH: return "VOICE_RADIO_TECH";
-        case RIL_REQUEST_WRITE_SMS_TO_SIM: return "WRITE_SMS_TO_SIM";
-#ifndef RIL_NO_CELL_INFO_LIST
-        case RIL_REQUEST_GET_CELL_INFO_LIST: return"GET_CELL_INFO_LIST";
-        case RIL_REQUEST_SET_UNSOL_CELL_INFO_LIST_RATE: return"SET_UNSOL_CELL_INFO_LIST_RATE";
-#endif
-        case RIL_REQUEST_SET_INITIAL_ATTACH_APN: return "RIL_REQUEST_SET_INITIAL_ATTACH_APN";
-        case RIL_REQUEST_IMS_REGISTRATION_STATE: return "IMS_REGISTRATION_STATE";
-        case RIL_REQUEST_IMS_SEND_SMS: return "IMS_SEND_SMS";
-        case RIL_REQUEST_GET_DATA_CALL_PROFILE: return "GET_DATA_CALL_PROFILE";
-        case RIL_REQUEST_SET_UICC_SUBSCRIPTION: return "SET_UICC_SUBSCRIPTION";
-        case RIL_REQUEST_SET_DATA_SUBSCRIPTION: return "SET_DATA_SUBSCRIPTION";
-        case RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED: return "UNSOL_RESPONSE_RADIO_STATE_CHANGED";
-        case RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED: return "UNSOL_RESPONSE_CALL_STATE_CHANGED";
-        case RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED: return "UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED";
-        case RIL_UNSOL_RESPONSE_NEW_SMS: return "UNSOL_RESPONSE_NEW_SMS";
-        case RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT: return "UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT";
-        case RIL_UNSOL_RESPONSE_NEW_SMS_ON_SIM: return "UNSOL_RESPONSE_NEW_SMS_ON_SIM";
-        case RIL_UNSOL_ON_USSD: return "UNSOL_ON_USSD";
-        case RIL_UNSOL_ON_USSD_REQUEST: return "UNSOL_ON_USSD_REQUEST(obsolete)";
-        case RIL_UNSOL_NITZ_TIME_RECEIVED: return "UNSOL_NITZ_TIME_RECEIVED";
-        case RIL_UNSOL_SIGNAL_STRENGTH: return "UNSOL_SIGNAL_STRENGTH";
-        case RIL_UNSOL_SUPP_SVC_NOTIFICATION: return "UNSOL_SUPP_SVC_NOTIFICATION";
-        case RIL_UNSOL_STK_SESSION_END: return "UNSOL_STK_SESSION_END";
-        case RIL_UNSOL_STK_PROACTIVE_COMMAND: return "UNSOL_STK_PROACTIVE_COMMAND";
-        case RIL_UNSOL_STK_EVENT_NOTIFY: return "UNSOL_STK_EVENT_NOTIFY";
-        case RIL_UNSOL_STK_CALL_SETUP: return "UNSOL_STK_CALL_SETUP";
-        case RIL_UNSOL_SIM_SMS_STORAGE_FULL: return "UNSOL_SIM_SMS_STORAGE_FUL";
-        case RIL_UNSOL_SIM_REFRESH: return "UNSOL_SIM_REFRESH";
-        case RIL_UNSOL_DATA_CALL_LIST_CHANGED: return "UNSOL_DATA_CALL_LIST_CHANGED";
-        case RIL_UNSOL_CALL_RING: return "UNSOL_CALL_RING";
-        case RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED: return "UNSOL_RESPONSE_SIM_STATUS_CHANGED";
-        case RIL_UNSOL_RESPONSE_CDMA_NEW_SMS: return "UNSOL_NEW_CDMA_SMS";
-        case RIL_UNSOL_RESPONSE_NEW_BROADCAST_SMS: return "UNSOL_NEW_BROADCAST_SMS";
-        case RIL_UNSOL_CDMA_RUIM_SMS_STORAGE_FULL: return "UNSOL_CDMA_RUIM_SMS_STORAGE_FULL";
-        case RIL_UNSOL_RESTRICTED_STATE_CHANGED: return "UNSOL_RESTRICTED_STATE_CHANGED";
-        case RIL_UNSOL_ENTER_EMERGENCY_CALLBACK_MODE: return "UNSOL_ENTER_EMERGENCY_CALLBACK_MODE";
-        case RIL_UNSOL_CDMA_CALL_WAITING: return "UNSOL_CDMA_CALL_WAITING";
-        case RIL_UNSOL_CDMA_OTA_PROVISION_STATUS: return "UNSOL_CDMA_OTA_PROVISION_STATUS";
-        case RIL_UNSOL_CDMA_INFO_REC: return "UNSOL_CDMA_INFO_REC";
-        case RIL_UNSOL_OEM_HOOK_RAW: return "UNSOL_OEM_HOOK_RAW";
-        case RIL_UNSOL_RINGBACK_TONE: return "UNSOL_RINGBACK_TONE";
-        case RIL_UNSOL_RESEND_INCALL_MUTE: return "UNSOL_RESEND_INCALL_MUTE";
-        case RIL_UNSOL_CDMA_SUBSCRIPTION_SOURCE_CHANGED: return "UNSOL_CDMA_SUBSCRIPTION_SOURCE_CHANGED";
-        case RIL_UNSOL_CDMA_PRL_CHANGED: return "UNSOL_CDMA_PRL_CHANGED";
-        case RIL_UNSOL_EXIT_EMERGENCY_CALLBACK_MODE: return "UNSOL_EXIT_EMERGENCY_CALLBACK_MODE";
-        case RIL_UNSOL_RIL_CONNECTED: return "UNSOL_RIL_CONNECTED";
-        case RIL_UNSOL_VOICE_RADIO_TECH_CHANGED: return "UNSOL_VOICE_RADIO_TECH_CHANGED";
-#ifndef RIL_NO_CELL_INFO_LIST
-        case RIL_UNSOL_CELL_INFO_LIST: return "UNSOL_CELL_INFO_LIST";
-#endif
-        case RIL_UNSOL_RESPONSE_IMS_NETWORK_STATE_CHANGED: return "RESPONSE_IMS_NETWORK_STATE_CHANGED";
-        case RIL_UNSOL_UICC_SUBSCRIPTION_STATUS_CHANGED: return "UNSOL_UICC_SUBSCRIPTION_STATUS_CHANGED";
-        default: return "<unknown request>";
+        case RIL_REQUEST_LIBRIL_SET_FEATURES: return "LIBRIL_SET_FEATURES";
+        case RIL_UNSOL_LIBRIL_CELL_INFO_DELTA: return "UNSOL_LIBRIL_CELL_INFO_DELTA";
+        case RIL_UNSOL_LIBRIL_NETWORK_SCAN_RESULT: return "UNSOL_LIBRIL_NETWORK_SCAN_RESULT";
     }
+
+    return "<unknown request>";
 }
 
 } /* namespace android */
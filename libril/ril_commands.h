@@ -16,133 +16,136 @@
 ** See the License for the specific language governing permissions and
 ** limitations under the License.
 */
-    {0, NULL, NULL},                   //none
-    {RIL_REQUEST_GET_SIM_STATUS, dispatchVoid, responseSimStatus},
-    {RIL_REQUEST_ENTER_SIM_PIN, dispatchStrings, responseInts},
-    {RIL_REQUEST_ENTER_SIM_PUK, dispatchStrings, responseInts},
-    {RIL_REQUEST_ENTER_SIM_PIN2, dispatchStrings, responseInts},
-    {RIL_REQUEST_ENTER_SIM_PUK2, dispatchStrings, responseInts},
-    {RIL_REQUEST_CHANGE_SIM_PIN, dispatchStrings, responseInts},
-    {RIL_REQUEST_CHANGE_SIM_PIN2, dispatchStrings, responseInts},
-    {RIL_REQUEST_ENTER_DEPERSONALIZATION_CODE, dispatchStrings, responseInts},
-    {RIL_REQUEST_GET_CURRENT_CALLS, dispatchVoid, responseCallList},
-    {RIL_REQUEST_DIAL, dispatchDial, responseVoid},
-    {RIL_REQUEST_GET_IMSI, dispatchStrings, responseString},
-    {RIL_REQUEST_HANGUP, dispatchInts, responseVoid},
-    {RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND, dispatchVoid, responseVoid},
-    {RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND, dispatchVoid, responseVoid},
-    {RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE, dispatchVoid, responseVoid},
-    {RIL_REQUEST_CONFERENCE, dispatchVoid, responseVoid},
-    {RIL_REQUEST_UDUB, dispatchVoid, responseVoid},
-    {RIL_REQUEST_LAST_CALL_FAIL_CAUSE, dispatchVoid, responseInts},
-    {RIL_REQUEST_SIGNAL_STRENGTH, dispatchVoid, responseRilSignalStrength},
-    {RIL_REQUEST_VOICE_REGISTRATION_STATE, dispatchVoid, responseStrings},
-    {RIL_REQUEST_DATA_REGISTRATION_STATE, dispatchVoid, responseStrings},
-    {RIL_REQUEST_OPERATOR, dispatchVoid, responseStrings},
-    {RIL_REQUEST_RADIO_POWER, dispatchInts, responseVoid},
-    {RIL_REQUEST_DTMF, dispatchString, responseVoid},
-    {RIL_REQUEST_SEND_SMS, dispatchStrings, responseSMS},
-    {RIL_REQUEST_SEND_SMS_EXPECT_MORE, dispatchStrings, responseSMS},
-    {RIL_REQUEST_SETUP_DATA_CALL, dispatchDataCall, responseSetupDataCall},
-    {RIL_REQUEST_SIM_IO, dispatchSIM_IO, responseSIM_IO},
-    {RIL_REQUEST_SEND_USSD, dispatchString, responseVoid},
-    {RIL_REQUEST_CANCEL_USSD, dispatchVoid, responseVoid},
-    {RIL_REQUEST_GET_CLIR, dispatchVoid, responseInts},
-    {RIL_REQUEST_SET_CLIR, dispatchInts, responseVoid},
-    {RIL_REQUEST_QUERY_CALL_FORWARD_STATUS, dispatchCallForward, responseCallForwards},
-    {RIL_REQUEST_SET_CALL_FORWARD, dispatchCallForward, responseVoid},
-    {RIL_REQUEST_QUERY_CALL_WAITING, dispatchInts, responseInts},
-    {RIL_REQUEST_SET_CALL_WAITING, dispatchInts, responseVoid},
-    {RIL_REQUEST_SMS_ACKNOWLEDGE, dispatchInts, responseVoid},
-    {RIL_REQUEST_GET_IMEI, dispatchVoid, responseString},
-    {RIL_REQUEST_GET_IMEISV, dispatchVoid, responseString},
-    {RIL_REQUEST_ANSWER,dispatchVoid, responseVoid},
-    {RIL_REQUEST_DEACTIVATE_DATA_CALL, dispatchStrings, responseVoid},
-    {RIL_REQUEST_QUERY_FACILITY_LOCK, dispatchStrings, responseInts},
-    {RIL_REQUEST_SET_FACILITY_LOCK, dispatchStrings, responseInts},
-    {RIL_REQUEST_CHANGE_BARRING_PASSWORD, dispatchStrings, responseVoid},
-    {RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE, dispatchVoid, responseInts},
-    {RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC, dispatchVoid, responseVoid},
-    {RIL_REQUEST_SET_NETWORK_SELECTION_MANUAL, dispatchString, responseVoid},
+    {0, NULL, NULL, PRIORITY_NORMAL, "<unknown request>"},  //none
+    REQUEST(GET_SIM_STATUS, dispatchVoid, responseSimStatus, NORMAL),
+    REQUEST(ENTER_SIM_PIN, dispatchStrings, responseInts, NORMAL),
+    REQUEST(ENTER_SIM_PUK, dispatchStrings, responseInts, NORMAL),
+    REQUEST(ENTER_SIM_PIN2, dispatchStrings, responseInts, NORMAL),
+    REQUEST(ENTER_SIM_PUK2, dispatchStrings, responseInts, NORMAL),
+    REQUEST(CHANGE_SIM_PIN, dispatchStrings, responseInts, NORMAL),
+    REQUEST(CHANGE_SIM_PIN2, dispatchStrings, responseInts, NORMAL),
+    REQUEST(ENTER_DEPERSONALIZATION_CODE, dispatchStrings, responseInts, NORMAL),
+    REQUEST(GET_CURRENT_CALLS, dispatchVoid, responseCallList, NORMAL),
+    REQUEST(DIAL, dispatchDial, responseVoid, CRITICAL),
+    REQUEST(GET_IMSI, dispatchStrings, responseString, NORMAL),
+    REQUEST(HANGUP, dispatchInts, responseVoid, CRITICAL),
+    REQUEST(HANGUP_WAITING_OR_BACKGROUND, dispatchVoid, responseVoid, CRITICAL),
+    REQUEST(HANGUP_FOREGROUND_RESUME_BACKGROUND, dispatchVoid, responseVoid, CRITICAL),
+    REQUEST(SWITCH_WAITING_OR_HOLDING_AND_ACTIVE, dispatchVoid, responseVoid, CRITICAL),
+    REQUEST(CONFERENCE, dispatchVoid, responseVoid, NORMAL),
+    REQUEST(UDUB, dispatchVoid, responseVoid, NORMAL),
+    REQUEST(LAST_CALL_FAIL_CAUSE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(SIGNAL_STRENGTH, dispatchVoid, responseRilSignalStrength, NORMAL),
+    REQUEST(VOICE_REGISTRATION_STATE, dispatchVoid, responseStrings, NORMAL),
+    REQUEST(DATA_REGISTRATION_STATE, dispatchVoid, responseStrings, NORMAL),
+    REQUEST(OPERATOR, dispatchVoid, responseStrings, NORMAL),
+    REQUEST(RADIO_POWER, dispatchInts, responseVoid, CRITICAL),
+    REQUEST(DTMF, dispatchString, responseVoid, CRITICAL),
+    REQUEST(SEND_SMS, dispatchStrings, responseSMS, NORMAL),
+    REQUEST(SEND_SMS_EXPECT_MORE, dispatchStrings, responseSMS, NORMAL),
+    REQUEST(SETUP_DATA_CALL, dispatchDataCall, responseSetupDataCall, NORMAL),
+    REQUEST(SIM_IO, dispatchSIM_IO, responseSIM_IO, NORMAL),
+    REQUEST(SEND_USSD, dispatchString, responseVoid, NORMAL),
+    REQUEST(CANCEL_USSD, dispatchVoid, responseVoid, NORMAL),
+    REQUEST(GET_CLIR, dispatchVoid, responseInts, NORMAL),
+    REQUEST(SET_CLIR, dispatchInts, responseVoid, NORMAL),
+    REQUEST(QUERY_CALL_FORWARD_STATUS, dispatchCallForward, responseCallForwards, NORMAL),
+    REQUEST(SET_CALL_FORWARD, dispatchCallForward, responseVoid, NORMAL),
+    REQUEST(QUERY_CALL_WAITING, dispatchInts, responseInts, NORMAL),
+    REQUEST(SET_CALL_WAITING, dispatchInts, responseVoid, NORMAL),
+    REQUEST(SMS_ACKNOWLEDGE, dispatchInts, responseVoid, NORMAL),
+    REQUEST(GET_IMEI, dispatchVoid, responseString, NORMAL),
+    REQUEST(GET_IMEISV, dispatchVoid, responseString, NORMAL),
+    REQUEST(ANSWER, dispatchVoid, responseVoid, CRITICAL),
+    REQUEST(DEACTIVATE_DATA_CALL, dispatchStrings, responseVoid, NORMAL),
+    REQUEST(QUERY_FACILITY_LOCK, dispatchStrings, responseInts, NORMAL),
+    REQUEST(SET_FACILITY_LOCK, dispatchStrings, responseInts, NORMAL),
+    REQUEST(CHANGE_BARRING_PASSWORD, dispatchStrings, responseVoid, NORMAL),
+    REQUEST(QUERY_NETWORK_SELECTION_MODE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(SET_NETWORK_SELECTION_AUTOMATIC, dispatchVoid, responseVoid, NORMAL),
+    REQUEST(SET_NETWORK_SELECTION_MANUAL, dispatchString, responseVoid, NORMAL),
 #ifdef RIL_VARIANT_LEGACY
-    {RIL_REQUEST_QUERY_AVAILABLE_NETWORKS , dispatchVoid, responseStrings},
+    REQUEST(QUERY_AVAILABLE_NETWORKS, dispatchVoid, responseStrings, NORMAL),
 #else
-    {RIL_REQUEST_QUERY_AVAILABLE_NETWORKS , dispatchVoid, responseStringsNetworks},
+    REQUEST(QUERY_AVAILABLE_NETWORKS, dispatchVoid, responseStringsNetworks, NORMAL),
 #endif
-    {RIL_REQUEST_DTMF_START, dispatchString, responseVoid},
-    {RIL_REQUEST_DTMF_STOP, dispatchVoid, responseVoid},
-    {RIL_REQUEST_BASEBAND_VERSION, dispatchVoid, responseString},
-    {RIL_REQUEST_SEPARATE_CONNECTION, dispatchInts, responseVoid},
-    {RIL_REQUEST_SET_MUTE, dispatchInts, responseVoid},
-    {RIL_REQUEST_GET_MUTE, dispatchVoid, responseInts},
-    {RIL_REQUEST_QUERY_CLIP, dispatchVoid, responseInts},
-    {RIL_REQUEST_LAST_DATA_CALL_FAIL_CAUSE, dispatchVoid, responseInts},
-    {RIL_REQUEST_DATA_CALL_LIST, dispatchVoid, responseDataCallList},
-    {RIL_REQUEST_RESET_RADIO, dispatchVoid, responseVoid},
-    {RIL_REQUEST_OEM_HOOK_RAW, dispatchRaw, responseRaw},
-    {RIL_REQUEST_OEM_HOOK_STRINGS, dispatchStrings, responseStrings},
-    {RIL_REQUEST_SCREEN_STATE, dispatchInts, responseVoid},
-    {RIL_REQUEST_SET_SUPP_SVC_NOTIFICATION, dispatchInts, responseVoid},
-    {RIL_REQUEST_WRITE_SMS_TO_SIM, dispatchSmsWrite, responseInts},
-    {RIL_REQUEST_DELETE_SMS_ON_SIM, dispatchInts, responseVoid},
-    {RIL_REQUEST_SET_BAND_MODE, dispatchInts, responseVoid},
-    {RIL_REQUEST_QUERY_AVAILABLE_BAND_MODE, dispatchVoid, responseInts},
-    {RIL_REQUEST_STK_GET_PROFILE, dispatchVoid, responseString},
-    {RIL_REQUEST_STK_SET_PROFILE, dispatchString, responseVoid},
-    {RIL_REQUEST_STK_SEND_ENVELOPE_COMMAND, dispatchString, responseString},
-    {RIL_REQUEST_STK_SEND_TERMINAL_RESPONSE, dispatchString, responseVoid},
-    {RIL_REQUEST_STK_HANDLE_CALL_SETUP_REQUESTED_FROM_SIM, dispatchInts, responseVoid},
-    {RIL_REQUEST_EXPLICIT_CALL_TRANSFER, dispatchVoid, responseVoid},
-    {RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE, dispatchInts, responseVoid},
-    {RIL_REQUEST_GET_PREFERRED_NETWORK_TYPE, dispatchVoid, responseInts},
-    {RIL_REQUEST_GET_NEIGHBORING_CELL_IDS, dispatchVoid, responseCellList},
-    {RIL_REQUEST_SET_LOCATION_UPDATES, dispatchInts, responseVoid},
-    {RIL_REQUEST_CDMA_SET_SUBSCRIPTION_SOURCE, dispatchInts, responseVoid},
-    {RIL_REQUEST_CDMA_SET_ROAMING_PREFERENCE, dispatchInts, responseVoid},
-    {RIL_REQUEST_CDMA_QUERY_ROAMING_PREFERENCE, dispatchVoid, responseInts},
-    {RIL_REQUEST_SET_TTY_MODE, dispatchInts, responseVoid},
-    {RIL_REQUEST_QUERY_TTY_MODE, dispatchVoid, responseInts},
-    {RIL_REQUEST_CDMA_SET_PREFERRED_VOICE_PRIVACY_MODE, dispatchInts, responseVoid},
-    {RIL_REQUEST_CDMA_QUERY_PREFERRED_VOICE_PRIVACY_MODE, dispatchVoid, responseInts},
-    {RIL_REQUEST_CDMA_FLASH, dispatchString, responseVoid},
-    {RIL_REQUEST_CDMA_BURST_DTMF, dispatchStrings, responseVoid},
-    {RIL_REQUEST_CDMA_VALIDATE_AND_WRITE_AKEY, dispatchString, responseVoid},
-    {RIL_REQUEST_CDMA_SEND_SMS, dispatchCdmaSms, responseSMS},
-    {RIL_REQUEST_CDMA_SMS_ACKNOWLEDGE, dispatchCdmaSmsAck, responseVoid},
-    {RIL_REQUEST_GSM_GET_BROADCAST_SMS_CONFIG, dispatchVoid, responseGsmBrSmsCnf},
-    {RIL_REQUEST_GSM_SET_BROADCAST_SMS_CONFIG, dispatchGsmBrSmsCnf, responseVoid},
-    {RIL_REQUEST_GSM_SMS_BROADCAST_ACTIVATION, dispatchInts, responseVoid},
-    {RIL_REQUEST_CDMA_GET_BROADCAST_SMS_CONFIG, dispatchVoid, responseCdmaBrSmsCnf},
-    {RIL_REQUEST_CDMA_SET_BROADCAST_SMS_CONFIG, dispatchCdmaBrSmsCnf, responseVoid},
-    {RIL_REQUEST_CDMA_SMS_BROADCAST_ACTIVATION, dispatchInts, responseVoid},
-    {RIL_REQUEST_CDMA_SUBSCRIPTION, dispatchVoid, responseStrings},
-    {RIL_REQUEST_CDMA_WRITE_SMS_TO_RUIM, dispatchRilCdmaSmsWriteArgs, responseInts},
-    {RIL_REQUEST_CDMA_DELETE_SMS_ON_RUIM, dispatchInts, responseVoid},
-    {RIL_REQUEST_DEVICE_IDENTITY, dispatchVoid, responseStrings},
-    {RIL_REQUEST_EXIT_EMERGENCY_CALLBACK_MODE, dispatchVoid, responseVoid},
-    {RIL_REQUEST_GET_SMSC_ADDRESS, dispatchVoid, responseString},
-    {RIL_REQUEST_SET_SMSC_ADDRESS, dispatchString, responseVoid},
-    {RIL_REQUEST_REPORT_SMS_MEMORY_STATUS, dispatchInts, responseVoid},
-    {RIL_REQUEST_REPORT_STK_SERVICE_IS_RUNNING, dispatchVoid, responseVoid},
-    {RIL_REQUEST_CDMA_GET_SUBSCRIPTION_SOURCE, dispatchCdmaSubscriptionSource, responseInts},
-    {RIL_REQUEST_ISIM_AUTHENTICATION, dispatchString, responseString},
-    {RIL_REQUEST_ACKNOWLEDGE_INCOMING_GSM_SMS_WITH_PDU, dispatchStrings, responseVoid},
-    {RIL_REQUEST_STK_SEND_ENVELOPE_WITH_STATUS, dispatchString, responseSIM_IO},
-    {RIL_REQUEST_VOICE_RADIO_TECH, dispatchVoiceRadioTech, responseInts},
+    REQUEST(DTMF_START, dispatchString, responseVoid, CRITICAL),
+    REQUEST(DTMF_STOP, dispatchVoid, responseVoid, CRITICAL),
+    REQUEST(BASEBAND_VERSION, dispatchVoid, responseString, NORMAL),
+    REQUEST(SEPARATE_CONNECTION, dispatchInts, responseVoid, NORMAL),
+    REQUEST(SET_MUTE, dispatchInts, responseVoid, CRITICAL),
+    REQUEST(GET_MUTE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(QUERY_CLIP, dispatchVoid, responseInts, NORMAL),
+    REQUEST(LAST_DATA_CALL_FAIL_CAUSE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(DATA_CALL_LIST, dispatchVoid, responseDataCallList, NORMAL),
+    REQUEST(RESET_RADIO, dispatchVoid, responseVoid, NORMAL),
+    REQUEST(OEM_HOOK_RAW, dispatchRaw, responseRaw, NORMAL),
+    REQUEST(OEM_HOOK_STRINGS, dispatchStrings, responseStrings, NORMAL),
+    REQUEST(SCREEN_STATE, dispatchInts, responseVoid, CRITICAL),
+    REQUEST(SET_SUPP_SVC_NOTIFICATION, dispatchInts, responseVoid, NORMAL),
+    REQUEST(WRITE_SMS_TO_SIM, dispatchSmsWrite, responseInts, NORMAL),
+    REQUEST(DELETE_SMS_ON_SIM, dispatchInts, responseVoid, NORMAL),
+    REQUEST(SET_BAND_MODE, dispatchInts, responseVoid, NORMAL),
+    REQUEST(QUERY_AVAILABLE_BAND_MODE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(STK_GET_PROFILE, dispatchVoid, responseString, NORMAL),
+    REQUEST(STK_SET_PROFILE, dispatchString, responseVoid, NORMAL),
+    REQUEST(STK_SEND_ENVELOPE_COMMAND, dispatchString, responseString, NORMAL),
+    REQUEST(STK_SEND_TERMINAL_RESPONSE, dispatchString, responseVoid, NORMAL),
+    REQUEST(STK_HANDLE_CALL_SETUP_REQUESTED_FROM_SIM, dispatchInts, responseVoid, NORMAL),
+    REQUEST(EXPLICIT_CALL_TRANSFER, dispatchVoid, responseVoid, NORMAL),
+    REQUEST(SET_PREFERRED_NETWORK_TYPE, dispatchInts, responseVoid, NORMAL),
+    REQUEST(GET_PREFERRED_NETWORK_TYPE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(GET_NEIGHBORING_CELL_IDS, dispatchVoid, responseCellList, NORMAL),
+    REQUEST(SET_LOCATION_UPDATES, dispatchInts, responseVoid, NORMAL),
+    REQUEST(CDMA_SET_SUBSCRIPTION_SOURCE, dispatchInts, responseVoid, NORMAL),
+    REQUEST(CDMA_SET_ROAMING_PREFERENCE, dispatchInts, responseVoid, NORMAL),
+    REQUEST(CDMA_QUERY_ROAMING_PREFERENCE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(SET_TTY_MODE, dispatchInts, responseVoid, NORMAL),
+    REQUEST(QUERY_TTY_MODE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(CDMA_SET_PREFERRED_VOICE_PRIVACY_MODE, dispatchInts, responseVoid, NORMAL),
+    REQUEST(CDMA_QUERY_PREFERRED_VOICE_PRIVACY_MODE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(CDMA_FLASH, dispatchString, responseVoid, NORMAL),
+    REQUEST(CDMA_BURST_DTMF, dispatchStrings, responseVoid, NORMAL),
+    REQUEST(CDMA_VALIDATE_AND_WRITE_AKEY, dispatchString, responseVoid, NORMAL),
+    REQUEST(CDMA_SEND_SMS, dispatchCdmaSms, responseSMS, NORMAL),
+    REQUEST(CDMA_SMS_ACKNOWLEDGE, dispatchCdmaSmsAck, responseVoid, NORMAL),
+    REQUEST(GSM_GET_BROADCAST_SMS_CONFIG, dispatchVoid, responseGsmBrSmsCnf, NORMAL),
+    REQUEST(GSM_SET_BROADCAST_SMS_CONFIG, dispatchGsmBrSmsCnf, responseVoid, NORMAL),
+    REQUEST(GSM_SMS_BROADCAST_ACTIVATION, dispatchInts, responseVoid, NORMAL),
+    REQUEST(CDMA_GET_BROADCAST_SMS_CONFIG, dispatchVoid, responseCdmaBrSmsCnf, NORMAL),
+    REQUEST(CDMA_SET_BROADCAST_SMS_CONFIG, dispatchCdmaBrSmsCnf, responseVoid, NORMAL),
+    REQUEST(CDMA_SMS_BROADCAST_ACTIVATION, dispatchInts, responseVoid, NORMAL),
+    REQUEST(CDMA_SUBSCRIPTION, dispatchVoid, responseStrings, NORMAL),
+    REQUEST(CDMA_WRITE_SMS_TO_RUIM, dispatchRilCdmaSmsWriteArgs, responseInts, NORMAL),
+    REQUEST(CDMA_DELETE_SMS_ON_RUIM, dispatchInts, responseVoid, NORMAL),
+    REQUEST(DEVICE_IDENTITY, dispatchVoid, responseStrings, NORMAL),
+    REQUEST(EXIT_EMERGENCY_CALLBACK_MODE, dispatchVoid, responseVoid, NORMAL),
+    REQUEST(GET_SMSC_ADDRESS, dispatchVoid, responseString, NORMAL),
+    REQUEST(SET_SMSC_ADDRESS, dispatchString, responseVoid, NORMAL),
+    REQUEST(REPORT_SMS_MEMORY_STATUS, dispatchInts, responseVoid, NORMAL),
+    REQUEST(REPORT_STK_SERVICE_IS_RUNNING, dispatchVoid, responseVoid, NORMAL),
+    REQUEST(CDMA_GET_SUBSCRIPTION_SOURCE, dispatchCdmaSubscriptionSource, responseInts, NORMAL),
+    REQUEST(ISIM_AUTHENTICATION, dispatchString, responseString, NORMAL),
+    REQUEST(ACKNOWLEDGE_INCOMING_GSM_SMS_WITH_PDU, dispatchStrings, responseVoid, NORMAL),
+    REQUEST(STK_SEND_ENVELOPE_WITH_STATUS, dispatchString, responseSIM_IO, NORMAL),
+    REQUEST(VOICE_RADIO_TECH, dispatchVoiceRadioTech, responseInts, NORMAL),
 #ifndef RIL_NO_CELL_INFO_LIST
-    {RIL_REQUEST_GET_CELL_INFO_LIST, dispatchVoid, responseCellInfoList},
-    {RIL_REQUEST_SET_UNSOL_CELL_INFO_LIST_RATE, dispatchInts, responseVoid},
+    REQUEST(GET_CELL_INFO_LIST, dispatchVoid, responseCellInfoList, NORMAL),
+    REQUEST(SET_UNSOL_CELL_INFO_LIST_RATE, dispatchInts, responseVoid, NORMAL),
+#else
+    REQUEST(GET_CELL_INFO_LIST, NULL, NULL, NORMAL),
+    REQUEST(SET_UNSOL_CELL_INFO_LIST_RATE, NULL, NULL, NORMAL),
 #endif
-    {RIL_REQUEST_SET_INITIAL_ATTACH_APN, dispatchSetInitialAttachApn, responseVoid},
-    {RIL_REQUEST_IMS_REGISTRATION_STATE, dispatchVoid, responseInts},
-    {RIL_REQUEST_IMS_SEND_SMS, dispatchImsSms, responseSMS},
-    {RIL_REQUEST_GET_DATA_CALL_PROFILE, dispatchInts, responseGetDataCallProfile},
-    {RIL_REQUEST_SET_UICC_SUBSCRIPTION, dispatchUiccSubscripton, responseVoid},
-    {RIL_REQUEST_SET_DATA_SUBSCRIPTION, dispatchVoid, responseVoid},
-    {RIL_REQUEST_SIM_TRANSMIT_BASIC, dispatchSIM_IO, responseSIM_IO},
-    {RIL_REQUEST_SIM_OPEN_CHANNEL, dispatchString, responseInts},
-    {RIL_REQUEST_SIM_CLOSE_CHANNEL, dispatchInts, responseVoid},
-    {RIL_REQUEST_SIM_TRANSMIT_CHANNEL, dispatchSIM_IO, responseSIM_IO},
+    REQUEST(SET_INITIAL_ATTACH_APN, dispatchSetInitialAttachApn, responseVoid, NORMAL),
+    REQUEST(IMS_REGISTRATION_STATE, dispatchVoid, responseInts, NORMAL),
+    REQUEST(IMS_SEND_SMS, dispatchImsSms, responseSMS, NORMAL),
+    REQUEST(GET_DATA_CALL_PROFILE, dispatchInts, responseGetDataCallProfile, NORMAL),
+    REQUEST(SET_UICC_SUBSCRIPTION, dispatchUiccSubscripton, responseVoid, NORMAL),
+    REQUEST(SET_DATA_SUBSCRIPTION, dispatchVoid, responseVoid, NORMAL),
+    REQUEST(SIM_TRANSMIT_BASIC, dispatchSIM_IO, responseSIM_IO, NORMAL),
+    REQUEST(SIM_OPEN_CHANNEL, dispatchString, responseInts, NORMAL),
+    REQUEST(SIM_CLOSE_CHANNEL, dispatchInts, responseVoid, NORMAL),
+    REQUEST(SIM_TRANSMIT_CHANNEL, dispatchSIM_IO, responseSIM_IO, NORMAL),
 #ifndef RIL_VARIANT_LEGACY
-    {RIL_REQUEST_SIM_GET_ATR, dispatchInts, responseString},
+    REQUEST(SIM_GET_ATR, dispatchInts, responseString, NORMAL),
 #endif
\ No newline at end of file
@@ -73,6 +73,23 @@ static struct ril_event * watch_table[MAX_FD_EVENTS];
 static struct ril_event timer_list;
 static struct ril_event pending_list;
 
+// Loop statistics, written by the loop thread only
+static unsigned int loopIterations = 0;
+static long long callbackUsecs = 0;
+
+// Callback profiler, off unless slowThresholdUs >= 0
+#define MAX_PROFILED_FUNCS 16
+#define MAX_SLOW_RECORDS 8
+
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+static long long slowThresholdUs = -1;
+static struct ril_event_profile profiles[MAX_PROFILED_FUNCS];
+static ril_event_identify_cb identifiers[MAX_PROFILED_FUNCS];
+static int numProfiles = 0;
+static struct ril_event_slow slowRecords[MAX_SLOW_RECORDS];
+static int numSlowRecords = 0;
+static int nextSlowRecord = 0;
+
 #define DEBUG 0
 
 #if DEBUG
@@ -173,6 +190,7 @@ static void processTimeouts()
         // Timer expired
         dlog("~~~~ firing timer ~~~~");
         next = tev->next;
+        tev->ready = tev->timeout;
         removeFromList(tev);
         addToList(tev, &pending_list);
         tev = next;
@@ -183,12 +201,18 @@ static void processTimeouts()
 
 static void processReadReadies(fd_set * rfds, int n)
 {
+    struct timeval now = {0, 0};
+
     dlog("~~~~ +processReadReadies (%d) ~~~~", n);
+    if (slowThresholdUs >= 0) {
+        getNow(&now);
+    }
     MUTEX_ACQUIRE();
 
     for (int i = 0; (i < MAX_FD_EVENTS) && (n > 0); i++) {
         struct ril_event * rev = watch_table[i];
         if (rev != NULL && FD_ISSET(rev->fd, rfds)) {
+            rev->ready = now;
             addToList(rev, &pending_list);
             if (rev->persist == false) {
                 removeWatch(rev, i);
@@ -201,14 +225,89 @@ static void processReadReadies(fd_set * rfds, int n)
     dlog("~~~~ -processReadReadies (%d) ~~~~", n);
 }
 
+static long long usecsBetween(const struct timeval * from, const struct timeval * to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000LL + (to->tv_usec - from->tv_usec);
+}
+
+// Must be called with profileMutex held
+static int findProfile(ril_event_cb func, bool create)
+{
+    for (int i = 0; i < numProfiles; i++) {
+        if (profiles[i].func == func) return i;
+    }
+    if (!create || numProfiles >= MAX_PROFILED_FUNCS) return -1;
+    memset(&profiles[numProfiles], 0, sizeof(profiles[numProfiles]));
+    profiles[numProfiles].func = func;
+    identifiers[numProfiles] = NULL;
+    return numProfiles++;
+}
+
+// Fires one event and accounts its duration and the delay since it
+// became ready. The event may be freed by its callback, so everything
+// recorded is captured up front.
+static void fireProfiled(struct ril_event * ev)
+{
+    struct timeval start, end;
+    ril_event_cb func = ev->func;
+    struct timeval ready = ev->ready;
+    int fd = ev->fd;
+    void *identity = ev->param;
+    int i;
+
+    pthread_mutex_lock(&profileMutex);
+    i = findProfile(func, true);
+    if (i >= 0 && identifiers[i] != NULL) {
+        identity = identifiers[i](ev->param);
+    }
+    pthread_mutex_unlock(&profileMutex);
+
+    getNow(&start);
+    ev->func(ev->fd, 0, ev->param);
+    getNow(&end);
+
+    long long duration = usecsBetween(&start, &end);
+    long long delay = usecsBetween(&ready, &start);
+    if (delay < 0) delay = 0;
+
+    pthread_mutex_lock(&profileMutex);
+    if (i >= 0) {
+        struct ril_event_profile * prof = &profiles[i];
+        prof->calls++;
+        prof->totalUs += duration;
+        prof->totalDelayUs += delay;
+        if (duration > prof->maxUs) prof->maxUs = duration;
+        if (delay > prof->maxDelayUs) prof->maxDelayUs = delay;
+        if (duration >= slowThresholdUs) prof->slow++;
+    }
+    if (duration >= slowThresholdUs) {
+        struct ril_event_slow * rec = &slowRecords[nextSlowRecord];
+        rec->func = func;
+        rec->name = (i >= 0) ? profiles[i].name : NULL;
+        rec->fd = fd;
+        rec->identity = identity;
+        rec->durationUs = duration;
+        rec->delayUs = delay;
+        rec->when = start;
+        nextSlowRecord = (nextSlowRecord + 1) % MAX_SLOW_RECORDS;
+        if (numSlowRecords < MAX_SLOW_RECORDS) numSlowRecords++;
+    }
+    pthread_mutex_unlock(&profileMutex);
+}
+
 static void firePending()
 {
     dlog("~~~~ +firePending ~~~~");
+    bool profiling = slowThresholdUs >= 0;
     struct ril_event * ev = pending_list.next;
     while (ev != &pending_list) {
         struct ril_event * next = ev->next;
         removeFromList(ev);
-        ev->func(ev->fd, 0, ev->param);
+        if (profiling) {
+            fireProfiled(ev);
+        } else {
+            ev->func(ev->fd, 0, ev->param);
+        }
         ev = next;
     }
     dlog("~~~~ -firePending ~~~~");
@@ -330,6 +429,86 @@ void ril_event_del(struct ril_event * ev)
     dlog("~~~~ -ril_event_del ~~~~");
 }
 
+static int countList(struct ril_event * list)
+{
+    int n = 0;
+    for (struct ril_event * ev = list->next; ev != list; ev = ev->next) {
+        n++;
+    }
+    return n;
+}
+
+// Get number of watched fds, armed timers and events waiting to fire
+void ril_event_get_counts(int *watches, int *timers, int *pending)
+{
+    MUTEX_ACQUIRE();
+    if (watches != NULL) {
+        *watches = 0;
+        for (int i = 0; i < MAX_FD_EVENTS; i++) {
+            if (watch_table[i] != NULL) (*watches)++;
+        }
+    }
+    if (timers != NULL) {
+        *timers = countList(&timer_list);
+    }
+    if (pending != NULL) {
+        *pending = countList(&pending_list);
+    }
+    MUTEX_RELEASE();
+}
+
+// Get loop iterations and the total time spent in callbacks
+void ril_event_get_loop_stats(unsigned int *iterations, long long *callbackUs)
+{
+    *iterations = __sync_fetch_and_add(&loopIterations, 0);
+    *callbackUs = __sync_fetch_and_add(&callbackUsecs, 0);
+}
+
+void ril_event_set_profiling(long long slowUs)
+{
+    pthread_mutex_lock(&profileMutex);
+    slowThresholdUs = slowUs;
+    pthread_mutex_unlock(&profileMutex);
+}
+
+void ril_event_profile_name(ril_event_cb func, const char *name,
+        ril_event_identify_cb identify)
+{
+    pthread_mutex_lock(&profileMutex);
+    int i = findProfile(func, true);
+    if (i >= 0) {
+        profiles[i].name = name;
+        identifiers[i] = identify;
+    }
+    pthread_mutex_unlock(&profileMutex);
+}
+
+int ril_event_get_profile(struct ril_event_profile *out, int max)
+{
+    int n;
+
+    pthread_mutex_lock(&profileMutex);
+    for (n = 0; n < numProfiles && n < max; n++) {
+        out[n] = profiles[n];
+    }
+    pthread_mutex_unlock(&profileMutex);
+    return n;
+}
+
+// Newest first
+int ril_event_get_slow(struct ril_event_slow *out, int max)
+{
+    int n;
+
+    pthread_mutex_lock(&profileMutex);
+    for (n = 0; n < numSlowRecords && n < max; n++) {
+        int i = (nextSlowRecord - 1 - n + MAX_SLOW_RECORDS) % MAX_SLOW_RECORDS;
+        out[n] = slowRecords[i];
+    }
+    pthread_mutex_unlock(&profileMutex);
+    return n;
+}
+
 #if DEBUG
 static void printReadies(fd_set * rfds)
 {
@@ -376,11 +555,20 @@ void ril_event_loop()
             return;
         }
 
+        struct timeval start, end, spent;
+
         // Check for timeouts
         processTimeouts();
         // Check for read-ready
         processReadReadies(&rfds, n);
         // Fire away
+        getNow(&start);
         firePending();
+        getNow(&end);
+
+        timersub(&end, &start, &spent);
+        __sync_fetch_and_add(&loopIterations, 1);
+        __sync_fetch_and_add(&callbackUsecs,
+                spent.tv_sec * 1000000LL + spent.tv_usec);
     }
 }
@@ -30,6 +30,34 @@ struct ril_event {
     struct timeval timeout;
     ril_event_cb func;
     void *param;
+    struct timeval ready;   // when the event became ready, for the profiler
+};
+
+// Returns what identifies one invocation of a callback, e.g. the user
+// function behind a generic timer; evaluated before the callback runs
+typedef void * (*ril_event_identify_cb)(void *param);
+
+// Callback profile, one per callback function
+struct ril_event_profile {
+    ril_event_cb func;
+    const char *name;
+    unsigned int calls;
+    unsigned int slow;
+    long long totalUs;
+    long long maxUs;
+    long long totalDelayUs;     // readiness to invocation
+    long long maxDelayUs;
+};
+
+// One invocation that took longer than the slow threshold
+struct ril_event_slow {
+    ril_event_cb func;
+    const char *name;
+    int fd;
+    void *identity;
+    long long durationUs;
+    long long delayUs;
+    struct timeval when;
 };
 
 // Initialize internal data structs
@@ -50,3 +78,22 @@ void ril_event_del(struct ril_event * ev);
 // Event loop
 void ril_event_loop();
 
+// Get number of watched fds, armed timers and events waiting to fire
+void ril_event_get_counts(int *watches, int *timers, int *pending);
+
+// Get loop iterations and the total time spent in callbacks
+void ril_event_get_loop_stats(unsigned int *iterations, long long *callbackUs);
+
+// Enable the callback profiler, invocations taking slowUs or longer are
+// recorded individually. A negative threshold disables it.
+void ril_event_set_profiling(long long slowUs);
+
+// Name a callback function in the profile; identify may be NULL
+void ril_event_profile_name(ril_event_cb func, const char *name,
+        ril_event_identify_cb identify);
+
+// Copy out up to max callback profiles / recent slow invocations,
+// returns the number copied
+int ril_event_get_profile(struct ril_event_profile *out, int max);
+int ril_event_get_slow(struct ril_event_slow *out, int max);
+
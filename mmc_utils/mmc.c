@@ -56,8 +56,11 @@ static struct Command commands[] = {
 	  NULL
 	},
 	{ do_read_extcsd, -1,
-	  "extcsd read", "<device>\n"
-		"Print extcsd data from <device>.",
+	  "extcsd read", "[--fields|--json|--binary] <device>\n"
+		"Print extcsd data from <device>.\n"
+		"--fields prints one \"name: value\" line per field known for\n"
+		"the EXT_CSD revision of <device>, --json the same fields as a\n"
+		"JSON object and --binary the raw 512 byte register.",
 	  NULL
 	},
 	{ do_write_extcsd_byte, -3,
@@ -173,6 +176,18 @@ static struct Command commands[] = {
 		  "    mmc rpmb write-block /dev/mmcblk0rpmb 0x02 - -",
 	  NULL
 	},
+	{ do_rpmb_write_blocks, -1,
+	  "rpmb write-blocks", "<rpmb device> <address> <data file> <key file>\n"
+		  "Blocks of 256 bytes will be written from data file, whose size\n"
+		  "must be a multiple of 256, to consecutive addresses of\n"
+		  "<rpmb device>, as many per write as REL_WR_SEC_C allows.\n"
+		  "The write counter is checked once all blocks are written.\n"
+		  "Also you can specify '-' instead of key file path or data file\n"
+		  "(but not both) to read it from stdin.\n"
+		  "Example:\n"
+		  "  $ mmc rpmb write-blocks /dev/mmcblk0rpmb 0x10 /tmp/blob /tmp/key",
+	  NULL
+	},
 	{ do_cache_en, -1,
 	  "cache enable", "<device>\n"
 		"Enable the eMMC cache feature on <device>.\n"
@@ -185,6 +200,89 @@ static struct Command commands[] = {
 		"NOTE! The cache is an optional feature on devices >= eMMC4.5.",
 	  NULL
 	},
+	{ do_health_monitor, -4,
+	  "health monitor", "<interval seconds> <wear threshold %> <output file> <device>\n"
+		"Sample the wear and BKOPS state of <device> every <interval\n"
+		"seconds> and append one record per sample to <output file>,\n"
+		"or stdout if '-' is given:\n"
+		"  s,<time>,<life A %>,<life B %>,<pre EOL>,<BKOPS status>,<CMD13>\n"
+		"Life time estimates give the upper bound of their 10% step.\n"
+		"Samples are put off while the block queue of <device> has\n"
+		"requests in flight. An event record\n"
+		"  e,<time>,<life_a|life_b|pre_eol>,<value>\n"
+		"is added, and also printed to stderr, when a life time estimate\n"
+		"reaches <wear threshold %> or pre EOL leaves the normal state.",
+	  NULL
+	},
+	{ do_bench, -7,
+	  "bench", "<-y|-n> <pattern> <block KiB> <queue depth> <total MiB> <fsync every> <device>\n"
+		"Measure O_DIRECT throughput and latency of <device>, a block\n"
+		"device or an image file. <pattern> is one of seqread, seqwrite,\n"
+		"randread or randwrite. <queue depth> threads keep that many\n"
+		"requests in flight. Writers fsync after every <fsync every>\n"
+		"requests, 0 for never. The report is tagged with the EXT_CSD\n"
+		"configuration of <device> when it has one.\n"
+		"Write patterns destroy data and only run when -y is passed.",
+	  NULL
+	},
+	{ do_align, -1,
+	  "align", "<device>\n"
+		"Check the partitions of the user area of <device> (GPT or\n"
+		"MBR) against its erase group, write protect group and native\n"
+		"sector size. Misaligned starts and sizes are flagged, and an\n"
+		"aligned layout is suggested. Nothing is written.",
+	  NULL
+	},
+	{ do_discard, -7,
+	  "discard", "<-y|-n> <discard|secdiscard> <batch MiB> <threads> <MiB/s> <extents|-> <device>\n"
+		"Discard the free extents listed in <extents> (or stdin), one\n"
+		"\"<offset> <length>\" pair in bytes per line, relative to the\n"
+		"partition <device>. Extents are merged, trimmed to whole erase\n"
+		"groups and issued as BLKDISCARD or BLKSECDISCARD batches of at\n"
+		"most <batch MiB> from <threads> threads, limited to <MiB/s>\n"
+		"(0 for no limit). -n only prints the plan, -y discards.\n"
+		"-y refuses a partition that is mounted or otherwise held open\n"
+		"exclusively; mounted filesystems must be trimmed with FITRIM\n"
+		"(fstrim) instead.",
+	  NULL
+	},
+	{ do_busy_report, -1,
+	  "busy report", "<log>\n"
+		"Print per operation histograms of the busy time recorded in\n"
+		"<log>. Every EXT_CSD write (SWITCH) polls CMD13 until the card\n"
+		"is back in the transfer state and appends a record to the file\n"
+		"named by the MMC_BUSY_LOG environment variable, if set.",
+	  NULL
+	},
+	{ do_bkops_daemon, -3,
+	  "bkops daemon", "<idle ms> <min level> <device>\n"
+		"Start BKOPS manually when <device> has been idle for <idle ms>\n"
+		"and BKOPS_STATUS is at least <min level> (1 non critical,\n"
+		"2 performance impacted, 3 critical). Below critical, BKOPS\n"
+		"only starts while the screen is off or external power is\n"
+		"present. Needs BKOPS_EN set, see \"bkops enable\".\n"
+		"BKOPS_START blocks until the card finishes and cannot be\n"
+		"interrupted; I/O issued meanwhile waits for it.",
+	  NULL
+	},
+	{ do_batch, -1,
+	  "batch", "<script file>\n"
+		"Run the commands of <script file>, or stdin if '-' is given,\n"
+		"one per line. Devices are opened and their EXT_CSD read once\n"
+		"for the whole script. Every command prints one line:\n"
+		"  ok <line> <command> <device> [name=value ...]\n"
+		"  error <line> <command> <device> <reason>\n"
+		"Commands:\n"
+		"  extcsd get <offset|field name> <device>\n"
+		"  extcsd refresh <device>\n"
+		"  status get <device>\n"
+		"  cache get <device>\n"
+		"  bkops get <device>\n"
+		"  writeprotect get <device>\n"
+		"  rpmb read-counter <rpmb device>\n"
+		"Empty lines and lines starting with '#' are skipped.",
+	  NULL
+	},
 	{ 0, 0, 0, 0 }
 };
 
@@ -14,6 +14,7 @@
  * Boston, MA 021110-1307, USA.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,15 +30,39 @@
 #include <errno.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/fs.h>
 
 #include "mmc.h"
 #include "mmc_cmds.h"
 #include "3rdparty/hmac_sha/hmac_sha2.h"
 
+/* EXT_CSD of the last device read, so the commands that need it
+ * several times only pay one CMD8. Dropped by every EXT_CSD write. */
+static struct {
+	int valid;
+	dev_t rdev;
+	__u8 data[512];
+} extcsd_cache;
+
+void extcsd_cache_invalidate(void)
+{
+	extcsd_cache.valid = 0;
+}
+
 int read_extcsd(int fd, __u8 *ext_csd)
 {
 	int ret = 0;
 	struct mmc_ioc_cmd idata;
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && extcsd_cache.valid &&
+	    extcsd_cache.rdev == st.st_rdev) {
+		memcpy(ext_csd, extcsd_cache.data, sizeof(extcsd_cache.data));
+		return 0;
+	}
+
 	memset(&idata, 0, sizeof(idata));
 	memset(ext_csd, 0, sizeof(__u8) * 512);
 	idata.write_flag = 0;
@@ -51,14 +76,139 @@ int read_extcsd(int fd, __u8 *ext_csd)
 	ret = ioctl(fd, MMC_IOC_CMD, &idata);
 	if (ret)
 		perror("ioctl");
+	else if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+		extcsd_cache.valid = 1;
+		extcsd_cache.rdev = st.st_rdev;
+		memcpy(extcsd_cache.data, ext_csd, sizeof(extcsd_cache.data));
+	}
+
+	return ret;
+}
+
+static unsigned long long now_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int send_status(int fd, __u32 *response)
+{
+	int ret = 0;
+	struct mmc_ioc_cmd idata;
+
+	memset(&idata, 0, sizeof(idata));
+	idata.opcode = MMC_SEND_STATUS;
+	idata.arg = (1 << 16);
+	idata.flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+	ret = ioctl(fd, MMC_IOC_CMD, &idata);
+	if (ret)
+	perror("ioctl");
+
+	*response = idata.response[0];
 
 	return ret;
 }
 
+/*
+ * Resolves a device path (by-name links included) and fills parent
+ * with the whole mmcblkN node of the card behind it, the only one
+ * that accepts MMC_IOC_CMD. Returns N, or -1 if it is not an mmcblk
+ * device.
+ */
+static int mmc_parent_device(const char *device, char *parent, size_t size)
+{
+	char resolved[PATH_MAX];
+	const char *name;
+	int idx;
+
+	if (!realpath(device, resolved))
+		return -1;
+	name = strrchr(resolved, '/');
+	name = name ? name + 1 : resolved;
+	if (sscanf(name, "mmcblk%d", &idx) != 1)
+		return -1;
+	if (parent && snprintf(parent, size, "%.*smmcblk%d",
+			       (int)(name - resolved), resolved, idx) >= (int)size)
+		return -1;
+
+	return idx;
+}
+
+#define BUSY_POLL_TIMEOUT	(600 * 1000000ULL)	/* sanitize can take minutes */
+
+static const char *busy_op_name(__u8 index)
+{
+	switch (index) {
+	case EXT_CSD_CACHE_CTRL:
+		return "cache_ctrl";
+	case EXT_CSD_FLUSH_CACHE:
+		return "cache_flush";
+	case EXT_CSD_BKOPS_START:
+		return "bkops_start";
+	case EXT_CSD_SANITIZE_START:
+		return "sanitize";
+	default:
+		return "switch";
+	}
+}
+
+/*
+ * With MMC_BUSY_LOG set, waits for the card to leave the busy (prg)
+ * state after a SWITCH and appends how long that took:
+ * "<op> <index> <value> <ioctl usecs> <busy usecs> <polls> <status>"
+ */
+static void busy_profile(int fd, __u8 index, __u8 value,
+			 unsigned long long start, int ret)
+{
+	const char *path = getenv("MMC_BUSY_LOG");
+	unsigned long long done, now, delay = 100;
+	unsigned int polls = 0;
+	__u32 status = 0;
+	FILE *log;
+
+	if (!path || !*path)
+		return;
+
+	done = now_usecs();
+	now = done;
+	while (!ret) {
+		polls++;
+		if (send_status(fd, &status))
+			break;
+		now = now_usecs();
+		if ((status & R1_READY_FOR_DATA) &&
+		    R1_CURRENT_STATE(status) == R1_STATE_TRAN)
+			break;
+		if (now - done > BUSY_POLL_TIMEOUT) {
+			fprintf(stderr, "card still busy after %llu s\n",
+				BUSY_POLL_TIMEOUT / 1000000);
+			break;
+		}
+		usleep(delay);
+		if (delay < 10000)
+			delay *= 2;
+	}
+
+	log = fopen(path, "a");
+	if (!log) {
+		perror("MMC_BUSY_LOG");
+		return;
+	}
+	fprintf(log, "%s %u %u %llu %llu %u 0x%08x\n", busy_op_name(index),
+		index, value, done - start, now - done, polls, status);
+	fclose(log);
+}
+
 int write_extcsd_value(int fd, __u8 index, __u8 value)
 {
 	int ret = 0;
 	struct mmc_ioc_cmd idata;
+	unsigned long long start;
+
+	extcsd_cache_invalidate();
 
 	memset(&idata, 0, sizeof(idata));
 	idata.write_flag = 1;
@@ -69,10 +219,13 @@ int write_extcsd_value(int fd, __u8 index, __u8 value)
 			EXT_CSD_CMD_SET_NORMAL;
 	idata.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
 
+	start = now_usecs();
 	ret = ioctl(fd, MMC_IOC_CMD, &idata);
 	if (ret)
 		perror("ioctl");
 
+	busy_profile(fd, index, value, start, ret);
+
 	return ret;
 }
 
@@ -110,25 +263,6 @@ int do_write_extcsd_byte(int nargs, char **argv)
 	return 0;
 }
 
-int send_status(int fd, __u32 *response)
-{
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-
-	memset(&idata, 0, sizeof(idata));
-	idata.opcode = MMC_SEND_STATUS;
-	idata.arg = (1 << 16);
-	idata.flags = MMC_RSP_R1 | MMC_CMD_AC;
-
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-	perror("ioctl");
-
-	*response = idata.response[0];
-
-	return ret;
-}
-
 void print_writeprotect_status(__u8 *ext_csd)
 {
 	__u8 reg;
@@ -1023,6 +1157,205 @@ int do_write_reliability_set(int nargs, char **argv)
 	return 0;
 }
 
+/* Declarative EXT_CSD layout: one entry per field, with its offset,
+ * width in bytes (little endian), the EXT_CSD_REV range it exists in
+ * and how its value is decoded. Feeds the --fields/--json output of
+ * "extcsd read" and the field names of "batch".
+ */
+struct extcsd_field {
+	const char *name;
+	unsigned short offset;
+	unsigned char width;
+	unsigned char min_rev;
+	unsigned char max_rev;
+	/* writes the decoded value, returns 1 if it is a string */
+	int (*decode)(const struct extcsd_field *f, __u32 raw, char *buf, size_t len);
+	unsigned int scale;
+};
+
+#define EXT_CSD_REV_ANY		0xff
+
+static int extcsd_dec_hex(const struct extcsd_field *f, __u32 raw,
+			  char *buf, size_t len)
+{
+	snprintf(buf, len, "\"0x%0*x\"", f->width * 2, raw);
+	return 1;
+}
+
+static int extcsd_dec_uint(const struct extcsd_field *f, __u32 raw,
+			   char *buf, size_t len)
+{
+	snprintf(buf, len, "%u", raw * (f->scale ? f->scale : 1));
+	return 0;
+}
+
+static int extcsd_dec_rev(const struct extcsd_field *f, __u32 raw,
+			  char *buf, size_t len)
+{
+	static const char * const revs[] = {
+		"4.0", "4.1", "4.2", "4.3", NULL, "4.41", "4.5", "5.0", "5.1"
+	};
+
+	if (raw < sizeof(revs) / sizeof(revs[0]) && revs[raw])
+		snprintf(buf, len, "\"%s\"", revs[raw]);
+	else
+		snprintf(buf, len, "\"unknown (%u)\"", raw);
+	return 1;
+}
+
+/* DEVICE_LIFE_TIME_EST_TYP_A/B: used life in 10% steps */
+static int extcsd_dec_life(const struct extcsd_field *f, __u32 raw,
+			   char *buf, size_t len)
+{
+	if (raw >= 0x01 && raw <= 0x0a)
+		snprintf(buf, len, "\"%u%%-%u%%\"", (raw - 1) * 10, raw * 10);
+	else if (raw == 0x0b)
+		snprintf(buf, len, "\"exceeded\"");
+	else
+		snprintf(buf, len, "\"undefined\"");
+	return 1;
+}
+
+static int extcsd_dec_pre_eol(const struct extcsd_field *f, __u32 raw,
+			      char *buf, size_t len)
+{
+	static const char * const states[] = {
+		"undefined", "normal", "warning", "urgent"
+	};
+
+	snprintf(buf, len, "\"%s\"", raw < 4 ? states[raw] : "reserved");
+	return 1;
+}
+
+static const struct extcsd_field extcsd_fields[] = {
+	{ "ext_csd_rev", EXT_CSD_REV, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_rev, 0 },
+	{ "s_cmd_set", EXT_CSD_S_CMD_SET, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "hpi_features", EXT_CSD_HPI_FEATURE, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "bkops_support", EXT_CSD_BKOPS_SUPPORT, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "device_life_time_est_typ_b", EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_B, 1, EXT_CSD_REV_V5_0, EXT_CSD_REV_ANY, extcsd_dec_life, 0 },
+	{ "device_life_time_est_typ_a", EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_A, 1, EXT_CSD_REV_V5_0, EXT_CSD_REV_ANY, extcsd_dec_life, 0 },
+	{ "pre_eol_info", EXT_CSD_PRE_EOL_INFO, 1, EXT_CSD_REV_V5_0, EXT_CSD_REV_ANY, extcsd_dec_pre_eol, 0 },
+	{ "cache_size_kib", EXT_CSD_CACHE_SIZE_0, 4, EXT_CSD_REV_V4_5, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "bkops_status", EXT_CSD_BKOPS_STATUS, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "boot_info", EXT_CSD_BOOT_INFO, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "boot_size_kib", EXT_CSD_BOOT_MULT, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_uint, 128 },
+	{ "hc_erase_grp_size_kib", EXT_CSD_HC_ERASE_GRP_SIZE, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_uint, 512 },
+	{ "rel_wr_sec_c", EXT_CSD_REL_WR_SEC_C, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "hc_wp_grp_size", EXT_CSD_HC_WP_GRP_SIZE, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "sec_count", EXT_CSD_SEC_COUNT_0, 4, 0, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "partition_switch_time", EXT_CSD_PART_SWITCH_TIME, 1, EXT_CSD_REV_V4_3, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "card_type", EXT_CSD_CARD_TYPE, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "partition_config", EXT_CSD_PART_CONFIG, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "boot_bus_conditions", EXT_CSD_BOOT_BUS_CONDITIONS, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "erase_group_def", EXT_CSD_ERASE_GROUP_DEF, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "boot_wp", EXT_CSD_BOOT_WP, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "user_wp", EXT_CSD_USER_WP, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "rpmb_size_kib", EXT_CSD_RPMB_MULT, 1, 0, EXT_CSD_REV_ANY, extcsd_dec_uint, 128 },
+	{ "wr_rel_set", EXT_CSD_WR_REL_SET, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "wr_rel_param", EXT_CSD_WR_REL_PARAM, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "bkops_en", EXT_CSD_BKOPS_EN, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "rst_n_function", EXT_CSD_RST_N_FUNCTION, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "partitioning_support", EXT_CSD_PARTITIONING_SUPPORT, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "max_enh_size_mult", EXT_CSD_MAX_ENH_SIZE_MULT_0, 3, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "partitions_attribute", EXT_CSD_PARTITIONS_ATTRIBUTE, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "partition_setting_completed", EXT_CSD_PARTITION_SETTING_COMPLETED, 1, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "gp_size_mult_4", EXT_CSD_GP_SIZE_MULT_4_0, 3, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "gp_size_mult_3", EXT_CSD_GP_SIZE_MULT_3_0, 3, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "gp_size_mult_2", EXT_CSD_GP_SIZE_MULT_2_0, 3, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "gp_size_mult_1", EXT_CSD_GP_SIZE_MULT_1_0, 3, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "enh_size_mult", EXT_CSD_ENH_SIZE_MULT_0, 3, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "enh_start_addr", EXT_CSD_ENH_START_ADDR_0, 4, EXT_CSD_REV_V4_4_1, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "native_sector_size", EXT_CSD_NATIVE_SECTOR_SIZE, 1, EXT_CSD_REV_V4_5, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "use_native_sector", EXT_CSD_USE_NATIVE_SECTOR, 1, EXT_CSD_REV_V4_5, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "data_sector_size", EXT_CSD_DATA_SECTOR_SIZE, 1, EXT_CSD_REV_V4_5, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ "ext_partitions_attribute", EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_0, 2, EXT_CSD_REV_V4_5, EXT_CSD_REV_ANY, extcsd_dec_hex, 0 },
+	{ "cache_ctrl", EXT_CSD_CACHE_CTRL, 1, EXT_CSD_REV_V4_5, EXT_CSD_REV_ANY, extcsd_dec_uint, 0 },
+	{ NULL, 0, 0, 0, 0, NULL, 0 }
+};
+
+static const struct extcsd_field *extcsd_field_find(const char *name)
+{
+	const struct extcsd_field *f;
+
+	for (f = extcsd_fields; f->name; f++)
+		if (!strcmp(f->name, name))
+			return f;
+
+	return NULL;
+}
+
+static int extcsd_field_present(const struct extcsd_field *f, const __u8 *ext_csd)
+{
+	__u8 rev = ext_csd[EXT_CSD_REV];
+
+	return rev >= f->min_rev &&
+		(f->max_rev == EXT_CSD_REV_ANY || rev <= f->max_rev);
+}
+
+/* Decodes a field into buf, returns 1 if the value is a (quoted) string */
+static int extcsd_field_value(const struct extcsd_field *f, const __u8 *ext_csd,
+			      char *buf, size_t len)
+{
+	__u32 raw = 0;
+	int i;
+
+	for (i = f->width - 1; i >= 0; i--)
+		raw = (raw << 8) | ext_csd[f->offset + i];
+
+	return f->decode(f, raw, buf, len);
+}
+
+/* Prints s as a JSON string, with its quotes */
+static void print_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", (unsigned char)*s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* The single decode pass behind "extcsd read --fields|--json" */
+static void print_extcsd_fields(const char *device, const __u8 *ext_csd, int json)
+{
+	const struct extcsd_field *f;
+	char value[64];
+	int first = 1;
+
+	if (json) {
+		printf("{\n  \"device\": ");
+		print_json_string(device);
+		printf(",\n  \"fields\": {");
+	}
+
+	for (f = extcsd_fields; f->name; f++) {
+		int quoted;
+
+		if (!extcsd_field_present(f, ext_csd))
+			continue;
+
+		quoted = extcsd_field_value(f, ext_csd, value, sizeof(value));
+		if (json) {
+			printf("%s\n    \"%s\": %s", first ? "" : ",", f->name, value);
+		} else if (quoted) {
+			/* strip the JSON quotes */
+			value[strlen(value) - 1] = '\0';
+			printf("%s: %s\n", f->name, value + 1);
+		} else {
+			printf("%s: %s\n", f->name, value);
+		}
+		first = 0;
+	}
+
+	if (json)
+		printf("\n  }\n}\n");
+}
+
 int do_dump_extcsd(int nargs, char **argv)
 {
 	__u8 ext_csd[512];
@@ -1056,13 +1389,28 @@ int do_read_extcsd(int nargs, char **argv)
 	__u8 ext_csd[512], ext_csd_rev, reg;
 	__u32 regl;
 	int fd, ret;
+	int format = 0;
 	char *device;
 	const char *str;
 
-	CHECK(nargs != 2, "Usage: mmc extcsd read </path/to/mmcblkX>\n",
+	CHECK(nargs != 2 && nargs != 3,
+	      "Usage: mmc extcsd read [--fields|--json|--binary] </path/to/mmcblkX>\n",
 			  exit(1));
 
-	device = argv[1];
+	if (nargs == 3) {
+		if (!strcmp(argv[1], "--fields"))
+			format = 1;
+		else if (!strcmp(argv[1], "--json"))
+			format = 2;
+		else if (!strcmp(argv[1], "--binary"))
+			format = 3;
+		else {
+			fprintf(stderr, "Unknown format %s\n", argv[1]);
+			exit(1);
+		}
+	}
+
+	device = argv[nargs - 1];
 
 	fd = open(device, O_RDWR);
 	if (fd < 0) {
@@ -1076,6 +1424,16 @@ int do_read_extcsd(int nargs, char **argv)
 		exit(1);
 	}
 
+	switch (format) {
+	case 1:
+	case 2:
+		print_extcsd_fields(device, ext_csd, format == 2);
+		return 0;
+	case 3:
+		fwrite(ext_csd, sizeof(ext_csd), 1, stdout);
+		return 0;
+	}
+
 	ext_csd_rev = ext_csd[EXT_CSD_REV];
 
 	switch (ext_csd_rev) {
@@ -1561,6 +1919,55 @@ struct rpmb_frame {
 	u_int16_t req_resp;
 };
 
+/* MMC_IOC_MULTI_CMD support of the kernel: unknown until first tried */
+static int rpmb_multi_cmd = -1;
+
+/* Issues the commands of one RPMB transaction.
+ *
+ * Kernels that know MMC_IOC_MULTI_CMD get the whole sequence in one
+ * ioctl, so no other request can get between the commands and the host
+ * is held for the transaction. Older kernels fail it with ENOTTY or
+ * EINVAL, after which one MMC_IOC_CMD per command is used.
+ */
+static int rpmb_submit(int fd, struct mmc_ioc_cmd *cmds, unsigned int n)
+{
+	struct mmc_ioc_multi_cmd *multi;
+	unsigned int i;
+	int err;
+
+	if (rpmb_multi_cmd != 0) {
+		multi = calloc(1, sizeof(*multi) + n * sizeof(*cmds));
+		if (!multi)
+			return -ENOMEM;
+
+		multi->num_of_cmds = n;
+		memcpy(multi->cmds, cmds, n * sizeof(*cmds));
+
+		err = ioctl(fd, MMC_IOC_MULTI_CMD, multi);
+		if (err < 0)
+			err = -errno;
+		else
+			memcpy(cmds, multi->cmds, n * sizeof(*cmds));
+		free(multi);
+
+		if (err != -ENOTTY && err != -EINVAL) {
+			rpmb_multi_cmd = 1;
+			return err;
+		}
+		if (rpmb_multi_cmd == 1)
+			return err;
+		rpmb_multi_cmd = 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		err = ioctl(fd, MMC_IOC_CMD, &cmds[i]);
+		if (err < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
 /* Performs RPMB operation.
  *
  * @fd: RPMB device on which we should perform ioctl command
@@ -1569,6 +1976,9 @@ struct rpmb_frame {
  *             result and req_resp for output frame.
  * @out_cnt: count of outer frames. Used only for multiple blocks reading,
  *           in the other cases -EINVAL will be returned.
+ *
+ * An authenticated data write takes as many input frames as block_count
+ * of the first frame says, the other requests take one.
  */
 static int do_rpmb_op(int fd,
 					  const struct rpmb_frame *frame_in,
@@ -1577,20 +1987,24 @@ static int do_rpmb_op(int fd,
 {
 	int err;
 	u_int16_t rpmb_type;
-
-	struct mmc_ioc_cmd ioc = {
-		.arg        = 0x0,
-		.blksz      = 512,
-		.blocks     = 1,
-		.write_flag = 1,
-		.opcode     = MMC_WRITE_MULTIPLE_BLOCK,
-		.flags      = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC,
-		.data_ptr   = (uintptr_t)frame_in
-	};
+	struct mmc_ioc_cmd ioc[3];
+	unsigned int n;
 
 	if (!frame_in || !frame_out || !out_cnt)
 		return -EINVAL;
 
+	memset(ioc, 0, sizeof(ioc));
+	for (n = 0; n < 3; n++) {
+		ioc[n].blksz  = 512;
+		ioc[n].blocks = 1;
+		ioc[n].flags  = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	}
+
+	/* Request */
+	ioc[0].write_flag = 1;
+	ioc[0].opcode     = MMC_WRITE_MULTIPLE_BLOCK;
+	ioc[0].data_ptr   = (uintptr_t)frame_in;
+
 	rpmb_type = be16toh(frame_in->req_resp);
 
 	switch(rpmb_type) {
@@ -1602,33 +2016,23 @@ static int do_rpmb_op(int fd,
 		}
 
 		/* Write request */
-		ioc.write_flag |= (1<<31);
-		err = ioctl(fd, MMC_IOC_CMD, &ioc);
-		if (err < 0) {
-			err = -errno;
-			goto out;
-		}
+		ioc[0].write_flag |= (1<<31);
+		if (rpmb_type == MMC_RPMB_WRITE && be16toh(frame_in->block_count) > 1)
+			ioc[0].blocks = be16toh(frame_in->block_count);
 
 		/* Result request */
 		memset(frame_out, 0, sizeof(*frame_out));
 		frame_out->req_resp = htobe16(MMC_RPMB_READ_RESP);
-		ioc.write_flag = 1;
-		ioc.data_ptr = (uintptr_t)frame_out;
-		err = ioctl(fd, MMC_IOC_CMD, &ioc);
-		if (err < 0) {
-			err = -errno;
-			goto out;
-		}
+		ioc[1].write_flag = 1;
+		ioc[1].opcode     = MMC_WRITE_MULTIPLE_BLOCK;
+		ioc[1].data_ptr   = (uintptr_t)frame_out;
 
 		/* Get response */
-		ioc.write_flag = 0;
-		ioc.opcode = MMC_READ_MULTIPLE_BLOCK;
-		err = ioctl(fd, MMC_IOC_CMD, &ioc);
-		if (err < 0) {
-			err = -errno;
-			goto out;
-		}
+		ioc[2].write_flag = 0;
+		ioc[2].opcode     = MMC_READ_MULTIPLE_BLOCK;
+		ioc[2].data_ptr   = (uintptr_t)frame_out;
 
+		err = rpmb_submit(fd, ioc, 3);
 		break;
 	case MMC_RPMB_READ_CNT:
 		if (out_cnt != 1) {
@@ -1638,24 +2042,13 @@ static int do_rpmb_op(int fd,
 		/* fall through */
 
 	case MMC_RPMB_READ:
-		/* Request */
-		err = ioctl(fd, MMC_IOC_CMD, &ioc);
-		if (err < 0) {
-			err = -errno;
-			goto out;
-		}
-
 		/* Get response */
-		ioc.write_flag = 0;
-		ioc.opcode   = MMC_READ_MULTIPLE_BLOCK;
-		ioc.blocks   = out_cnt;
-		ioc.data_ptr = (uintptr_t)frame_out;
-		err = ioctl(fd, MMC_IOC_CMD, &ioc);
-		if (err < 0) {
-			err = -errno;
-			goto out;
-		}
+		ioc[1].write_flag = 0;
+		ioc[1].opcode     = MMC_READ_MULTIPLE_BLOCK;
+		ioc[1].blocks     = out_cnt;
+		ioc[1].data_ptr   = (uintptr_t)frame_out;
 
+		err = rpmb_submit(fd, ioc, 2);
 		break;
 	default:
 		err = -EINVAL;
@@ -2034,63 +2427,1919 @@ int do_rpmb_write_block(int nargs, char **argv)
 	return ret;
 }
 
-int do_cache_ctrl(int value, int nargs, char **argv)
+/* One reliable write worth of frames and the key to sign them with */
+struct rpmb_mac_job {
+	const unsigned char *key;
+	struct rpmb_frame *frames;
+	unsigned int cnt;
+};
+
+/* Signs a multi-block write: the MAC covers the data up to the end of
+ * every frame and goes into the last one. Runs in its own thread so
+ * the next write gets signed while the current one is at the device.
+ */
+static void *rpmb_mac_job(void *arg)
 {
-	__u8 ext_csd[512];
-	int fd, ret;
-	char *device;
+	struct rpmb_mac_job *job = arg;
+	hmac_sha256_ctx ctx;
+	unsigned int i;
+
+	hmac_sha256_init(&ctx, job->key, 32);
+	for (i = 0; i < job->cnt; i++)
+		hmac_sha256_update(&ctx, job->frames[i].data,
+				   sizeof(struct rpmb_frame) -
+					   offsetof(struct rpmb_frame, data));
+	hmac_sha256_final(&ctx, job->frames[job->cnt - 1].key_mac,
+			  sizeof(job->frames[job->cnt - 1].key_mac));
+
+	return NULL;
+}
 
-	CHECK(nargs != 2, "Usage: mmc cache enable </path/to/mmcblkX>\n",
-			  exit(1));
+int do_rpmb_write_blocks(int nargs, char **argv)
+{
+	int ret, dev_fd, key_fd, data_fd;
+	unsigned char key[32];
+	__u8 ext_csd[512];
+	uint16_t addr;
+	unsigned int cnt, end_cnt, blocks = 0, alloc = 0, chunk, writes, i, w;
+	struct rpmb_frame *frames = NULL, frame_out;
+	struct rpmb_mac_job *jobs;
+	pthread_t signer;
 
-	device = argv[1];
+	CHECK(nargs != 5, "Usage: mmc rpmb write-blocks </path/to/mmcblkXrpmb> <address> </path/to/input_file> </path/to/key>\n",
+			exit(1));
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
+	dev_fd = open(argv[1], O_RDWR);
+	if (dev_fd < 0) {
+		perror("device open");
 		exit(1);
 	}
 
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+	/* Get block address */
+	errno = 0;
+	addr = strtol(argv[2], NULL, 0);
+	if (errno) {
+		perror("incorrect address");
 		exit(1);
 	}
 
-	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5) {
-		fprintf(stderr,
-			"The CACHE option is only availabe on devices >= "
-			"MMC 4.5 %s\n", device);
+	/* The data is read to EOF, nothing would be left for the key */
+	if (0 == strcmp(argv[3], "-") && 0 == strcmp(argv[4], "-")) {
+		fprintf(stderr, "data and key can't both be read from stdin\n");
 		exit(1);
 	}
 
-	/* If the cache size is zero, this device does not have a cache */
-	if (!(ext_csd[EXT_CSD_CACHE_SIZE_3] ||
-			ext_csd[EXT_CSD_CACHE_SIZE_2] ||
-			ext_csd[EXT_CSD_CACHE_SIZE_1] ||
-			ext_csd[EXT_CSD_CACHE_SIZE_0])) {
-		fprintf(stderr,
-			"The CACHE option is not available on %s\n",
-			device);
-		exit(1);
-	}
-	ret = write_extcsd_value(fd, EXT_CSD_CACHE_CTRL, value);
-	if (ret) {
-		fprintf(stderr,
-			"Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			value, EXT_CSD_CACHE_CTRL, device);
-		exit(1);
+	/* Read the data, 256b per frame */
+	if (0 == strcmp(argv[3], "-"))
+		data_fd = STDIN_FILENO;
+	else {
+		data_fd = open(argv[3], O_RDONLY);
+		if (data_fd < 0) {
+			perror("can't open input file");
+			exit(1);
+		}
 	}
 
-	return ret;
-}
+	for (;;) {
+		if (blocks == alloc) {
+			alloc = alloc ? alloc * 2 : 16;
+			frames = realloc(frames, alloc * sizeof(*frames));
+			if (!frames) {
+				printf("can't allocate memory for RPMB frames\n");
+				exit(1);
+			}
+		}
 
-int do_cache_en(int nargs, char **argv)
-{
-	return do_cache_ctrl(1, nargs, argv);
-}
+		ret = DO_IO(read, data_fd, frames[blocks].data,
+			    sizeof(frames[blocks].data));
+		if (ret < 0) {
+			perror("read the data");
+			exit(1);
+		} else if (ret == 0) {
+			break;
+		} else if (ret != sizeof(frames[blocks].data)) {
+			printf("Data must be a multiple of %lu bytes, but the last block has %d, exit\n",
+				   (unsigned long)sizeof(frames[blocks].data),
+				   ret);
+			exit(1);
+		}
+		blocks++;
+	}
 
-int do_cache_dis(int nargs, char **argv)
-{
+	if (!blocks) {
+		printf("no data to write\n");
+		exit(1);
+	}
+
+	/* Read the auth key */
+	if (0 == strcmp(argv[4], "-"))
+		key_fd = STDIN_FILENO;
+	else {
+		key_fd = open(argv[4], O_RDONLY);
+		if (key_fd < 0) {
+			perror("can't open key file");
+			exit(1);
+		}
+	}
+
+	ret = DO_IO(read, key_fd, key, sizeof(key));
+	if (ret < 0) {
+		perror("read the key");
+		exit(1);
+	} else if (ret != sizeof(key)) {
+		printf("Auth key must be %lu bytes length, but we read only %d, exit\n",
+			   (unsigned long)sizeof(key),
+			   ret);
+		exit(1);
+	}
+
+	/* Frames per reliable write: REL_WR_SEC_C counts 512 byte
+	 * sectors, each frame carries 256 bytes of data */
+	chunk = 1;
+	if (read_extcsd(dev_fd, ext_csd) == 0 && ext_csd[EXT_CSD_REL_WR_SEC_C])
+		chunk = ext_csd[EXT_CSD_REL_WR_SEC_C] * 512 /
+			sizeof(frames[0].data);
+	writes = (blocks + chunk - 1) / chunk;
+
+	ret = rpmb_read_counter(dev_fd, &cnt);
+	/* Check RPMB response */
+	if (ret != 0) {
+		printf("RPMB read counter operation failed, retcode 0x%04x\n", ret);
+		exit(1);
+	}
+
+	/* Every successful write bumps the counter by one, so the counter
+	 * of each write is known before the first one is issued */
+	jobs = calloc(writes, sizeof(*jobs));
+	if (!jobs) {
+		printf("can't allocate memory for RPMB writes\n");
+		exit(1);
+	}
+	for (w = 0; w < writes; w++) {
+		jobs[w].key = key;
+		jobs[w].frames = &frames[w * chunk];
+		jobs[w].cnt = blocks - w * chunk < chunk ? blocks - w * chunk : chunk;
+
+		for (i = 0; i < jobs[w].cnt; i++) {
+			struct rpmb_frame *f = &jobs[w].frames[i];
+
+			memset(f->stuff, 0, sizeof(f->stuff));
+			memset(f->key_mac, 0, sizeof(f->key_mac));
+			memset(f->nonce, 0, sizeof(f->nonce));
+			f->write_counter = htobe32(cnt + w);
+			f->addr = htobe16(addr + w * chunk);
+			f->block_count = htobe16(jobs[w].cnt);
+			f->result = 0;
+			f->req_resp = htobe16(MMC_RPMB_WRITE);
+		}
+	}
+
+	rpmb_mac_job(&jobs[0]);
+
+	for (w = 0; w < writes; w++) {
+		int signing = 0;
+
+		if (w + 1 < writes) {
+			if (pthread_create(&signer, NULL, rpmb_mac_job, &jobs[w + 1]) == 0)
+				signing = 1;
+			else
+				rpmb_mac_job(&jobs[w + 1]);
+		}
+
+		/* Execute RPMB op */
+		ret = do_rpmb_op(dev_fd, jobs[w].frames, &frame_out, 1);
+
+		if (signing)
+			pthread_join(signer, NULL);
+
+		if (ret != 0) {
+			perror("RPMB ioctl failed");
+			exit(1);
+		}
+
+		/* Check RPMB response */
+		if (frame_out.result != 0) {
+			printf("RPMB operation failed at address 0x%04x, retcode 0x%04x\n",
+				   addr + w * chunk, be16toh(frame_out.result));
+			exit(1);
+		}
+	}
+
+	ret = rpmb_read_counter(dev_fd, &end_cnt);
+	if (ret != 0) {
+		printf("RPMB read counter operation failed, retcode 0x%04x\n", ret);
+		exit(1);
+	}
+	if (end_cnt != cnt + writes) {
+		printf("RPMB write counter is %u after %u writes from %u\n",
+			   end_cnt, writes, cnt);
+		exit(1);
+	}
+
+	printf("%u blocks written in %u writes of up to %u\n", blocks, writes, chunk);
+
+	free(jobs);
+	free(frames);
+	close(dev_fd);
+	if (data_fd != STDIN_FILENO)
+		close(data_fd);
+	if (key_fd != STDIN_FILENO)
+		close(key_fd);
+
+	return ret;
+}
+
+int do_cache_ctrl(int value, int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	int fd, ret;
+	char *device;
+
+	CHECK(nargs != 2, "Usage: mmc cache enable </path/to/mmcblkX>\n",
+			  exit(1));
+
+	device = argv[1];
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5) {
+		fprintf(stderr,
+			"The CACHE option is only availabe on devices >= "
+			"MMC 4.5 %s\n", device);
+		exit(1);
+	}
+
+	/* If the cache size is zero, this device does not have a cache */
+	if (!(ext_csd[EXT_CSD_CACHE_SIZE_3] ||
+			ext_csd[EXT_CSD_CACHE_SIZE_2] ||
+			ext_csd[EXT_CSD_CACHE_SIZE_1] ||
+			ext_csd[EXT_CSD_CACHE_SIZE_0])) {
+		fprintf(stderr,
+			"The CACHE option is not available on %s\n",
+			device);
+		exit(1);
+	}
+	ret = write_extcsd_value(fd, EXT_CSD_CACHE_CTRL, value);
+	if (ret) {
+		fprintf(stderr,
+			"Could not write 0x%02x to EXT_CSD[%d] in %s\n",
+			value, EXT_CSD_CACHE_CTRL, device);
+		exit(1);
+	}
+
+	return ret;
+}
+
+int do_cache_en(int nargs, char **argv)
+{
+	return do_cache_ctrl(1, nargs, argv);
+}
+
+int do_cache_dis(int nargs, char **argv)
+{
 	return do_cache_ctrl(0, nargs, argv);
 }
+
+#define BATCH_MAX_DEVICES	8
+#define BATCH_MAX_ARGS		8
+
+/* A device opened by a batch script, with its EXT_CSD snapshot */
+struct batch_dev {
+	char *path;
+	int fd;
+	int have_ext_csd;
+	__u8 ext_csd[512];
+};
+
+struct batch_ctx {
+	struct batch_dev devs[BATCH_MAX_DEVICES];
+	int ndevs;
+	char result[256];
+};
+
+typedef int (*BatchFunction)(struct batch_ctx *ctx, struct batch_dev *dev,
+			     int argc, char **argv);
+
+static struct batch_dev *batch_open(struct batch_ctx *ctx, const char *path)
+{
+	struct batch_dev *dev;
+	int i;
+
+	for (i = 0; i < ctx->ndevs; i++)
+		if (!strcmp(ctx->devs[i].path, path))
+			return &ctx->devs[i];
+
+	if (ctx->ndevs == BATCH_MAX_DEVICES) {
+		errno = EMFILE;
+		return NULL;
+	}
+
+	dev = &ctx->devs[ctx->ndevs];
+	dev->fd = open(path, O_RDWR);
+	if (dev->fd < 0)
+		return NULL;
+	dev->path = strdup(path);
+	dev->have_ext_csd = 0;
+	ctx->ndevs++;
+
+	return dev;
+}
+
+/* The EXT_CSD snapshot of a device, read on first use */
+static __u8 *batch_ext_csd(struct batch_dev *dev)
+{
+	if (!dev->have_ext_csd) {
+		if (read_extcsd(dev->fd, dev->ext_csd))
+			return NULL;
+		dev->have_ext_csd = 1;
+	}
+
+	return dev->ext_csd;
+}
+
+static int batch_extcsd_get(struct batch_ctx *ctx, struct batch_dev *dev,
+			    int argc, char **argv)
+{
+	const struct extcsd_field *field;
+	__u8 *ext_csd;
+	char *end;
+	long offset;
+
+	if (argc != 1) {
+		snprintf(ctx->result, sizeof(ctx->result), "usage: extcsd get <offset|field> <device>");
+		return -1;
+	}
+
+	ext_csd = batch_ext_csd(dev);
+	if (!ext_csd) {
+		snprintf(ctx->result, sizeof(ctx->result), "cannot read EXT_CSD");
+		return -1;
+	}
+
+	field = extcsd_field_find(argv[0]);
+	if (field) {
+		char value[64];
+
+		extcsd_field_value(field, ext_csd, value, sizeof(value));
+		snprintf(ctx->result, sizeof(ctx->result), "%s=%s", field->name, value);
+		return 0;
+	}
+
+	offset = strtol(argv[0], &end, 0);
+	if (*end || offset < 0 || offset >= 512) {
+		snprintf(ctx->result, sizeof(ctx->result), "invalid offset %s", argv[0]);
+		return -1;
+	}
+
+	snprintf(ctx->result, sizeof(ctx->result), "offset=%ld value=0x%02x",
+		 offset, ext_csd[offset]);
+	return 0;
+}
+
+static int batch_extcsd_refresh(struct batch_ctx *ctx, struct batch_dev *dev,
+				int argc, char **argv)
+{
+	extcsd_cache_invalidate();
+	dev->have_ext_csd = 0;
+	if (!batch_ext_csd(dev)) {
+		snprintf(ctx->result, sizeof(ctx->result), "cannot read EXT_CSD");
+		return -1;
+	}
+
+	snprintf(ctx->result, sizeof(ctx->result), "rev=%d",
+		 dev->ext_csd[EXT_CSD_REV]);
+	return 0;
+}
+
+static int batch_status_get(struct batch_ctx *ctx, struct batch_dev *dev,
+			    int argc, char **argv)
+{
+	__u32 response;
+
+	if (send_status(dev->fd, &response)) {
+		snprintf(ctx->result, sizeof(ctx->result), "CMD13 failed");
+		return -1;
+	}
+
+	snprintf(ctx->result, sizeof(ctx->result), "status=0x%08x", response);
+	return 0;
+}
+
+static int batch_cache_get(struct batch_ctx *ctx, struct batch_dev *dev,
+			   int argc, char **argv)
+{
+	__u8 *ext_csd = batch_ext_csd(dev);
+
+	if (!ext_csd) {
+		snprintf(ctx->result, sizeof(ctx->result), "cannot read EXT_CSD");
+		return -1;
+	}
+
+	snprintf(ctx->result, sizeof(ctx->result), "size_kib=%u enabled=%d",
+		 ext_csd[EXT_CSD_CACHE_SIZE_0] |
+		 (ext_csd[EXT_CSD_CACHE_SIZE_1] << 8) |
+		 (ext_csd[EXT_CSD_CACHE_SIZE_2] << 16) |
+		 (ext_csd[EXT_CSD_CACHE_SIZE_3] << 24),
+		 ext_csd[EXT_CSD_CACHE_CTRL] & 1);
+	return 0;
+}
+
+static int batch_bkops_get(struct batch_ctx *ctx, struct batch_dev *dev,
+			   int argc, char **argv)
+{
+	__u8 *ext_csd = batch_ext_csd(dev);
+
+	if (!ext_csd) {
+		snprintf(ctx->result, sizeof(ctx->result), "cannot read EXT_CSD");
+		return -1;
+	}
+
+	snprintf(ctx->result, sizeof(ctx->result), "supported=%d enabled=%d status=%d",
+		 ext_csd[EXT_CSD_BKOPS_SUPPORT] & 1,
+		 ext_csd[EXT_CSD_BKOPS_EN] & BKOPS_ENABLE,
+		 ext_csd[EXT_CSD_BKOPS_STATUS] & 0x3);
+	return 0;
+}
+
+static int batch_writeprotect_get(struct batch_ctx *ctx, struct batch_dev *dev,
+				  int argc, char **argv)
+{
+	__u8 *ext_csd = batch_ext_csd(dev);
+
+	if (!ext_csd) {
+		snprintf(ctx->result, sizeof(ctx->result), "cannot read EXT_CSD");
+		return -1;
+	}
+
+	snprintf(ctx->result, sizeof(ctx->result), "boot_wp=0x%02x user_wp=0x%02x",
+		 ext_csd[EXT_CSD_BOOT_WP], ext_csd[EXT_CSD_USER_WP]);
+	return 0;
+}
+
+static int batch_rpmb_read_counter(struct batch_ctx *ctx, struct batch_dev *dev,
+				   int argc, char **argv)
+{
+	struct rpmb_frame frame_in = {
+		.req_resp = htobe16(MMC_RPMB_READ_CNT)
+	}, frame_out;
+	int ret;
+
+	ret = do_rpmb_op(dev->fd, &frame_in, &frame_out, 1);
+	if (ret != 0) {
+		snprintf(ctx->result, sizeof(ctx->result), "RPMB ioctl failed: %s",
+			 strerror(-ret));
+		return -1;
+	}
+
+	if (frame_out.result != 0) {
+		snprintf(ctx->result, sizeof(ctx->result), "RPMB retcode 0x%04x",
+			 be16toh(frame_out.result));
+		return -1;
+	}
+
+	snprintf(ctx->result, sizeof(ctx->result), "counter=%u",
+		 be32toh(frame_out.write_counter));
+	return 0;
+}
+
+/* Batch commands; the device is the last word of every line */
+static struct {
+	const char *verb;
+	BatchFunction func;
+} batch_commands[] = {
+	{ "extcsd get", batch_extcsd_get },
+	{ "extcsd refresh", batch_extcsd_refresh },
+	{ "status get", batch_status_get },
+	{ "cache get", batch_cache_get },
+	{ "bkops get", batch_bkops_get },
+	{ "writeprotect get", batch_writeprotect_get },
+	{ "rpmb read-counter", batch_rpmb_read_counter },
+	{ NULL, NULL }
+};
+
+int do_batch(int nargs, char **argv)
+{
+	struct batch_ctx ctx;
+	char line[512], verb[64];
+	char *args[BATCH_MAX_ARGS];
+	FILE *script;
+	int lineno = 0, failed = 0, i;
+
+	CHECK(nargs != 2, "Usage: mmc batch </path/to/script|->\n", exit(1));
+
+	if (0 == strcmp(argv[1], "-"))
+		script = stdin;
+	else {
+		script = fopen(argv[1], "r");
+		if (!script) {
+			perror("can't open script");
+			exit(1);
+		}
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	while (fgets(line, sizeof(line), script)) {
+		struct batch_dev *dev;
+		char *tok, *save;
+		int argc = 0, c;
+
+		lineno++;
+
+		for (tok = strtok_r(line, " \t\r\n", &save);
+		     tok && argc < BATCH_MAX_ARGS;
+		     tok = strtok_r(NULL, " \t\r\n", &save))
+			args[argc++] = tok;
+
+		if (!argc || args[0][0] == '#')
+			continue;
+
+		if (argc < 3) {
+			printf("error %d %s - incomplete command\n", lineno, args[0]);
+			failed++;
+			continue;
+		}
+
+		snprintf(verb, sizeof(verb), "%s %s", args[0], args[1]);
+		for (c = 0; batch_commands[c].verb; c++)
+			if (!strcmp(batch_commands[c].verb, verb))
+				break;
+
+		if (!batch_commands[c].verb) {
+			printf("error %d %s %s unknown command\n", lineno, verb,
+			       args[argc - 1]);
+			failed++;
+			continue;
+		}
+
+		dev = batch_open(&ctx, args[argc - 1]);
+		if (!dev) {
+			printf("error %d %s %s cannot open: %s\n", lineno, verb,
+			       args[argc - 1], strerror(errno));
+			failed++;
+			continue;
+		}
+
+		ctx.result[0] = '\0';
+		if (batch_commands[c].func(&ctx, dev, argc - 3, args + 2)) {
+			printf("error %d %s %s %s\n", lineno, verb, dev->path,
+			       ctx.result);
+			failed++;
+		} else {
+			printf("ok %d %s %s %s\n", lineno, verb, dev->path,
+			       ctx.result);
+		}
+		fflush(stdout);
+	}
+
+	for (i = 0; i < ctx.ndevs; i++) {
+		close(ctx.devs[i].fd);
+		free(ctx.devs[i].path);
+	}
+	if (script != stdin)
+		fclose(script);
+
+	return failed ? 1 : 0;
+}
+
+/* Seconds a sample may be put off while the block queue is busy,
+   it is skipped after that */
+#define HEALTH_MAX_DEFER	10
+
+/* Upper bound, in percent, of a DEVICE_LIFE_TIME_EST step */
+static int life_time_percent(__u8 est)
+{
+	if (est >= 0x01 && est <= 0x0b)
+		return est * 10;
+	return -1;
+}
+
+/* Requests in flight on the block queue of an mmcblk device, -1 if
+ * unknown. Partitions and the boot/rpmb areas share the queue of the
+ * main device.
+ */
+static int block_queue_inflight(const char *device)
+{
+	char path[64];
+	unsigned int reads, writes;
+	int idx, n;
+	FILE *f;
+
+	idx = mmc_parent_device(device, NULL, 0);
+	if (idx < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/block/mmcblk%d/inflight", idx);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	n = fscanf(f, "%u %u", &reads, &writes);
+	fclose(f);
+
+	return n == 2 ? (int)(reads + writes) : -1;
+}
+
+static void health_event(FILE *out, time_t now, const char *what, int value)
+{
+	fprintf(out, "e,%ld,%s,%d\n", (long)now, what, value);
+	fprintf(stderr, "mmc health: %s reached %d\n", what, value);
+}
+
+int do_health_monitor(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	__u32 status;
+	int fd, interval, threshold;
+	int last_a = -1, last_b = -1, last_eol = -1;
+	char *device, path[PATH_MAX];
+	FILE *out;
+
+	CHECK(nargs != 5, "Usage: mmc health monitor <interval seconds> <wear threshold %%> <output file|-> </path/to/mmcblkX>\n",
+			exit(1));
+
+	interval = strtol(argv[1], NULL, 0);
+	threshold = strtol(argv[2], NULL, 0);
+	device = argv[4];
+
+	if (interval <= 0 || threshold <= 0) {
+		fprintf(stderr, "interval and threshold must be positive\n");
+		exit(1);
+	}
+
+	/* by-name links hide the mmcblkN the queue state is read from */
+	if (!realpath(device, path)) {
+		perror("realpath");
+		exit(1);
+	}
+	if (block_queue_inflight(path) < 0) {
+		fprintf(stderr, "Could not read the queue state of %s\n", path);
+		exit(1);
+	}
+
+	if (0 == strcmp(argv[3], "-"))
+		out = stdout;
+	else {
+		out = fopen(argv[3], "a");
+		if (!out) {
+			perror("can't open output file");
+			exit(1);
+		}
+	}
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	for (;;) {
+		int deferred, busy, life_a, life_b, eol;
+		time_t now;
+
+		/* do not compete with real I/O for the bus */
+		busy = block_queue_inflight(path) > 0;
+		for (deferred = 0; busy && deferred < HEALTH_MAX_DEFER; deferred++) {
+			sleep(1);
+			busy = block_queue_inflight(path) > 0;
+		}
+		if (busy) {
+			sleep(interval);
+			continue;
+		}
+
+		extcsd_cache_invalidate();
+		if (read_extcsd(fd, ext_csd)) {
+			fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+			sleep(interval);
+			continue;
+		}
+		if (send_status(fd, &status))
+			status = 0;
+
+		now = time(NULL);
+		if (ext_csd[EXT_CSD_REV] >= EXT_CSD_REV_V5_0) {
+			life_a = life_time_percent(ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_A]);
+			life_b = life_time_percent(ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_B]);
+			eol = ext_csd[EXT_CSD_PRE_EOL_INFO];
+		} else {
+			life_a = life_b = eol = -1;
+		}
+
+		fprintf(out, "s,%ld,%d,%d,%d,%d,0x%08x\n", (long)now,
+			life_a, life_b, eol,
+			ext_csd[EXT_CSD_BKOPS_STATUS] & 0x3, status);
+
+		if (life_a >= threshold && last_a < threshold)
+			health_event(out, now, "life_a", life_a);
+		if (life_b >= threshold && last_b < threshold)
+			health_event(out, now, "life_b", life_b);
+		if (eol > 1 && eol != last_eol)
+			health_event(out, now, "pre_eol", eol);
+
+		last_a = life_a;
+		last_b = life_b;
+		last_eol = eol;
+
+		fflush(out);
+		sleep(interval);
+	}
+
+	return 0;
+}
+
+#define BENCH_BUCKETS		32	/* log2 microseconds */
+#define BENCH_MAX_DEPTH		64
+
+struct bench_job {
+	int fd;
+	int write;
+	int random;
+	size_t block;
+	unsigned long long size;	/* usable bytes of the device */
+	unsigned long long total;	/* requests to issue, all threads */
+	unsigned long long next;	/* next request, shared */
+	unsigned int fsync_every;
+	int failed;
+};
+
+struct bench_worker {
+	pthread_t thread;
+	struct bench_job *job;
+	unsigned int seed;
+	unsigned long long done;
+	unsigned long long usecs;
+	unsigned long long max_usecs;
+	unsigned long long hist[BENCH_BUCKETS];
+};
+
+static void *bench_worker_run(void *arg)
+{
+	struct bench_worker *w = arg;
+	struct bench_job *job = w->job;
+	unsigned long long blocks = job->size / job->block;
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, job->block)) {
+		job->failed = ENOMEM;
+		return NULL;
+	}
+	memset(buf, 0xa5, job->block);
+
+	for (;;) {
+		unsigned long long n = __sync_fetch_and_add(&job->next, 1);
+		unsigned long long start, lat;
+		off_t offset;
+		ssize_t r;
+		int bucket = 0;
+
+		if (n >= job->total || job->failed)
+			break;
+
+		if (job->random)
+			offset = (off_t)(((unsigned long long)rand_r(&w->seed) << 16 ^
+					  rand_r(&w->seed)) % blocks) * job->block;
+		else
+			offset = (off_t)(n % blocks) * job->block;
+
+		start = now_usecs();
+		if (job->write)
+			r = pwrite(job->fd, buf, job->block, offset);
+		else
+			r = pread(job->fd, buf, job->block, offset);
+		if (r != (ssize_t)job->block) {
+			job->failed = r < 0 ? errno : EIO;
+			break;
+		}
+		w->done++;
+		if (job->write && job->fsync_every && w->done % job->fsync_every == 0)
+			fsync(job->fd);
+		lat = now_usecs() - start;
+
+		w->usecs += lat;
+		if (lat > w->max_usecs)
+			w->max_usecs = lat;
+		while (bucket < BENCH_BUCKETS - 1 && lat >= (1ULL << bucket))
+			bucket++;
+		w->hist[bucket]++;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Latency below which pct percent of the requests completed */
+static unsigned long long bench_percentile(const unsigned long long *hist,
+					   unsigned long long count, int pct)
+{
+	unsigned long long seen = 0, want = (count * pct + 99) / 100;
+	int i;
+
+	for (i = 0; i < BENCH_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= want)
+			return 1ULL << i;
+	}
+
+	return 1ULL << (BENCH_BUCKETS - 1);
+}
+
+/* Prints the EXT_CSD settings a benchmark result depends on */
+static void bench_print_config(const char *device)
+{
+	static const char * const names[] = {
+		"ext_csd_rev", "cache_size_kib", "cache_ctrl", "bkops_en",
+		"wr_rel_set", "partitions_attribute", "partition_config", NULL
+	};
+	char parent[PATH_MAX];
+	__u8 ext_csd[512];
+	char value[64];
+	int i, fd, ret = -1;
+
+	if (mmc_parent_device(device, parent, sizeof(parent)) >= 0) {
+		fd = open(parent, O_RDONLY);
+		if (fd >= 0) {
+			ret = read_extcsd(fd, ext_csd);
+			close(fd);
+		}
+	}
+	if (ret) {
+		printf("config: none\n");
+		return;
+	}
+
+	printf("config:");
+	for (i = 0; names[i]; i++) {
+		const struct extcsd_field *f = extcsd_field_find(names[i]);
+
+		if (!f || !extcsd_field_present(f, ext_csd))
+			continue;
+		if (extcsd_field_value(f, ext_csd, value, sizeof(value))) {
+			value[strlen(value) - 1] = '\0';
+			printf(" %s=%s", f->name, value + 1);
+		} else {
+			printf(" %s=%s", f->name, value);
+		}
+	}
+	printf("\n");
+}
+
+int do_bench(int nargs, char **argv)
+{
+	struct bench_job job;
+	struct bench_worker *workers;
+	unsigned long long hist[BENCH_BUCKETS];
+	unsigned long long done = 0, usecs = 0, max_usecs = 0, elapsed;
+	unsigned long long total_mib;
+	const char *pattern;
+	char *device;
+	struct stat st;
+	int depth, i, dry_run = 1;
+
+	CHECK(nargs != 8, "Usage: mmc bench <-y|-n> <seqread|seqwrite|randread|randwrite> "
+			  "<block KiB> <queue depth> <total MiB> <fsync every> </path/to/mmcblkX>\n",
+			  exit(1));
+
+	if (!strcmp("-y", argv[1]))
+		dry_run = 0;
+
+	memset(&job, 0, sizeof(job));
+	pattern = argv[2];
+	if (!strcmp(pattern, "seqread"))
+		;
+	else if (!strcmp(pattern, "seqwrite"))
+		job.write = 1;
+	else if (!strcmp(pattern, "randread"))
+		job.random = 1;
+	else if (!strcmp(pattern, "randwrite"))
+		job.write = job.random = 1;
+	else {
+		fprintf(stderr, "Unknown pattern %s\n", pattern);
+		exit(1);
+	}
+
+	job.block = strtoul(argv[3], NULL, 0) * 1024;
+	depth = strtol(argv[4], NULL, 0);
+	total_mib = strtoull(argv[5], NULL, 0);
+	job.fsync_every = strtoul(argv[6], NULL, 0);
+	device = argv[7];
+
+	if (!job.block || depth <= 0 || depth > BENCH_MAX_DEPTH || !total_mib) {
+		fprintf(stderr, "block size, queue depth (1-%d) and total size must be positive\n",
+			BENCH_MAX_DEPTH);
+		exit(1);
+	}
+
+	if (job.write && dry_run) {
+		fprintf(stderr, "%s overwrites %s, pass -y to run it\n", pattern, device);
+		exit(1);
+	}
+
+	job.fd = open(device, (job.write ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (job.fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	if (fstat(job.fd, &st)) {
+		perror("fstat");
+		exit(1);
+	}
+	if (S_ISBLK(st.st_mode)) {
+		__u64 bytes;
+
+		if (ioctl(job.fd, BLKGETSIZE64, &bytes)) {
+			perror("BLKGETSIZE64");
+			exit(1);
+		}
+		job.size = bytes;
+	} else {
+		job.size = st.st_size;
+	}
+
+	if (job.size < job.block) {
+		fprintf(stderr, "%s is smaller than one block\n", device);
+		exit(1);
+	}
+	job.total = total_mib * 1024 * 1024 / job.block;
+	if (!job.total)
+		job.total = 1;
+
+	workers = calloc(depth, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Could not allocate %d workers\n", depth);
+		exit(1);
+	}
+
+	if (S_ISBLK(st.st_mode))
+		bench_print_config(device);
+	else
+		printf("config: none\n");
+
+	elapsed = now_usecs();
+	for (i = 0; i < depth; i++) {
+		workers[i].job = &job;
+		workers[i].seed = (unsigned int)elapsed + i;
+		if (pthread_create(&workers[i].thread, NULL, bench_worker_run, &workers[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < depth; i++) {
+		int b;
+
+		pthread_join(workers[i].thread, NULL);
+		done += workers[i].done;
+		usecs += workers[i].usecs;
+		if (workers[i].max_usecs > max_usecs)
+			max_usecs = workers[i].max_usecs;
+		for (b = 0; b < BENCH_BUCKETS; b++)
+			hist[b] += workers[i].hist[b];
+	}
+	if (job.write)
+		fsync(job.fd);
+	elapsed = now_usecs() - elapsed;
+	if (!elapsed)
+		elapsed = 1;
+
+	if (job.failed)
+		fprintf(stderr, "I/O failed: %s\n", strerror(job.failed));
+
+	printf("%s: %llu requests of %zu KiB, depth %d, fsync every %u\n",
+	       pattern, done, job.block / 1024, depth, job.fsync_every);
+	printf("throughput: %.2f MiB/s, %.0f IOPS\n",
+	       (double)done * job.block / (1024 * 1024) / (elapsed / 1e6),
+	       done / (elapsed / 1e6));
+	if (done) {
+		printf("latency us: avg %llu p50 <%llu p99 <%llu max %llu\n",
+		       usecs / done, bench_percentile(hist, done, 50),
+		       bench_percentile(hist, done, 99), max_usecs);
+		for (i = 0; i < BENCH_BUCKETS; i++)
+			if (hist[i])
+				printf("  <%llu us: %llu\n", 1ULL << i, hist[i]);
+	}
+
+	free(workers);
+	close(job.fd);
+
+	return job.failed ? 1 : 0;
+}
+
+#define ALIGN_MAX_PARTS		128
+#define ALIGN_BY_NAME_DIR	"/dev/block/platform"
+
+struct align_part {
+	unsigned int num;
+	char name[37];
+	unsigned long long start;	/* 512 byte sectors */
+	unsigned long long count;
+};
+
+/* Table fields sit at arbitrary offsets, never load them through a cast */
+static __u32 align_get_le32(const __u8 *p)
+{
+	__u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static __u64 align_get_le64(const __u8 *p)
+{
+	__u64 v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static int align_read_sector(int fd, unsigned long long lba, __u8 *buf)
+{
+	return pread(fd, buf, 512, (off_t)lba * 512) == 512 ? 0 : -1;
+}
+
+/* GPT entries, or the primary MBR entries when there is no GPT */
+static int align_read_table(int fd, struct align_part *parts, const char **scheme)
+{
+	__u8 sector[512], mbr[512];
+	unsigned long long entries_lba;
+	unsigned int count, size, i, n = 0;
+
+	if (align_read_sector(fd, 0, mbr) || mbr[510] != 0x55 || mbr[511] != 0xaa)
+		return -1;
+
+	if (!align_read_sector(fd, 1, sector) && !memcmp(sector, "EFI PART", 8)) {
+		__u8 *entries;
+
+		entries_lba = align_get_le64(&sector[72]);
+		count = align_get_le32(&sector[80]);
+		size = align_get_le32(&sector[84]);
+		if (size < 128 || size > 512 || size % 8 ||
+		    count > ALIGN_MAX_PARTS * 4)
+			return -1;
+
+		entries = malloc(count * size + 512);
+		if (!entries)
+			return -1;
+		for (i = 0; i < (count * size + 511) / 512; i++)
+			if (align_read_sector(fd, entries_lba + i, entries + i * 512)) {
+				free(entries);
+				return -1;
+			}
+
+		for (i = 0; i < count && n < ALIGN_MAX_PARTS; i++) {
+			__u8 *e = entries + i * size;
+			unsigned long long first = align_get_le64(&e[32]);
+			unsigned long long last = align_get_le64(&e[40]);
+			int c;
+
+			if (!first && !last)
+				continue;
+
+			parts[n].num = i + 1;
+			parts[n].start = first;
+			parts[n].count = last - first + 1;
+			/* UTF-16LE name, ASCII is enough for eMMC layouts */
+			for (c = 0; c < 36; c++)
+				parts[n].name[c] = e[56 + c * 2];
+			parts[n].name[36] = '\0';
+			n++;
+		}
+		free(entries);
+		*scheme = "GPT";
+		return n;
+	}
+
+	for (i = 0; i < 4; i++) {
+		__u8 *e = &mbr[446 + i * 16];
+
+		if (!e[4])
+			continue;
+		parts[n].num = i + 1;
+		parts[n].name[0] = '\0';
+		parts[n].start = align_get_le32(&e[8]);
+		parts[n].count = align_get_le32(&e[12]);
+		n++;
+	}
+	*scheme = "MBR";
+	return n;
+}
+
+/* Names partitions without one from the by-name links of the platform */
+static void align_by_name(const char *device, struct align_part *parts, int n)
+{
+	char dir[PATH_MAX], link[PATH_MAX], target[PATH_MAX];
+	const char *base = strrchr(device, '/');
+	struct dirent *plat, *ent;
+	DIR *pd, *bd;
+	int i;
+
+	base = base ? base + 1 : device;
+
+	pd = opendir(ALIGN_BY_NAME_DIR);
+	if (!pd)
+		return;
+
+	while ((plat = readdir(pd))) {
+		if (plat->d_name[0] == '.')
+			continue;
+		snprintf(dir, sizeof(dir), ALIGN_BY_NAME_DIR "/%s/by-name",
+			 plat->d_name);
+		bd = opendir(dir);
+		if (!bd)
+			continue;
+
+		while ((ent = readdir(bd))) {
+			ssize_t len;
+			const char *t;
+			unsigned int num;
+
+			if (ent->d_name[0] == '.')
+				continue;
+			if (snprintf(link, sizeof(link), "%s/%s", dir,
+				     ent->d_name) >= (int)sizeof(link))
+				continue;
+			len = readlink(link, target, sizeof(target) - 1);
+			if (len <= 0)
+				continue;
+			target[len] = '\0';
+
+			t = strrchr(target, '/');
+			t = t ? t + 1 : target;
+			if (strncmp(t, base, strlen(base)) || t[strlen(base)] != 'p' ||
+			    sscanf(t + strlen(base) + 1, "%u", &num) != 1)
+				continue;
+
+			for (i = 0; i < n; i++)
+				if (parts[i].num == num && !parts[i].name[0])
+					snprintf(parts[i].name, sizeof(parts[i].name),
+						 "%.36s", ent->d_name);
+		}
+		closedir(bd);
+	}
+	closedir(pd);
+}
+
+/*
+ * Erase group of the card behind a device path, in bytes: the high
+ * capacity one from EXT_CSD when ERASE_GROUP_DEF is set, else the one
+ * the kernel uses. 0 if neither can be read.
+ */
+static unsigned long long mmc_erase_group(const char *device)
+{
+	char parent[PATH_MAX];
+	__u8 ext_csd[512];
+	unsigned long long grp = 0;
+	unsigned int size;
+	int idx, fd;
+	FILE *f;
+
+	idx = mmc_parent_device(device, parent, sizeof(parent));
+	if (idx < 0)
+		return 0;
+
+	fd = open(parent, O_RDONLY);
+	if (fd >= 0) {
+		if (!read_extcsd(fd, ext_csd) &&
+		    (ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 1))
+			grp = get_hc_erase_grp_size(ext_csd) * 512 * 1024ULL;
+		close(fd);
+	}
+	if (grp)
+		return grp;
+
+	snprintf(parent, sizeof(parent), "/sys/block/mmcblk%d/device/erase_size", idx);
+	f = fopen(parent, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%u", &size) == 1)
+		grp = size;
+	fclose(f);
+
+	return grp;
+}
+
+static unsigned long long align_up(unsigned long long v, unsigned long long a)
+{
+	return (v + a - 1) / a * a;
+}
+
+int do_align(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	struct align_part *parts;
+	unsigned long long erase_grp, wp_grp, native, next = 0;
+	const char *scheme = NULL;
+	char *device;
+	int fd, n, i, misaligned = 0;
+
+	CHECK(nargs != 2, "Usage: mmc align </path/to/mmcblkX>\n", exit(1));
+
+	device = argv[1];
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	if (read_extcsd(fd, ext_csd)) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	/* All in 512 byte sectors */
+	erase_grp = mmc_erase_group(device) / 512;
+	if (!erase_grp) {
+		fprintf(stderr, "Could not read the erase group size of %s\n",
+			device);
+		exit(1);
+	}
+	wp_grp = erase_grp;
+	if ((ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 1) && get_hc_wp_grp_size(ext_csd))
+		wp_grp *= get_hc_wp_grp_size(ext_csd);
+	native = (ext_csd[EXT_CSD_REV] >= EXT_CSD_REV_V4_5 &&
+		  ext_csd[EXT_CSD_NATIVE_SECTOR_SIZE] == 1) ? 8 : 1;
+
+	parts = calloc(ALIGN_MAX_PARTS, sizeof(*parts));
+	if (!parts) {
+		fprintf(stderr, "Could not allocate partition table\n");
+		exit(1);
+	}
+
+	n = align_read_table(fd, parts, &scheme);
+	if (n < 0) {
+		fprintf(stderr, "No GPT or MBR found on %s\n", device);
+		exit(1);
+	}
+	align_by_name(device, parts, n);
+
+	printf("%s: %s, %d partitions\n", device, scheme, n);
+	printf("erase group %llu KiB, WP group %llu KiB, native sector %llu B\n\n",
+	       erase_grp / 2, wp_grp / 2, native * 512);
+	printf("%-4s %-20s %12s %12s  %-16s %12s %12s\n", "num", "name",
+	       "start", "sectors", "misaligned", "start'", "sectors'");
+
+	for (i = 0; i < n; i++) {
+		struct align_part *p = &parts[i];
+		char flags[32] = "";
+		unsigned long long start, count;
+
+		if (p->start % native || p->count % native)
+			strcat(flags, "native,");
+		if (p->start % erase_grp || p->count % erase_grp)
+			strcat(flags, "erase,");
+		if (p->start % wp_grp)
+			strcat(flags, "wp,");
+		if (flags[0]) {
+			flags[strlen(flags) - 1] = '\0';
+			misaligned++;
+		}
+
+		/* suggestion: keep the order, start on an erase group and
+		 * never shrink a partition */
+		start = align_up(p->start > next ? p->start : next, erase_grp);
+		count = align_up(p->count, erase_grp);
+		next = start + count;
+
+		printf("%-4u %-20s %12llu %12llu  %-16s %12llu %12llu\n",
+		       p->num, p->name[0] ? p->name : "-", p->start, p->count,
+		       flags[0] ? flags : "-", start, count);
+	}
+
+	if (next > get_sector_count(ext_csd) && get_sector_count(ext_csd))
+		printf("\nthe suggested layout needs %llu sectors more than the user area has\n",
+		       next - get_sector_count(ext_csd));
+
+	printf("\n%d of %d partitions misaligned\n", misaligned, n);
+
+	free(parts);
+	close(fd);
+
+	return misaligned ? 2 : 0;
+}
+
+#define DISCARD_MAX_THREADS	16
+
+struct discard_range {
+	unsigned long long start;	/* bytes, relative to the partition */
+	unsigned long long len;
+};
+
+struct discard_job {
+	int fd;
+	unsigned long request;
+	struct discard_range *batches;
+	unsigned int count;
+	unsigned int next;		/* next batch, shared */
+	unsigned long long rate;	/* bytes per second, 0 = unlimited */
+	unsigned long long total;
+	pthread_mutex_t lock;
+	unsigned long long slot;	/* rate limiter, usecs */
+	unsigned long long done;
+	unsigned long long last_print;
+	int failed;
+};
+
+static int discard_range_cmp(const void *a, const void *b)
+{
+	const struct discard_range *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Lines that do not parse are reported and left out */
+static int discard_read_extents(FILE *in, struct discard_range **out)
+{
+	struct discard_range *r = NULL, *tmp;
+	unsigned int n = 0, size = 0, lineno = 0, bad = 0;
+	char line[128];
+
+	while (fgets(line, sizeof(line), in)) {
+		unsigned long long start, len;
+		char *end, *next;
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		start = strtoull(line, &end, 0);
+		len = strtoull(end, &next, 0);
+		while (isspace((unsigned char)*next))
+			next++;
+		if (end == line || next == end || *next || !len) {
+			fprintf(stderr, "extents line %u: cannot parse \"%.*s\"\n",
+				lineno, (int)strcspn(line, "\n"), line);
+			bad++;
+			continue;
+		}
+
+		if (n == size) {
+			size = size ? size * 2 : 256;
+			tmp = realloc(r, size * sizeof(*r));
+			if (!tmp) {
+				free(r);
+				return -1;
+			}
+			r = tmp;
+		}
+		r[n].start = start;
+		r[n].len = len;
+		n++;
+	}
+
+	if (bad)
+		fprintf(stderr, "%u extent lines skipped\n", bad);
+
+	*out = r;
+	return n;
+}
+
+/*
+ * Merges overlapping and adjacent extents, then trims each one to whole
+ * erase groups of the device (grp_off is the partition offset in bytes,
+ * so the alignment is absolute) and splits it into batches.
+ */
+static int discard_plan(struct discard_range *ext, int n, unsigned long long grp,
+			unsigned long long grp_off, unsigned long long batch,
+			struct discard_range **out)
+{
+	struct discard_range *b = NULL, *tmp;
+	unsigned int count = 0, size = 0;
+	int i, m = 0;
+
+	if (!n) {
+		*out = NULL;
+		return 0;
+	}
+
+	qsort(ext, n, sizeof(*ext), discard_range_cmp);
+	for (i = 1; i < n; i++) {
+		if (ext[i].start <= ext[m].start + ext[m].len) {
+			unsigned long long end = ext[i].start + ext[i].len;
+
+			if (end > ext[m].start + ext[m].len)
+				ext[m].len = end - ext[m].start;
+		} else {
+			ext[++m] = ext[i];
+		}
+	}
+	n = m + 1;
+
+	for (i = 0; i < n; i++) {
+		unsigned long long start = ext[i].start + grp_off;
+		unsigned long long end = start + ext[i].len;
+
+		start = (start + grp - 1) / grp * grp;
+		end = end / grp * grp;
+
+		while (start < end) {
+			unsigned long long len = end - start < batch ? end - start : batch;
+
+			if (count == size) {
+				size = size ? size * 2 : 256;
+				tmp = realloc(b, size * sizeof(*b));
+				if (!tmp) {
+					free(b);
+					return -1;
+				}
+				b = tmp;
+			}
+			b[count].start = start - grp_off;
+			b[count].len = len;
+			count++;
+			start += len;
+		}
+	}
+
+	*out = b;
+	return count;
+}
+
+static void *discard_worker_run(void *arg)
+{
+	struct discard_job *job = arg;
+
+	for (;;) {
+		unsigned int n = __sync_fetch_and_add(&job->next, 1);
+		unsigned long long range[2], now, wait = 0;
+
+		if (n >= job->count || job->failed)
+			break;
+
+		range[0] = job->batches[n].start;
+		range[1] = job->batches[n].len;
+
+		if (job->rate) {
+			pthread_mutex_lock(&job->lock);
+			now = now_usecs();
+			if (job->slot < now)
+				job->slot = now;
+			wait = job->slot - now;
+			job->slot += range[1] * 1000000 / job->rate;
+			pthread_mutex_unlock(&job->lock);
+			if (wait)
+				usleep(wait);
+		}
+
+		if (ioctl(job->fd, job->request, range) < 0) {
+			job->failed = errno;
+			break;
+		}
+
+		pthread_mutex_lock(&job->lock);
+		job->done += range[1];
+		now = now_usecs();
+		if (now - job->last_print >= 500000 || job->done == job->total) {
+			fprintf(stderr, "\r%llu/%llu MiB", job->done >> 20,
+				job->total >> 20);
+			job->last_print = now;
+		}
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Offset in bytes of a resolved mmcblkXpY partition, 0 for a whole
+ * mmcblkX. Returns -1 for anything else or when sysfs has no start.
+ */
+static int discard_part_offset(const char *device, unsigned long long *offset)
+{
+	char path[PATH_MAX];
+	const char *name = strrchr(device, '/');
+	unsigned long long start;
+	int idx, part, len = 0, ret = -1;
+	FILE *f;
+
+	name = name ? name + 1 : device;
+	if (sscanf(name, "mmcblk%d%n", &idx, &len) == 1 && !name[len]) {
+		*offset = 0;
+		return 0;
+	}
+	len = 0;
+	if (sscanf(name, "mmcblk%dp%d%n", &idx, &part, &len) != 2 || name[len])
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%.64s/start", name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%llu", &start) == 1) {
+		*offset = start * 512;
+		ret = 0;
+	}
+	fclose(f);
+
+	return ret;
+}
+
+int do_discard(int nargs, char **argv)
+{
+	struct discard_job job;
+	struct discard_range *ext = NULL;
+	pthread_t threads[DISCARD_MAX_THREADS];
+	unsigned long long grp, offset, batch, elapsed, part_size = 0;
+	const char *extents;
+	char *device, path[PATH_MAX];
+	FILE *in;
+	int n, i, nthreads, dry_run = 1;
+
+	CHECK(nargs != 8, "Usage: mmc discard <-y|-n> <discard|secdiscard> <batch MiB> "
+			  "<threads> <MiB/s> <extents|-> </path/to/mmcblkXpY>\n",
+			  exit(1));
+
+	if (!strcmp("-y", argv[1]))
+		dry_run = 0;
+
+	memset(&job, 0, sizeof(job));
+	if (!strcmp(argv[2], "discard"))
+		job.request = BLKDISCARD;
+	else if (!strcmp(argv[2], "secdiscard"))
+		job.request = BLKSECDISCARD;
+	else {
+		fprintf(stderr, "Unknown discard type %s\n", argv[2]);
+		exit(1);
+	}
+
+	batch = strtoull(argv[3], NULL, 0) << 20;
+	nthreads = strtol(argv[4], NULL, 0);
+	job.rate = strtoull(argv[5], NULL, 0) << 20;
+	extents = argv[6];
+	device = argv[7];
+
+	if (!batch || nthreads <= 0 || nthreads > DISCARD_MAX_THREADS) {
+		fprintf(stderr, "batch size and threads (1-%d) must be positive\n",
+			DISCARD_MAX_THREADS);
+		exit(1);
+	}
+
+	/* by-name links hide the card and partition the geometry comes from */
+	if (!realpath(device, path)) {
+		perror("realpath");
+		exit(1);
+	}
+	grp = mmc_erase_group(path);
+	if (!grp) {
+		fprintf(stderr, "Could not read the erase group of %s\n", path);
+		exit(1);
+	}
+	if (discard_part_offset(path, &offset)) {
+		fprintf(stderr, "Could not read the partition offset of %s\n", path);
+		exit(1);
+	}
+	if (batch < grp)
+		batch = grp;
+	batch = batch / grp * grp;
+
+	in = strcmp(extents, "-") ? fopen(extents, "r") : stdin;
+	if (!in) {
+		perror("open extents");
+		exit(1);
+	}
+	n = discard_read_extents(in, &ext);
+	if (in != stdin)
+		fclose(in);
+	if (n >= 0)
+		n = discard_plan(ext, n, grp, offset, batch, &job.batches);
+	free(ext);
+	if (n < 0) {
+		fprintf(stderr, "Could not allocate the extent list\n");
+		exit(1);
+	}
+	job.count = n;
+	for (i = 0; i < n; i++)
+		job.total += job.batches[i].len;
+
+	/* O_EXCL on a block device fails while a filesystem holds it */
+	job.fd = open(device, dry_run ? O_RDONLY : O_WRONLY | O_EXCL);
+	if (job.fd < 0 && errno == EBUSY) {
+		fprintf(stderr, "%s is in use, trim mounted filesystems with FITRIM (fstrim)\n",
+			device);
+		exit(1);
+	}
+	if (job.fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	if (ioctl(job.fd, BLKGETSIZE64, &part_size) == 0 && n &&
+	    job.batches[n - 1].start + job.batches[n - 1].len > part_size) {
+		fprintf(stderr, "Extents run past the end of %s\n", device);
+		exit(1);
+	}
+
+	printf("%s: erase group %llu KiB, offset %llu, %u batches, %llu MiB\n",
+	       device, grp >> 10, offset, job.count, job.total >> 20);
+
+	if (dry_run) {
+		for (i = 0; i < n; i++)
+			printf("%llu %llu\n", job.batches[i].start, job.batches[i].len);
+		printf("dry run, pass -y to discard\n");
+		goto out;
+	}
+
+	pthread_mutex_init(&job.lock, NULL);
+	elapsed = now_usecs();
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, discard_worker_run, &job)) {
+			fprintf(stderr, "Could not start discard thread\n");
+			job.failed = EAGAIN;
+			break;
+		}
+	nthreads = i;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now_usecs() - elapsed;
+	pthread_mutex_destroy(&job.lock);
+
+	if (job.total)
+		fprintf(stderr, "\n");
+	if (job.failed) {
+		fprintf(stderr, "%s failed after %llu MiB: %s\n", argv[2],
+			job.done >> 20, strerror(job.failed));
+		exit(1);
+	}
+
+	printf("discarded %llu MiB in %llu.%03llu s\n", job.done >> 20,
+	       elapsed / 1000000, elapsed / 1000 % 1000);
+
+out:
+	free(job.batches);
+	close(job.fd);
+
+	return 0;
+}
+
+struct busy_op {
+	char name[16];
+	unsigned long long count;
+	unsigned long long usecs;
+	unsigned long long max_usecs;
+	unsigned long long hist[BENCH_BUCKETS];
+};
+
+/* the named operations plus a switch per EXT_CSD index */
+#define BUSY_MAX_OPS	(4 + 256)
+
+int do_busy_report(int nargs, char **argv)
+{
+	struct busy_op ops[BUSY_MAX_OPS];
+	unsigned long long ioctl_us, busy_us, lat;
+	unsigned int index, value, polls;
+	char line[256], name[16];
+	int nops = 0, dropped = 0, i;
+	FILE *log;
+
+	CHECK(nargs != 2, "Usage: mmc busy report <log>\n", exit(1));
+
+	log = fopen(argv[1], "r");
+	if (!log) {
+		perror("open");
+		exit(1);
+	}
+
+	memset(ops, 0, sizeof(ops));
+	while (fgets(line, sizeof(line), log)) {
+		struct busy_op *op = NULL;
+		int bucket = 0;
+
+		if (sscanf(line, "%15s %u %u %llu %llu %u", name, &index, &value,
+			   &ioctl_us, &busy_us, &polls) != 6)
+			continue;
+
+		/* plain switches are split by EXT_CSD index */
+		if (!strcmp(name, "switch"))
+			snprintf(name, sizeof(name), "switch[%u]", index);
+
+		for (i = 0; i < nops; i++)
+			if (!strcmp(ops[i].name, name))
+				op = &ops[i];
+		if (!op) {
+			if (nops == BUSY_MAX_OPS) {
+				dropped++;
+				continue;
+			}
+			op = &ops[nops++];
+			strcpy(op->name, name);
+		}
+
+		lat = ioctl_us + busy_us;
+		op->count++;
+		op->usecs += lat;
+		if (lat > op->max_usecs)
+			op->max_usecs = lat;
+		while (bucket < BENCH_BUCKETS - 1 && lat >= (1ULL << bucket))
+			bucket++;
+		op->hist[bucket]++;
+	}
+	fclose(log);
+
+	if (dropped)
+		fprintf(stderr, "more than %d operation types, %d records left out\n",
+			BUSY_MAX_OPS, dropped);
+
+	for (i = 0; i < nops; i++) {
+		struct busy_op *op = &ops[i];
+		int b;
+
+		printf("%s: %llu ops, avg %llu us, p50 %llu us, p99 %llu us, max %llu us\n",
+		       op->name, op->count, op->usecs / op->count,
+		       bench_percentile(op->hist, op->count, 50),
+		       bench_percentile(op->hist, op->count, 99), op->max_usecs);
+		for (b = 0; b < BENCH_BUCKETS; b++)
+			if (op->hist[b])
+				printf("  < %10llu us: %llu\n", 1ULL << b, op->hist[b]);
+	}
+
+	return 0;
+}
+
+#define BKOPS_POLL_MS		100
+#define BKOPS_LEVEL_CRITICAL	3
+
+/* I/Os completed and in flight, from /sys/block/mmcblkN/stat */
+static int bkops_queue_stat(int idx, unsigned long long *ios,
+			    unsigned int *inflight)
+{
+	char path[64];
+	unsigned long long rd, rd_merge, rd_sect, rd_ticks;
+	unsigned long long wr, wr_merge, wr_sect, wr_ticks;
+	int n;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/block/mmcblk%d/stat", idx);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	n = fscanf(f, "%llu %llu %llu %llu %llu %llu %llu %llu %u",
+		   &rd, &rd_merge, &rd_sect, &rd_ticks,
+		   &wr, &wr_merge, &wr_sect, &wr_ticks, inflight);
+	fclose(f);
+	if (n != 9)
+		return -1;
+
+	*ios = rd + wr;
+	return 0;
+}
+
+static int bkops_read_int(const char *path, int *value)
+{
+	FILE *f = fopen(path, "r");
+	int n;
+
+	if (!f)
+		return -1;
+	n = fscanf(f, "%d", value);
+	fclose(f);
+
+	return n == 1 ? 0 : -1;
+}
+
+/* Backlight off, or any mains/USB supply online */
+static int bkops_power_hint(void)
+{
+	char path[PATH_MAX], type[16];
+	struct dirent *ent;
+	DIR *dir;
+	FILE *f;
+	int value, hint = 0;
+
+	if (!bkops_read_int("/sys/class/leds/lcd-backlight/brightness", &value) &&
+	    !value)
+		return 1;
+
+	dir = opendir("/sys/class/power_supply");
+	if (!dir)
+		return 0;
+	while (!hint && (ent = readdir(dir))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/power_supply/%.200s/type",
+			 ent->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%15s", type) != 1)
+			type[0] = '\0';
+		fclose(f);
+		if (strcmp(type, "Mains") && strcmp(type, "USB"))
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/power_supply/%.200s/online",
+			 ent->d_name);
+		if (!bkops_read_int(path, &value) && value)
+			hint = 1;
+	}
+	closedir(dir);
+
+	return hint;
+}
+
+int do_bkops_daemon(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	unsigned long long ios, last_ios = 0, idle_since;
+	unsigned int inflight;
+	int fd, idx, idle_ms, min_level, level;
+	char *device, parent[PATH_MAX];
+
+	CHECK(nargs != 4, "Usage: mmc bkops daemon <idle ms> <min level> </path/to/mmcblkX>\n",
+			exit(1));
+
+	idle_ms = strtol(argv[1], NULL, 0);
+	min_level = strtol(argv[2], NULL, 0);
+	device = argv[3];
+
+	if (idle_ms <= 0 || min_level < 1 || min_level > BKOPS_LEVEL_CRITICAL) {
+		fprintf(stderr, "idle time must be positive and level 1-%d\n",
+			BKOPS_LEVEL_CRITICAL);
+		exit(1);
+	}
+
+	/* by-name links and partitions both map to the card's mmcblkN */
+	idx = mmc_parent_device(device, parent, sizeof(parent));
+	if (idx < 0) {
+		fprintf(stderr, "%s is not an mmcblk device\n", device);
+		exit(1);
+	}
+	device = parent;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	if (read_extcsd(fd, ext_csd)) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_BKOPS_SUPPORT] & 0x1)) {
+		fprintf(stderr, "%s doesn't support BKOPS\n", device);
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_BKOPS_EN] & BKOPS_ENABLE)) {
+		fprintf(stderr, "BKOPS_EN is not set on %s\n", device);
+		exit(1);
+	}
+	if (bkops_queue_stat(idx, &ios, &inflight)) {
+		fprintf(stderr, "Could not read the queue statistics of %s\n", device);
+		exit(1);
+	}
+
+	idle_since = now_usecs();
+	for (;;) {
+		usleep(BKOPS_POLL_MS * 1000);
+
+		if (bkops_queue_stat(idx, &ios, &inflight))
+			continue;
+		if (ios != last_ios || inflight) {
+			last_ios = ios;
+			idle_since = now_usecs();
+			continue;
+		}
+		if (now_usecs() - idle_since < (unsigned long long)idle_ms * 1000)
+			continue;
+
+		extcsd_cache_invalidate();
+		if (read_extcsd(fd, ext_csd)) {
+			fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+			idle_since = now_usecs();
+			continue;
+		}
+		level = ext_csd[EXT_CSD_BKOPS_STATUS] & 0x3;
+
+		if (level >= min_level &&
+		    (level == BKOPS_LEVEL_CRITICAL || bkops_power_hint())) {
+			unsigned long long start = now_usecs();
+
+			/*
+			 * BKOPS_START is an R1B SWITCH: the ioctl only returns
+			 * once the card leaves busy, which can take seconds,
+			 * and nothing here can cut it short (no HPI). I/O that
+			 * arrives meanwhile waits, which is why non critical
+			 * levels are only handled under a power hint.
+			 */
+			if (write_extcsd_value(fd, EXT_CSD_BKOPS_START, 1))
+				fprintf(stderr, "Could not start BKOPS on %s\n", device);
+			else
+				printf("%ld bkops level %d, %llu ms\n", (long)time(NULL),
+				       level, (now_usecs() - start) / 1000);
+			fflush(stdout);
+		}
+
+		/* our own CMD8 and SWITCH count as I/O, wait for the next window */
+		bkops_queue_stat(idx, &last_ios, &inflight);
+		idle_since = now_usecs();
+	}
+
+	return 0;
+}
@@ -35,5 +35,13 @@ int do_rpmb_write_key(int nargs, char **argv);
 int do_rpmb_read_counter(int nargs, char **argv);
 int do_rpmb_read_block(int nargs, char **argv);
 int do_rpmb_write_block(int nargs, char **argv);
+int do_rpmb_write_blocks(int nargs, char **argv);
 int do_cache_en(int nargs, char **argv);
 int do_cache_dis(int nargs, char **argv);
+int do_batch(int nargs, char **argv);
+int do_health_monitor(int nargs, char **argv);
+int do_bench(int nargs, char **argv);
+int do_align(int nargs, char **argv);
+int do_discard(int nargs, char **argv);
+int do_busy_report(int nargs, char **argv);
+int do_bkops_daemon(int nargs, char **argv);